@@ -0,0 +1,188 @@
+// kaldilm/csrc/arpa_cache.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/arpa_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include "kaldilm/csrc/arpa_file_parser.h"
+#include "kaldilm/csrc/log.h"
+
+namespace kaldilm {
+
+namespace {
+
+constexpr char kMagic[8] = {'K', 'L', 'M', 'C', 'A', 'C', 'H', 'E'};
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kByteOrderMark = 0x01020304;
+
+// Bit of ArpaCacheHeader::flags: the words are integers, not symbols.
+constexpr uint32_t kIntegerWords = 1;
+
+template <class T>
+void WriteArray(std::ostream &os, const T *data, std::size_t n) {
+  os.write(reinterpret_cast<const char *>(data), n * sizeof(T));
+}
+
+}  // namespace
+
+bool IsArpaCache(const char *data, std::size_t size) {
+  return size >= sizeof(kMagic) && memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+ArpaCacheWriter::ArpaCacheWriter(const std::string &filename,
+                                 const std::vector<int32_t> &ngram_counts,
+                                 int32_t num_cached_orders,
+                                 const fst::SymbolTable *symbols)
+    : filename_(filename),
+      os_(filename, std::ios::binary),
+      symbols_(symbols) {
+  if (!os_) KALDILM_ERR << "Failed to open " << filename << " for writing";
+
+  memset(&header_, 0, sizeof(header_));
+  memcpy(header_.magic, kMagic, sizeof(kMagic));
+  header_.version = kVersion;
+  header_.byte_order = kByteOrderMark;
+  header_.flags = symbols == nullptr ? kIntegerWords : 0;
+  header_.num_orders = ngram_counts.size();
+  header_.num_cached_orders = num_cached_orders;
+  // The vocabulary offset and size are filled in by Finish().
+  WriteArray(os_, &header_, 1);
+  WriteArray(os_, ngram_counts.data(), ngram_counts.size());
+  KALDILM_LOG << "Writing ARPA cache " << filename;
+}
+
+ArpaCacheWriter::~ArpaCacheWriter() {
+  if (os_.is_open()) Discard();
+}
+
+int32_t ArpaCacheWriter::VocabIndex(int32_t word) {
+  auto it = vocab_index_.find(word);
+  if (it != vocab_index_.end()) return it->second;
+  int32_t index = vocab_.size();
+  vocab_.push_back(word);
+  vocab_index_.emplace(word, index);
+  return index;
+}
+
+void ArpaCacheWriter::Write(const NGramBatch &batch) {
+  KALDILM_ASSERT(batch.order <=
+                 static_cast<int32_t>(header_.num_cached_orders));
+  int32_t order_and_size[2] = {batch.order, batch.Size()};
+  block_words_.resize(batch.words.size());
+  for (std::size_t i = 0; i != batch.words.size(); ++i) {
+    block_words_[i] = VocabIndex(batch.words[i]);
+  }
+  WriteArray(os_, order_and_size, 2);
+  WriteArray(os_, block_words_.data(), block_words_.size());
+  WriteArray(os_, batch.logprobs.data(), batch.logprobs.size());
+  WriteArray(os_, batch.backoffs.data(), batch.backoffs.size());
+  WriteArray(os_, batch.line_numbers.data(), batch.line_numbers.size());
+}
+
+void ArpaCacheWriter::Finish() {
+  int32_t end_of_blocks[2] = {0, 0};
+  WriteArray(os_, end_of_blocks, 2);
+
+  header_.vocab_offset = os_.tellp();
+  header_.vocab_size = vocab_.size();
+  std::string token;
+  for (int32_t word : vocab_) {
+    token = symbols_ != nullptr ? symbols_->Find(word) : std::to_string(word);
+    uint32_t length = token.size();
+    WriteArray(os_, &length, 1);
+    os_.write(token.data(), length);
+  }
+
+  os_.seekp(0);
+  WriteArray(os_, &header_, 1);
+  os_.close();
+  if (!os_) KALDILM_ERR << "Failed to write ARPA cache " << filename_;
+  KALDILM_LOG << "Wrote ARPA cache " << filename_ << " with "
+              << vocab_.size() << " words.";
+}
+
+void ArpaCacheWriter::Discard() {
+  os_.close();
+  std::remove(filename_.c_str());
+}
+
+ArpaCacheReader::ArpaCacheReader(const char *data, std::size_t size)
+    : data_(data) {
+  if (!IsArpaCache(data, size) || size < sizeof(header_)) {
+    KALDILM_ERR << "Not an ARPA cache";
+  }
+  memcpy(&header_, data, sizeof(header_));
+  if (header_.byte_order != kByteOrderMark) {
+    KALDILM_ERR << "The ARPA cache was written on a machine with another "
+                << "byte order";
+  }
+  if (header_.version != kVersion) {
+    KALDILM_ERR << "Unsupported ARPA cache version " << header_.version
+                << ", expected " << kVersion;
+  }
+
+  std::size_t counts_end =
+      sizeof(header_) + std::size_t(header_.num_orders) * sizeof(int32_t);
+  if (header_.num_orders == 0 ||
+      header_.num_cached_orders > header_.num_orders ||
+      header_.vocab_offset < counts_end || header_.vocab_offset > size) {
+    KALDILM_ERR << "Corrupted ARPA cache header";
+  }
+  ngram_counts_.resize(header_.num_orders);
+  memcpy(ngram_counts_.data(), data + sizeof(header_),
+         header_.num_orders * sizeof(int32_t));
+  for (int32_t count : ngram_counts_) {
+    if (count < 0) KALDILM_ERR << "Corrupted ARPA cache header";
+  }
+  next_block_ = counts_end;
+
+  // Integers are formatted back as tokens when the cache is written, so
+  // they are read as any other vocabulary.
+  const char *p = data + header_.vocab_offset;
+  const char *end = data + size;
+  vocab_.reserve(header_.vocab_size);
+  for (uint64_t i = 0; i != header_.vocab_size; ++i) {
+    uint32_t length;
+    if (end - p < static_cast<std::ptrdiff_t>(sizeof(length))) break;
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    if (static_cast<std::size_t>(end - p) < length) break;
+    vocab_.emplace_back(p, length);
+    p += length;
+  }
+  if (vocab_.size() != header_.vocab_size) {
+    KALDILM_ERR << "Corrupted ARPA cache vocabulary";
+  }
+}
+
+bool ArpaCacheReader::Next(Block *block) {
+  std::size_t left = header_.vocab_offset - next_block_;
+  if (left < 2 * sizeof(int32_t)) KALDILM_ERR << "Corrupted ARPA cache";
+  const int32_t *p = reinterpret_cast<const int32_t *>(data_ + next_block_);
+  block->order = p[0];
+  block->size = p[1];
+  if (block->order == 0) return false;
+
+  std::size_t block_bytes =
+      (2 + std::size_t(block->size) * (block->order + 3)) * sizeof(int32_t);
+  if (block->order < 0 ||
+      block->order > static_cast<int32_t>(header_.num_cached_orders) ||
+      block->size <= 0 || left < block_bytes) {
+    KALDILM_ERR << "Corrupted ARPA cache block at offset " << next_block_;
+  }
+  block->words = p + 2;
+  block->logprobs = reinterpret_cast<const float *>(
+      block->words + std::size_t(block->size) * block->order);
+  block->backoffs = block->logprobs + block->size;
+  block->line_numbers =
+      reinterpret_cast<const int32_t *>(block->backoffs + block->size);
+  next_block_ += block_bytes;
+  return true;
+}
+
+}  // namespace kaldilm
@@ -0,0 +1,146 @@
+// kaldilm/csrc/arpa_cache.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_ARPA_CACHE_H_
+#define KALDILM_CSRC_ARPA_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fst/symbol-table.h"
+#include "kaldilm/csrc/string_utils.h"
+
+namespace kaldilm {
+
+struct NGramBatch;
+
+/**
+   An ARPA cache holds the n-grams of an ARPA file in binary form, so that
+   compiling the same file again, e.g., with another symbol table, another
+   disambiguation symbol or a lower max_order, needs no text parsing.
+   ArpaFileParser writes one while parsing if ArpaParseOptions::cache_filename
+   is set, and Read(filename) accepts it in place of the ARPA file.
+
+   Words are kept as tokens rather than symbol ids, and they are mapped to
+   symbols while the cache is read, with the options of that read. All
+   numbers are in the byte order of the machine that wrote the file:
+
+     ArpaCacheHeader
+     int32   counts[num_orders]        // From the \data\ section.
+     blocks, each of a single order, in file order:
+       int32 order, int32 n
+       int32 words[n * order]          // Indexes into the vocabulary.
+       float logprobs[n]               // Natural log, as parsed.
+       float backoffs[n]
+       int32 line_numbers[n]           // Lines in the ARPA file.
+     int32 0, int32 0                  // End of blocks.
+     vocabulary, at vocab_offset:
+       vocab_size times: uint32 length, char token[length]
+
+   All arrays of a block are 4-byte aligned in a memory-mapped file.
+ */
+struct ArpaCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;  // kByteOrderMark as written.
+  uint32_t flags;
+  uint32_t num_orders;         // Orders in the \data\ section.
+  uint32_t num_cached_orders;  // Orders whose n-grams are in the cache.
+  uint32_t reserved;
+  uint64_t vocab_offset;
+  uint64_t vocab_size;
+};
+
+/// Return true if the buffer starts like an ARPA cache.
+bool IsArpaCache(const char *data, std::size_t size);
+
+/**
+   Writes the n-grams an ArpaFileParser delivers into an ARPA cache; see
+   ArpaCacheHeader. The blocks are written as they come, so only the
+   vocabulary is kept in memory.
+ */
+class ArpaCacheWriter {
+ public:
+  /// The file is created at once. If symbols is nullptr, the words of the
+  /// batches are integers of an ARPA file without a symbol table.
+  ArpaCacheWriter(const std::string &filename,
+                  const std::vector<int32_t> &ngram_counts,
+                  int32_t num_cached_orders, const fst::SymbolTable *symbols);
+
+  /// A file that is neither finished nor discarded, e.g., because reading
+  /// failed, is deleted.
+  ~ArpaCacheWriter();
+
+  ArpaCacheWriter(const ArpaCacheWriter &) = delete;
+  ArpaCacheWriter &operator=(const ArpaCacheWriter &) = delete;
+
+  /// Append a batch of n-grams as a block.
+  void Write(const NGramBatch &batch);
+
+  /// Write the vocabulary and complete the header. The symbol table passed
+  /// to the constructor must hold all the words of the batches by now.
+  void Finish();
+
+  /// Delete the partly written file.
+  void Discard();
+
+ private:
+  // Return the index of the word in the vocabulary, adding it if needed.
+  int32_t VocabIndex(int32_t word);
+
+  std::string filename_;
+  std::ofstream os_;
+  ArpaCacheHeader header_;
+  const fst::SymbolTable *symbols_;  // Not owned.
+
+  // Symbol ids or integers of the words, in the order of their indexes.
+  std::vector<int32_t> vocab_;
+  std::unordered_map<int32_t, int32_t> vocab_index_;
+  std::vector<int32_t> block_words_;  // Scratch space.
+};
+
+/**
+   Gives access to an ARPA cache in memory, e.g., a memory-mapped file. The
+   arrays of the blocks are used in place. The buffer must outlive it.
+ */
+class ArpaCacheReader {
+ public:
+  /// A block of n-grams of the same order. The pointers point into the
+  /// buffer.
+  struct Block {
+    int32_t order = 0;
+    int32_t size = 0;
+    const int32_t *words = nullptr;
+    const float *logprobs = nullptr;
+    const float *backoffs = nullptr;
+    const int32_t *line_numbers = nullptr;
+  };
+
+  /// Throw std::runtime_error if the buffer does not hold a valid cache.
+  ArpaCacheReader(const char *data, std::size_t size);
+
+  const std::vector<int32_t> &NgramCounts() const { return ngram_counts_; }
+  int32_t NumCachedOrders() const { return header_.num_cached_orders; }
+
+  /// Tokens of the words, indexed by the entries of Block::words.
+  const std::vector<StringPiece> &Vocabulary() const { return vocab_; }
+
+  /// Read the next block. Return false at the end of the blocks.
+  bool Next(Block *block);
+
+ private:
+  const char *data_;
+  ArpaCacheHeader header_;
+  std::vector<int32_t> ngram_counts_;
+  std::vector<StringPiece> vocab_;
+  std::size_t next_block_;  // Offset of the next block.
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_ARPA_CACHE_H_
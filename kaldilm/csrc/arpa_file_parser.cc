@@ -8,8 +8,24 @@
 
 #include "kaldilm/csrc/arpa_file_parser.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include "kaldilm/csrc/arpa_cache.h"
+#include "kaldilm/csrc/decompressing_stream.h"
+#include "kaldilm/csrc/flat_hash_map.h"
 #include "kaldilm/csrc/log.h"
+#include "kaldilm/csrc/mapped_file.h"
+#include "kaldilm/csrc/spsc_queue.h"
 #include "kaldilm/csrc/string_utils.h"
+#include "kaldilm/csrc/thread_pool.h"
 
 #ifndef M_LN10
 #define M_LN10 2.302585092994045684017991454684
@@ -24,11 +40,666 @@ ArpaFileParser::ArpaFileParser(const ArpaParseOptions &options,
       line_number_(0),
       warning_count_(0) {}
 
-static void TrimTrailingWhitespace(std::string *str) {
-  str->erase(str->find_last_not_of(" \n\r\t") + 1);
+// Yields lines of a stream one by one. The returned piece points into a
+// buffer owned by the reader and is valid until the next call to Next().
+class StreamLineReader {
+ public:
+  explicit StreamLineReader(std::istream &is, const char *name = "stream")
+      : is_(is), bytes_read_(0), name_(name) {}
+
+  bool Next(StringPiece *line) {
+    bool ok = getline(is_, buffer_) && !is_.eof();
+    bytes_read_ += buffer_.size() + (ok ? 1 : 0);
+    // Like the memory reader, expose an unterminated last line to the
+    // caller even though it is not returned as a line.
+    *line = StringPiece(buffer_.data(), buffer_.size());
+    return ok;
+  }
+
+  std::size_t BytesRead() const { return bytes_read_; }
+  const char *Name() const { return name_; }
+  // The returned lines are overwritten by the next call to Next().
+  bool LinesStayValid() const { return false; }
+
+ private:
+  std::istream &is_;
+  std::string buffer_;
+  std::size_t bytes_read_;
+  const char *name_;
+};
+
+// Yields lines of an in-memory buffer, e.g., a memory-mapped file, without
+// copying them. A last line without a trailing newline is not returned, to
+// match the behavior of getline() in StreamLineReader.
+class MemoryLineReader {
+ public:
+  MemoryLineReader(const char *data, std::size_t size, const char *name)
+      : begin_(data), cur_(data), end_(data + size), name_(name) {}
+
+  bool Next(StringPiece *line) {
+    if (cur_ == end_) {
+      *line = StringPiece(end_, end_);
+      return false;
+    }
+    const char *newline =
+        static_cast<const char *>(memchr(cur_, '\n', end_ - cur_));
+    if (newline == nullptr) {
+      // Keep the unterminated last line visible to LineReference().
+      *line = StringPiece(cur_, end_);
+      cur_ = end_;
+      return false;
+    }
+    *line = StringPiece(cur_, newline);
+    cur_ = newline + 1;
+    return true;
+  }
+
+  std::size_t BytesRead() const { return cur_ - begin_; }
+  const char *Name() const { return name_; }
+  bool LinesStayValid() const { return true; }
+
+  // The unread part of the buffer is [Position(), End()).
+  const char *Position() const { return cur_; }
+  const char *End() const { return end_; }
+  void Seek(const char *pos) { cur_ = pos; }
+
+ private:
+  const char *begin_;
+  const char *cur_;
+  const char *end_;
+  const char *name_;
+};
+
+namespace {
+
+// Number of bytes of an \N-grams: section parsed by one task in the parallel
+// mode. Large enough to amortize scheduling, small enough to balance load.
+constexpr std::size_t kParallelChunkBytes = 1 << 20;
+
+// Number of n-grams passed to one call of ConsumeNGrams().
+constexpr int32_t kNGramBatchSize = 4096;
+
+// FNV-1a, mixed so that its low bits can index a FlatHashMap.
+struct WordHash {
+  std::size_t operator()(const StringPiece &word) const {
+    uint64_t h = 14695981039346656037ULL;
+    for (char c : word) {
+      h ^= static_cast<unsigned char>(c);
+      h *= 1099511628211ULL;
+    }
+    return MixHash(h);
+  }
+};
+
+StringPiece TrimTrailingWhitespace(const StringPiece &str) {
+  const char *end = str.end();
+  while (end != str.begin() && (end[-1] == ' ' || end[-1] == '\n' ||
+                                end[-1] == '\r' || end[-1] == '\t')) {
+    --end;
+  }
+  return StringPiece(str.begin(), end);
+}
+
+bool IsBlank(const StringPiece &line) {
+  for (char c : line) {
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') return false;
+  }
+  return true;
+}
+
+// Return the "\N-grams:" keyword that starts the section of the given order.
+std::string SectionKeyword(int32_t order) {
+  std::ostringstream keyword;
+  keyword << "\\" << order << "-grams:";
+  return keyword.str();
 }
 
+// Return true if line, with trailing whitespace removed, terminates the
+// \N-grams: section of the given order.
+bool IsSectionEnd(const StringPiece &line, int32_t order) {
+  return line == "\\end\\" || line == SectionKeyword(order + 1);
+}
+
+// Return the start of the line terminating the n-gram section that begins
+// at `begin`. If there is no such line, return the end of the last complete
+// line, so that an unterminated last line is left out of the section just
+// as MemoryLineReader::Next() leaves it out.
+const char *FindSectionEnd(const char *begin, const char *end, int32_t order) {
+  // A backslash is rare inside n-gram lines, so look for it rather than
+  // scanning line by line.
+  const char *p = begin;
+  while (p != end) {
+    const char *backslash =
+        static_cast<const char *>(memchr(p, '\\', end - p));
+    if (backslash == nullptr) break;
+    if (backslash == begin || backslash[-1] == '\n') {
+      const char *eol =
+          static_cast<const char *>(memchr(backslash, '\n', end - backslash));
+      StringPiece line(backslash, eol != nullptr ? eol : end);
+      if (IsSectionEnd(TrimTrailingWhitespace(line), order)) return backslash;
+    }
+    p = backslash + 1;
+  }
+  while (end != begin && end[-1] != '\n') --end;
+  return end;
+}
+
+// Return the start of the last line of [begin, end) if it is \end\, ignoring
+// trailing whitespace and blank lines, or nullptr.
+const char *FindLastEndLine(const char *begin, const char *end) {
+  while (end != begin && (end[-1] == ' ' || end[-1] == '\n' ||
+                          end[-1] == '\r' || end[-1] == '\t')) {
+    --end;
+  }
+  const char *line = end;
+  while (line != begin && line[-1] != '\n') --line;
+  return StringPiece(line, end) == "\\end\\" ? line : nullptr;
+}
+
+// Number of batches that may wait in the queue of the pipeline.
+constexpr std::size_t kPipelineDepth = 16;
+
+}  // namespace
+
+// The result of parsing one chunk of an \N-grams: section on a worker
+// thread in the parallel mode. See ReadNGramLines().
+struct ArpaFileParser::ParsedChunk {
+  struct Line {
+    StringPiece text;
+    int32_t line_offset;  // Number of lines in the chunk before this one.
+    LineStatus status;
+    int32_t bad_column;
+    bool is_directive;
+    float logprob;
+    float backoff;
+  };
+
+  const char *begin = nullptr;
+  const char *end = nullptr;
+  int32_t num_lines = 0;         // Including blank lines.
+  std::vector<Line> lines;       // Non-blank lines only.
+  std::vector<int32_t> words;    // `order` words per entry of lines.
+
+  // With kAddToSymbols, the words of kLineUnresolved lines are either
+  // symbols, for words in KnownWords, or -1 - i for the i-th entry of
+  // local_words, the other distinct words of the chunk in order of first
+  // use. DeliverChunk() adds them to the symbol table at their first use, so
+  // the symbols are numbered as the serial reader numbers them.
+  std::vector<StringPiece> local_words;
+  std::vector<int32_t> local_symbols;  // Of local_words; -1 until added.
+  FlatHashMap<StringPiece, int32_t, WordHash> local_ids{StringPiece()};
+
+  // Scratch space of the worker.
+  std::vector<StringPiece> columns;
+  std::string token;
+};
+
+// With kAddToSymbols, the symbol table cannot be read by the workers while
+// new words are being added to it. They look words up here instead, in the
+// words added by the sections before, which are typically all of them after
+// the 1-grams. The words added by a section are moved into ids once its
+// chunks are all parsed. Words point into the buffer being read.
+struct ArpaFileParser::KnownWords {
+  FlatHashMap<StringPiece, int32_t, WordHash> ids{StringPiece()};
+  std::vector<std::pair<StringPiece, int32_t>> added;
+};
+
+// Batches of n-grams on their way to ConsumeNGrams() on the consumer
+// thread, with the copied text of their lines; see StartPipeline().
+struct ArpaFileParser::Pipeline {
+  struct Slot {
+    NGramBatch batch;
+    std::string text;
+  };
+
+  SpscQueue<Slot> queue{kPipelineDepth};
+  std::thread consumer;
+  // Set once the consumer is to drop the batches still to come: if
+  // ConsumeNGrams() has thrown error, which the parsing thread rethrows, or
+  // if the parsing thread has failed itself.
+  std::atomic<bool> stopped{false};
+  std::exception_ptr error;
+
+  ~Pipeline() {
+    if (!consumer.joinable()) return;
+    stopped.store(true);
+    queue.Close();
+    consumer.join();
+  }
+};
+
 void ArpaFileParser::Read(std::istream &is) {
+  StreamLineReader reader(is);
+  ReadInternal(&reader);
+}
+
+void ArpaFileParser::Read(const std::string &filename) {
+  MappedFile file;
+  if (!file.Open(filename)) {
+    // Not a regular file, e.g., a pipe, or empty, or mmap() failed: read it
+    // as a stream, which cannot be decompressed or parsed in parallel.
+    std::ifstream is(filename);
+    if (!is) KALDILM_ERR << "Failed to open " << filename;
+    KALDILM_LOG << "Reading " << filename << " as a stream.";
+    StreamLineReader reader(is, "file stream");
+    ReadInternal(&reader);
+    return;
+  }
+
+  Compression compression = DetectCompression(file.Data(), file.Size());
+  if (compression != Compression::kNone) {
+    // Lines are parsed while the next blocks are being decompressed. The
+    // multi-threaded n-gram parsing needs the whole file in memory, so
+    // compressed input is always parsed on this thread.
+    KALDILM_LOG << "Decompressing " << CompressionName(compression)
+                << " input " << filename << " on a background thread.";
+    DecompressingStreamBuf buf(file.Data(), file.Size(), compression);
+    std::istream is(&buf);
+    // Let a decompression error, which the buffer throws, get through.
+    is.exceptions(std::ios::badbit);
+    StreamLineReader reader(is, "decompressed stream");
+    ReadInternal(&reader);
+    return;
+  }
+
+  ReadMemory(file.Data(), file.Size(), "memory-mapped file");
+}
+
+void ArpaFileParser::Read(const char *data, std::size_t size) {
+  ReadMemory(data, size, "memory");
+}
+
+void ArpaFileParser::ReadMemory(const char *data, std::size_t size,
+                                const char *name) {
+  if (IsArpaCache(data, size)) {
+    ReadCache(data, size, name);
+    return;
+  }
+
+  MemoryLineReader reader(data, size, name);
+  if (options_.num_threads == 1) {
+    ReadInternal(&reader);
+    return;
+  }
+  ThreadPool pool(options_.num_threads);
+  KALDILM_LOG << "Parsing n-gram sections with " << pool.NumThreads()
+              << " threads.";
+  KnownWords known_words;
+  pool_ = &pool;
+  known_words_ = &known_words;
+  ReadInternal(&reader);
+  pool_ = nullptr;
+  known_words_ = nullptr;
+}
+
+ArpaFileParser::LineStatus ArpaFileParser::ParseNGramLine(
+    const StringPiece &line, int32_t order, std::vector<StringPiece> *columns,
+    std::string *token, float *logprob, float *backoff, int32_t *words,
+    int32_t *bad_column) const {
+  SplitStringToPieces(line, " \t", true, columns);
+  const std::vector<StringPiece> &col = *columns;
+
+  if (col.size() < 1 + order || col.size() > 2 + order ||
+      (order == ngram_counts_.size() && col.size() != 1 + order)) {
+    return kBadColumnCount;
+  }
+
+  // Parse out n-gram logprob and, if present, backoff weight.
+  if (!ConvertStringToReal(col[0], logprob)) return kBadLogprob;
+  *backoff = 0.0;
+  if (col.size() > order + 1) {
+    if (!ConvertStringToReal(col[order + 1], backoff)) return kBadBackoff;
+  }
+  // Convert to natural log.
+  *logprob *= M_LN10;
+  *backoff *= M_LN10;
+
+  // Adding symbols changes the table, and symbol ids depend on the order in
+  // which words are added, so it is left to FinishNGramLine(), or in the
+  // parallel mode to ResolveLocalWords().
+  if (symbols_ && options_.oov_handling == ArpaParseOptions::kAddToSymbols) {
+    return kLineUnresolved;
+  }
+
+  for (int32_t index = 0; index < order; ++index) {
+    const StringPiece &word = col[1 + index];
+    *bad_column = 1 + index;
+    int32_t id;
+    if (symbols_) {
+      // Symbol table provided, so symbol labels are expected.
+      token->assign(word.data, word.size);
+      id = symbols_->Find(*token);
+      if (id == -1) {  // fst::kNoSymbol
+        switch (options_.oov_handling) {
+          case ArpaParseOptions::kReplaceWithUnk:
+            id = options_.unk_symbol;
+            break;
+          case ArpaParseOptions::kSkipNGram:
+            return kLineSkipped;
+          default:
+            return kOovSymbol;
+        }
+      }
+    } else {
+      // Symbols not provided, LM file should contain integers.
+      if (!ConvertStringToInteger(word, &id) || id < 0) return kBadSymbol;
+    }
+    // Whichever way we got it, an epsilon is invalid.
+    if (id == 0) return kEpsilonSymbol;
+    words[index] = id;
+  }
+  return kLineOk;
+}
+
+bool ArpaFileParser::FinishNGramLine(LineStatus status, int32_t bad_column,
+                                     int32_t order, int32_t *words) {
+#define PARSE_ERR KALDILM_ERR << LineReference() << ": "
+  // Let the n-grams read so far report their diagnostics first.
+  if (status != kLineOk && status != kLineUnresolved) DrainBatches();
+
+  switch (status) {
+    case kLineOk:
+      return true;
+    case kLineUnresolved:
+      for (int32_t index = 0; index < order; ++index) {
+        const StringPiece &word = columns_[1 + index];
+        token_.assign(word.data, word.size);
+        int32_t id = symbols_->AddSymbol(token_);
+        if (id == 0) {
+          PARSE_ERR << "epsilon symbol '" << word << "' is illegal in ARPA LM";
+        }
+        words[index] = id;
+      }
+      return true;
+    case kLineSkipped:
+      ngrams_skipped_ = true;
+      ++stats_.skipped_ngrams[order - 1];
+      if (ShouldWarn())
+        KALDILM_WARN << LineReference() << " skipped: word '"
+                     << columns_[bad_column] << "' not in symbol table";
+      return false;
+    case kBadColumnCount:
+      PARSE_ERR << "Invalid n-gram data line";
+      break;
+    case kBadLogprob:
+      PARSE_ERR << "invalid n-gram logprob '" << columns_[0] << "'";
+      break;
+    case kBadBackoff:
+      PARSE_ERR << "invalid backoff weight '" << columns_[order + 1] << "'";
+      break;
+    case kBadSymbol:
+      PARSE_ERR << "invalid symbol '" << columns_[bad_column] << "'";
+      break;
+    case kOovSymbol:
+      PARSE_ERR << "word '" << columns_[bad_column]
+                << "' not in symbol table";
+      break;
+    case kEpsilonSymbol:
+      PARSE_ERR << "epsilon symbol '" << columns_[bad_column]
+                << "' is illegal in ARPA LM";
+      break;
+  }
+  return false;
+#undef PARSE_ERR
+}
+
+void ArpaFileParser::WarnAboutDirective(int32_t order) {
+  DrainBatches();
+  if (ShouldWarn()) {
+    KALDILM_WARN << "ignoring possible directive '" << current_line_
+                 << "' expecting '" << SectionKeyword(order + 1) << "'";
+
+    if (warning_count_ > 0 &&
+        warning_count_ > static_cast<uint32_t>(options_.max_warnings)) {
+      KALDILM_WARN << "Of " << warning_count_ << " parse warnings, "
+                   << options_.max_warnings << " were reported. "
+                   << "Run program with --max-arpa-warnings=-1 "
+                   << "to see all warnings";
+    }
+  }
+}
+
+template <class LineReader>
+int32_t ArpaFileParser::ReadNGramLinesSerially(LineReader *reader,
+                                               int32_t order) {
+  int32_t ngram_count = 0;
+  int32_t bad_column = 0;
+  float logprob, backoff;
+  std::vector<int32_t> words(order);
+  bool copy_line = !reader->LinesStayValid();
+  while (++line_number_, reader->Next(&current_line_)) {
+    if (IsBlank(current_line_)) {
+      continue;
+    }
+    if (current_line_[0] == '\\') {
+      current_line_ = TrimTrailingWhitespace(current_line_);
+      if (IsSectionEnd(current_line_, order)) break;
+      WarnAboutDirective(order);
+    }
+
+    LineStatus status =
+        ParseNGramLine(current_line_, order, &columns_, &token_, &logprob,
+                       &backoff, words.data(), &bad_column);
+    ++ngram_count;
+    if (FinishNGramLine(status, bad_column, order, words.data())) {
+      AddToBatch(words.data(), logprob, backoff, copy_line);
+    }
+  }
+  return ngram_count;
+}
+
+int32_t ArpaFileParser::ReadNGramLines(StreamLineReader *reader,
+                                       int32_t order) {
+  return ReadNGramLinesSerially(reader, order);
+}
+
+int32_t ArpaFileParser::ReadNGramLines(MemoryLineReader *reader,
+                                       int32_t order) {
+  if (pool_ == nullptr) return ReadNGramLinesSerially(reader, order);
+
+  // Lines of the section are split into chunks that are tokenized, converted
+  // and looked up on the pool. Results are delivered on this thread in file
+  // order, so derived classes see exactly what the serial reader produces.
+  // While one window of chunks is being delivered, the next one is parsed.
+  const char *section_end =
+      FindSectionEnd(reader->Position(), reader->End(), order);
+  const char *next = reader->Position();
+  int32_t chunks_per_window = 2 * pool_->NumThreads();
+  std::vector<ParsedChunk> windows[2];
+  std::vector<std::future<void>> futures[2];
+  for (auto &window : windows) window.resize(chunks_per_window);
+
+  auto submit = [&](int32_t w) {
+    for (int32_t c = 0; c != chunks_per_window && next != section_end; ++c) {
+      ParsedChunk *chunk = &windows[w][c];
+      chunk->begin = next;
+      if (static_cast<std::size_t>(section_end - next) <= kParallelChunkBytes) {
+        next = section_end;
+      } else {
+        // Every line of the section ends with a newline.
+        next = static_cast<const char *>(memchr(
+                   next + kParallelChunkBytes, '\n',
+                   section_end - next - kParallelChunkBytes)) +
+               1;
+      }
+      chunk->end = next;
+      futures[w].push_back(
+          pool_->Enqueue([this, chunk, order] { ParseChunk(order, chunk); }));
+    }
+  };
+
+  int32_t ngram_count = 0;
+  int32_t cur = 0;
+  try {
+    submit(cur);
+    while (!futures[cur].empty()) {
+      submit(1 - cur);
+      for (std::size_t c = 0; c != futures[cur].size(); ++c) {
+        futures[cur][c].get();
+        DeliverChunk(&windows[cur][c], order, &ngram_count);
+      }
+      futures[cur].clear();
+      cur = 1 - cur;
+    }
+  } catch (...) {
+    // A parse error. The chunks still being parsed refer to the windows.
+    for (auto &window_futures : futures) {
+      for (auto &future : window_futures) {
+        if (future.valid()) future.wait();
+      }
+    }
+    throw;
+  }
+
+  // No worker is running, so the words added can be published.
+  for (const auto &word : known_words_->added) {
+    if (known_words_->ids.Find(word.first) == nullptr) {
+      known_words_->ids.Insert(word.first, word.second);
+    }
+  }
+  known_words_->added.clear();
+
+  // Read the line terminating the section as the serial reader would.
+  reader->Seek(section_end);
+  if (++line_number_, reader->Next(&current_line_)) {
+    current_line_ = TrimTrailingWhitespace(current_line_);
+  }
+  return ngram_count;
+}
+
+void ArpaFileParser::SkipNGramSections(StreamLineReader *reader) {
+  // A stream cannot be sought, but its lines need not be parsed.
+  SkipNGramSectionsSerially(reader);
+}
+
+void ArpaFileParser::SkipNGramSections(MemoryLineReader *reader) {
+  const char *end_line = FindLastEndLine(reader->Position(), reader->End());
+  if (end_line == nullptr) {
+    // Let the serial reader find out what is wrong.
+    SkipNGramSectionsSerially(reader);
+    return;
+  }
+  // Line numbers are not counted across the skipped lines. No diagnostic
+  // refers to them after \end\.
+  reader->Seek(end_line);
+  reader->Next(&current_line_);
+  current_line_ = TrimTrailingWhitespace(current_line_);
+}
+
+template <class LineReader>
+void ArpaFileParser::SkipNGramSectionsSerially(LineReader *reader) {
+  while (++line_number_, reader->Next(&current_line_)) {
+    if (current_line_.size != 0 && current_line_[0] == '\\') {
+      current_line_ = TrimTrailingWhitespace(current_line_);
+      if (current_line_ == "\\end\\") return;
+    }
+  }
+}
+
+void ArpaFileParser::ParseChunk(int32_t order, ParsedChunk *chunk) const {
+  chunk->num_lines = 0;
+  chunk->lines.clear();
+  chunk->words.clear();
+  chunk->local_words.clear();
+  chunk->local_ids.Clear();
+
+  const char *p = chunk->begin;
+  while (p != chunk->end) {
+    const char *eol =
+        static_cast<const char *>(memchr(p, '\n', chunk->end - p));
+    StringPiece text(p, eol);
+    p = eol + 1;
+
+    int32_t line_offset = chunk->num_lines++;
+    if (IsBlank(text)) continue;
+
+    ParsedChunk::Line line;
+    line.line_offset = line_offset;
+    line.is_directive = text[0] == '\\';
+    line.text = line.is_directive ? TrimTrailingWhitespace(text) : text;
+    line.bad_column = 0;
+
+    std::size_t offset = chunk->words.size();
+    chunk->words.resize(offset + order);
+    line.status = ParseNGramLine(line.text, order, &chunk->columns,
+                                 &chunk->token, &line.logprob, &line.backoff,
+                                 &chunk->words[offset], &line.bad_column);
+    if (line.status == kLineUnresolved) {
+      // Words are never empty, so none equals the empty key of the maps.
+      line.status = kLineOk;
+      for (int32_t index = 0; index < order; ++index) {
+        const StringPiece &word = chunk->columns[1 + index];
+        int32_t *word_id = &chunk->words[offset + index];
+        const int32_t *symbol = known_words_->ids.Find(word);
+        if (symbol != nullptr) {
+          *word_id = *symbol;
+          continue;
+        }
+        line.status = kLineUnresolved;
+        int32_t *local = chunk->local_ids.Find(word);
+        if (local == nullptr) {
+          *word_id = -1 - static_cast<int32_t>(chunk->local_words.size());
+          chunk->local_ids.Insert(word, chunk->local_words.size());
+          chunk->local_words.push_back(word);
+        } else {
+          *word_id = -1 - *local;
+        }
+      }
+    }
+    chunk->lines.push_back(line);
+  }
+}
+
+void ArpaFileParser::DeliverChunk(ParsedChunk *chunk, int32_t order,
+                                  int32_t *ngram_count) {
+  int32_t base_line_number = line_number_;
+  chunk->local_symbols.assign(chunk->local_words.size(), -1);
+  int32_t *words = chunk->words.data();
+  for (const auto &line : chunk->lines) {
+    line_number_ = base_line_number + line.line_offset + 1;
+    current_line_ = line.text;
+    if (line.is_directive) WarnAboutDirective(order);
+
+    LineStatus status = line.status;
+    int32_t bad_column = line.bad_column;
+    if (status == kLineUnresolved) {
+      status = ResolveLocalWords(chunk, order, words, &bad_column);
+    }
+    if (status != kLineOk) {
+      // Diagnostics need the columns.
+      SplitStringToPieces(current_line_, " \t", true, &columns_);
+    }
+    ++*ngram_count;
+    if (FinishNGramLine(status, bad_column, order, words)) {
+      AddToBatch(words, line.logprob, line.backoff, false);
+    }
+    words += order;
+  }
+  line_number_ = base_line_number + chunk->num_lines;
+}
+
+ArpaFileParser::LineStatus ArpaFileParser::ResolveLocalWords(
+    ParsedChunk *chunk, int32_t order, int32_t *words, int32_t *bad_column) {
+  for (int32_t index = 0; index < order; ++index) {
+    if (words[index] >= 0) continue;  // A known word.
+    int32_t local = -1 - words[index];
+    int32_t &symbol = chunk->local_symbols[local];
+    if (symbol == -1) {
+      const StringPiece &word = chunk->local_words[local];
+      token_.assign(word.data, word.size);
+      symbol = symbols_->AddSymbol(token_);
+      if (symbol != 0) known_words_->added.emplace_back(word, symbol);
+    }
+    if (symbol == 0) {
+      *bad_column = 1 + index;
+      return kEpsilonSymbol;
+    }
+    words[index] = symbol;
+  }
+  return kLineOk;
+}
+
+void ArpaFileParser::CheckOptions() const {
   // Argument sanity checks.
   if (options_.bos_symbol <= 0 || options_.eos_symbol <= 0 ||
       options_.bos_symbol == options_.eos_symbol)
@@ -53,11 +724,59 @@ void ArpaFileParser::Read(std::istream &is) {
   if (symbols_ != NULL && options_.unk_symbol > 0 &&
       symbols_->Find(options_.unk_symbol).empty())
     KALDILM_ERR << "UNK symbol must exist in symbol table";
+  if (!options_.cache_filename.empty() && symbols_ != NULL &&
+      options_.oov_handling == ArpaParseOptions::kReplaceWithUnk)
+    KALDILM_ERR << "An ARPA cache cannot be written with kReplaceWithUnk, "
+                << "since the replaced words would be lost";
+}
+
+std::unique_ptr<ArpaCacheWriter> ArpaFileParser::StartCacheWriter() {
+  std::unique_ptr<ArpaCacheWriter> writer;
+  ngrams_skipped_ = false;
+  if (!options_.cache_filename.empty()) {
+    int32_t num_orders = ngram_counts_.size();
+    writer.reset(new ArpaCacheWriter(options_.cache_filename, ngram_counts_,
+                                     std::min(options_.max_order, num_orders),
+                                     symbols_));
+  }
+  cache_writer_ = writer.get();
+  return writer;
+}
+
+void ArpaFileParser::FinishCacheWriter(
+    std::unique_ptr<ArpaCacheWriter> writer) {
+  cache_writer_ = nullptr;
+  if (writer == nullptr) return;
+  if (ngrams_skipped_) {
+    KALDILM_WARN << "Not writing ARPA cache " << options_.cache_filename
+                 << ", as some n-grams were skipped for OOV words. Write it "
+                 << "without a symbol table instead.";
+    writer->Discard();
+    return;
+  }
+  writer->Finish();
+}
+
+void ArpaFileParser::WarnAboutWarningCount() {
+  if (warning_count_ > 0 &&
+      warning_count_ > static_cast<uint32_t>(options_.max_warnings)) {
+    KALDILM_WARN << "Of " << warning_count_ << " parse warnings, "
+                 << options_.max_warnings << " were reported. Run program with "
+                 << "--max-arpa-warnings=-1 to see all warnings";
+  }
+}
+
+template <class LineReader>
+void ArpaFileParser::ReadInternal(LineReader *reader) {
+  CheckOptions();
 
   ngram_counts_.clear();
   line_number_ = 0;
   warning_count_ = 0;
-  current_line_.clear();
+  current_line_ = StringPiece();
+  stats_ = CompileStats();
+
+  PhaseTimer timer;
 
 #define PARSE_ERR KALDILM_ERR << LineReference() << ": "
 
@@ -66,12 +785,12 @@ void ArpaFileParser::Read(std::istream &is) {
 
   // Processes "\data\" section.
   bool keyword_found = false;
-  while (++line_number_, getline(is, current_line_) && !is.eof()) {
-    if (current_line_.find_first_not_of(" \t\n\r") == std::string::npos) {
+  while (++line_number_, reader->Next(&current_line_)) {
+    if (IsBlank(current_line_)) {
       continue;
     }
 
-    TrimTrailingWhitespace(&current_line_);
+    current_line_ = TrimTrailingWhitespace(current_line_);
 
     // Continue skipping lines until the \data\ marker alone on a line is found.
     if (!keyword_found) {
@@ -85,24 +804,42 @@ void ArpaFileParser::Read(std::istream &is) {
     if (current_line_[0] == '\\') break;
 
     // Enters "\data\" section, and looks for patterns like "ngram 1=1000",
-    // which means there are 1000 unigrams.
-    std::size_t equal_symbol_pos = current_line_.find("=");
-    if (equal_symbol_pos != std::string::npos)
-      // Guaranteed spaces around the "=".
-      current_line_.replace(equal_symbol_pos, 1, " = ");
-    std::vector<std::string> col;
-    SplitString(current_line_, " \t", true, &col);
-    if (col.size() == 4 && col[0] == "ngram" && col[2] == "=") {
-      int32_t order, ngram_count = 0;
-      if (!ConvertStringToInteger(col[1], &order) ||
-          !ConvertStringToInteger(col[3], &ngram_count)) {
-        PARSE_ERR << "cannot parse ngram count";
+    // which means there are 1000 unigrams. Spaces around the "=" are
+    // optional.
+    const char *equal_symbol =
+        static_cast<const char *>(memchr(current_line_.data, '=',
+                                         current_line_.size));
+    bool ok = false;
+    if (equal_symbol != nullptr) {
+      StringPiece order_str, count_str;
+      SplitStringToPieces(StringPiece(current_line_.begin(), equal_symbol),
+                          " \t", true, &columns_);
+      if (columns_.size() == 2 && columns_[0] == "ngram") {
+        order_str = columns_[1];
+        SplitStringToPieces(StringPiece(equal_symbol + 1, current_line_.end()),
+                            " \t", true, &columns_);
+        if (columns_.size() == 1) {
+          count_str = columns_[0];
+          ok = true;
+        }
       }
-      if (ngram_counts_.size() <= order) {
-        ngram_counts_.resize(order);
+      if (ok) {
+        int32_t order, ngram_count = 0;
+        if (!ConvertStringToInteger(order_str, &order) ||
+            !ConvertStringToInteger(count_str, &ngram_count)) {
+          PARSE_ERR << "cannot parse ngram count";
+        }
+        // The counts size the arrays of the compiler.
+        if (order < 1 || ngram_count < 0) {
+          PARSE_ERR << "invalid ngram order or count";
+        }
+        if (ngram_counts_.size() <= order) {
+          ngram_counts_.resize(order);
+        }
+        ngram_counts_[order - 1] = ngram_count;
       }
-      ngram_counts_[order - 1] = ngram_count;
-    } else {
+    }
+    if (!ok) {
       KALDILM_WARN << LineReference()
                    << ": uninterpretable line in \\data\\ section";
     }
@@ -110,18 +847,19 @@ void ArpaFileParser::Read(std::istream &is) {
 
   if (ngram_counts_.size() == 0)
     PARSE_ERR << "\\data\\ section missing or empty.";
+  stats_.ngrams.assign(ngram_counts_.size(), 0);
+  stats_.skipped_ngrams.assign(ngram_counts_.size(), 0);
 
   // Signal that grammar order and n-gram counts are known.
   HeaderAvailable();
 
-  NGram ngram;
-  ngram.words.reserve(ngram_counts_.size());
-
   if (options_.max_order == -1) {
     options_.max_order = ngram_counts_.size();
   }
 
   KALDILM_ASSERT(options_.max_order >= 1);
+  std::unique_ptr<ArpaCacheWriter> cache_writer = StartCacheWriter();
+  std::unique_ptr<Pipeline> pipeline = StartPipeline();
 
   // Processes "\N-grams:" section.
   for (int32_t cur_order = 1; cur_order <= ngram_counts_.size(); ++cur_order) {
@@ -132,138 +870,318 @@ void ArpaFileParser::Read(std::istream &is) {
                    << " section). There is possibly a problem with the file.";
 
     // Must be looking at a \k-grams: directive at this point.
-    std::ostringstream keyword;
-    keyword << "\\" << cur_order << "-grams:";
-    if (current_line_ != keyword.str()) {
-      PARSE_ERR << "invalid directive, expecting '" << keyword.str() << "'";
+    std::string keyword = SectionKeyword(cur_order);
+    if (current_line_ != keyword) {
+      PARSE_ERR << "invalid directive, expecting '" << keyword << "'";
+    }
+    if (cur_order > options_.max_order) {
+      KALDILM_LOG << "Skipping " << current_line_
+                  << " and higher order sections.";
+      SkipNGramSections(reader);
+      break;
     }
     KALDILM_LOG << "Reading " << current_line_ << " section.";
 
-    int32_t ngram_count = 0;
-    while (++line_number_, getline(is, current_line_) && !is.eof()) {
-      if (current_line_.find_first_not_of(" \n\t\r") == std::string::npos) {
-        continue;
-      }
-      if (current_line_[0] == '\\') {
-        TrimTrailingWhitespace(&current_line_);
-        std::ostringstream next_keyword;
-        next_keyword << "\\" << cur_order + 1 << "-grams:";
-        if ((current_line_ != next_keyword.str()) &&
-            (current_line_ != "\\end\\")) {
-          if (ShouldWarn()) {
-            KALDILM_WARN << "ignoring possible directive '" << current_line_
-                         << "' expecting '" << next_keyword.str() << "'";
-
-            if (warning_count_ > 0 &&
-                warning_count_ > static_cast<uint32_t>(options_.max_warnings)) {
-              KALDILM_WARN << "Of " << warning_count_ << " parse warnings, "
-                           << options_.max_warnings << " were reported. "
-                           << "Run program with --max-arpa-warnings=-1 "
-                           << "to see all warnings";
-            }
-          }
-        } else {
-          break;
+    batch_.order = cur_order;
+    int32_t ngram_count = ReadNGramLines(reader, cur_order);
+    DrainBatches();
+    if (ngram_count > ngram_counts_[cur_order - 1]) {
+      PARSE_ERR << "header said there would be " << ngram_counts_[cur_order - 1]
+                << " n-grams of order " << cur_order
+                << ", but we saw more already.";
+    }
+  }
+  FinishPipeline(std::move(pipeline));
+
+  if (current_line_ != "\\end\\") {
+    PARSE_ERR << "invalid or unexpected directive line, expecting \\end\\";
+  }
+
+  WarnAboutWarningCount();
+  FinishCacheWriter(std::move(cache_writer));
+
+  stats_.bytes_read = reader->BytesRead();
+  timer.Finish("read", &stats_);
+  double elapsed = timer.WallSeconds();
+  double megabytes = reader->BytesRead() / 1048576.0;
+  KALDILM_LOG << "Read " << megabytes << " MB from " << reader->Name()
+              << " in " << elapsed << " s ("
+              << (elapsed > 0 ? megabytes / elapsed : 0) << " MB/s)";
+
+  current_line_ = StringPiece();
+  ReadComplete();
+
+#undef PARSE_ERR
+}
+
+int32_t ArpaFileParser::ResolveCachedWord(const StringPiece &word) {
+#define PARSE_ERR KALDILM_ERR << LineReference() << ": "
+  int32_t id;
+  if (symbols_ == nullptr) {
+    if (!ConvertStringToInteger(word, &id) || id < 0) {
+      PARSE_ERR << "invalid symbol '" << word << "'";
+    }
+  } else {
+    token_.assign(word.data, word.size);
+    if (options_.oov_handling == ArpaParseOptions::kAddToSymbols) {
+      id = symbols_->AddSymbol(token_);
+    } else {
+      id = symbols_->Find(token_);
+      if (id == -1) {  // fst::kNoSymbol
+        switch (options_.oov_handling) {
+          case ArpaParseOptions::kReplaceWithUnk:
+            id = options_.unk_symbol;
+            break;
+          case ArpaParseOptions::kSkipNGram:
+            return -1;
+          default:
+            PARSE_ERR << "word '" << word << "' not in symbol table";
+            break;
         }
       }
+    }
+  }
+  if (id == 0) {
+    PARSE_ERR << "epsilon symbol '" << word << "' is illegal in ARPA LM";
+  }
+  return id;
+#undef PARSE_ERR
+}
 
-      std::vector<std::string> col;
-      SplitString(current_line_, " \t", true, &col);
+void ArpaFileParser::ReadCache(const char *data, std::size_t size,
+                               const char *name) {
+  ArpaCacheReader cache(data, size);
+  CheckOptions();
 
-      if (col.size() < 1 + cur_order || col.size() > 2 + cur_order ||
-          (cur_order == ngram_counts_.size() && col.size() != 1 + cur_order)) {
-        PARSE_ERR << "Invalid n-gram data line";
-      }
-      ++ngram_count;
+  ngram_counts_ = cache.NgramCounts();
+  line_number_ = 0;
+  warning_count_ = 0;
+  current_line_ = StringPiece();
+  stats_ = CompileStats();
+  stats_.ngrams.assign(ngram_counts_.size(), 0);
+  stats_.skipped_ngrams.assign(ngram_counts_.size(), 0);
 
-      // Parse out n-gram logprob and, if present, backoff weight.
-      if (!ConvertStringToReal(col[0], &ngram.logprob)) {
-        PARSE_ERR << "invalid n-gram logprob '" << col[0] << "'";
-      }
-      ngram.backoff = 0.0;
-      if (col.size() > cur_order + 1) {
-        if (!ConvertStringToReal(col[cur_order + 1], &ngram.backoff))
-          PARSE_ERR << "invalid backoff weight '" << col[cur_order + 1] << "'";
-      }
-      // Convert to natural log.
-      ngram.logprob *= M_LN10;
-      ngram.backoff *= M_LN10;
-
-      ngram.words.resize(cur_order);
-      bool skip_ngram = false;
-      if (cur_order > options_.max_order) {
-        skip_ngram = true;
-      }
+  PhaseTimer timer;
+  ReadStarted();
+  KALDILM_LOG << "Reading ARPA cache from " << name << ".";
+  HeaderAvailable();
 
-      for (int32_t index = 0; !skip_ngram && index < cur_order; ++index) {
-        int32_t word;
-        if (symbols_) {
-          // Symbol table provided, so symbol labels are expected.
-          if (options_.oov_handling == ArpaParseOptions::kAddToSymbols) {
-            word = symbols_->AddSymbol(col[1 + index]);
-          } else {
-            word = symbols_->Find(col[1 + index]);
-            if (word == -1) {  // fst::kNoSymbol
-              switch (options_.oov_handling) {
-                case ArpaParseOptions::kReplaceWithUnk:
-                  word = options_.unk_symbol;
-                  break;
-                case ArpaParseOptions::kSkipNGram:
-                  if (ShouldWarn())
-                    KALDILM_WARN << LineReference() << " skipped: word '"
-                                 << col[1 + index] << "' not in symbol table";
-                  skip_ngram = true;
-                  break;
-                default:
-                  PARSE_ERR << "word '" << col[1 + index]
-                            << "' not in symbol table";
-              }
-            }
-          }
-        } else {
-          // Symbols not provided, LM file should contain integers.
-          if (!ConvertStringToInteger(col[1 + index], &word) || word < 0) {
-            PARSE_ERR << "invalid symbol '" << col[1 + index] << "'";
-          }
+  int32_t num_orders = ngram_counts_.size();
+  if (options_.max_order == -1) {
+    options_.max_order = num_orders;
+  }
+  KALDILM_ASSERT(options_.max_order >= 1);
+  if (options_.max_order > cache.NumCachedOrders() &&
+      cache.NumCachedOrders() < num_orders) {
+    KALDILM_ERR << "The ARPA cache holds n-grams up to order "
+                << cache.NumCachedOrders() << " only, but max_order is "
+                << options_.max_order;
+  }
+  for (int32_t order = 1; order <= std::min(options_.max_order, num_orders);
+       ++order) {
+    if (ngram_counts_[order - 1] == 0)
+      KALDILM_WARN << "Zero ngram count in ngram order " << order
+                   << ". There is possibly a problem with the file.";
+  }
+  std::unique_ptr<ArpaCacheWriter> cache_writer = StartCacheWriter();
+  std::unique_ptr<Pipeline> pipeline = StartPipeline();
+
+  // A word is mapped to its symbol when it is first used, so that symbols
+  // are added in the same order as when the ARPA file is parsed.
+  const int32_t kUnresolved = -2;
+  const std::vector<StringPiece> &vocab = cache.Vocabulary();
+  std::vector<int32_t> word_symbols(vocab.size(), kUnresolved);
+  std::vector<int32_t> words;
+  int32_t order = 0;
+  ArpaCacheReader::Block block;
+  while (cache.Next(&block) && block.order <= options_.max_order) {
+    if (block.order != order) {
+      DrainBatches();
+      order = batch_.order = block.order;
+      words.resize(order);
+      KALDILM_LOG << "Reading " << SectionKeyword(order) << " section.";
+    }
+    for (int32_t i = 0; i != block.size; ++i) {
+      line_number_ = block.line_numbers[i];
+      const int32_t *indexes = block.words + i * order;
+      int32_t index = 0;
+      for (; index != order; ++index) {
+        if (indexes[index] < 0 || indexes[index] >= vocab.size()) {
+          KALDILM_ERR << "Corrupted ARPA cache: invalid word index "
+                      << indexes[index];
         }
-        // Whichever way we got it, an epsilon is invalid.
-        if (word == 0) {
-          PARSE_ERR << "epsilon symbol '" << col[1 + index]
-                    << "' is illegal in ARPA LM";
+        int32_t &symbol = word_symbols[indexes[index]];
+        if (symbol == kUnresolved) {
+          symbol = ResolveCachedWord(vocab[indexes[index]]);
         }
-        ngram.words[index] = word;
+        if (symbol == -1) break;
+        words[index] = symbol;
       }
-      if (!skip_ngram) {
-        ConsumeNGram(ngram);
+      if (index != order) {
+        DrainBatches();
+        ngrams_skipped_ = true;
+        ++stats_.skipped_ngrams[order - 1];
+        if (ShouldWarn())
+          KALDILM_WARN << LineReference() << " skipped: word '"
+                       << vocab[indexes[index]] << "' not in symbol table";
+        continue;
       }
-    }
-    if (ngram_count > ngram_counts_[cur_order - 1]) {
-      PARSE_ERR << "header said there would be " << ngram_counts_[cur_order - 1]
-                << " n-grams of order " << cur_order
-                << ", but we saw more already.";
+      AddToBatch(words.data(), block.logprobs[i], block.backoffs[i], false);
     }
   }
+  FlushBatch();
+  FinishPipeline(std::move(pipeline));
 
-  if (current_line_ != "\\end\\") {
-    PARSE_ERR << "invalid or unexpected directive line, expecting \\end\\";
+  WarnAboutWarningCount();
+  FinishCacheWriter(std::move(cache_writer));
+
+  stats_.bytes_read = size;
+  timer.Finish("read", &stats_);
+  double elapsed = timer.WallSeconds();
+  double megabytes = size / 1048576.0;
+  KALDILM_LOG << "Read " << megabytes << " MB of ARPA cache from " << name
+              << " in " << elapsed << " s ("
+              << (elapsed > 0 ? megabytes / elapsed : 0) << " MB/s)";
+
+  ReadComplete();
+}
+
+void ArpaFileParser::AddToBatch(const int32_t *words, float logprob,
+                                float backoff, bool copy_line) {
+  batch_.words.insert(batch_.words.end(), words, words + batch_.order);
+  batch_.logprobs.push_back(logprob);
+  batch_.backoffs.push_back(backoff);
+  batch_.line_numbers.push_back(line_number_);
+  if (copy_line) {
+    // Pointers into batch_text_ are set in FlushBatch(), after it stops
+    // growing.
+    batch_text_offsets_.push_back(batch_text_.size());
+    batch_text_.append(current_line_.data, current_line_.size);
+    batch_.lines.push_back(StringPiece(nullptr, current_line_.size));
+  } else {
+    batch_.lines.push_back(current_line_);
   }
+  if (batch_.Size() == kNGramBatchSize) FlushBatch();
+}
 
-  if (warning_count_ > 0 &&
-      warning_count_ > static_cast<uint32_t>(options_.max_warnings)) {
-    KALDILM_WARN << "Of " << warning_count_ << " parse warnings, "
-                 << options_.max_warnings << " were reported. Run program with "
-                 << "--max-arpa-warnings=-1 to see all warnings";
+void ArpaFileParser::FlushBatch() {
+  if (batch_.Size() == 0) return;
+  stats_.ngrams[batch_.order - 1] += batch_.Size();
+  if (cache_writer_ != nullptr) cache_writer_->Write(batch_);
+
+  NGramBatch *batch = &batch_;
+  std::string *text = &batch_text_;
+  if (pipeline_ != nullptr) {
+    // Trade the batch and its text for the emptied ones of an earlier
+    // batch.
+    Pipeline::Slot *slot = pipeline_->queue.BeginPush();
+    std::swap(slot->batch, batch_);
+    slot->text.swap(batch_text_);
+    batch_.order = slot->batch.order;
+    batch = &slot->batch;
+    text = &slot->text;
+  }
+  // The text has stopped growing and moving.
+  for (std::size_t i = 0; i != batch_text_offsets_.size(); ++i) {
+    batch->lines[i].data = &(*text)[batch_text_offsets_[i]];
   }
 
-  current_line_.clear();
-  ReadComplete();
+  if (pipeline_ != nullptr) {
+    pipeline_->queue.EndPush();
+    if (pipeline_->stopped.load()) std::rethrow_exception(pipeline_->error);
+  } else {
+    ConsumeNGrams(batch_);
+  }
 
-#undef PARSE_ERR
+  batch_.Clear();
+  batch_text_.clear();
+  batch_text_offsets_.clear();
+}
+
+void ArpaFileParser::DrainBatches() {
+  FlushBatch();
+  if (pipeline_ != nullptr) {
+    pipeline_->queue.WaitUntilEmpty();
+    if (pipeline_->stopped.load()) std::rethrow_exception(pipeline_->error);
+  }
+}
+
+std::unique_ptr<ArpaFileParser::Pipeline> ArpaFileParser::StartPipeline() {
+  std::unique_ptr<Pipeline> pipeline;
+  if (options_.num_threads != 1 && CanConsumeConcurrently()) {
+    pipeline.reset(new Pipeline);
+    pipeline_ = pipeline.get();
+    pipeline->consumer = std::thread([this] { ConsumePipelinedBatches(); });
+  }
+  return pipeline;
+}
+
+void ArpaFileParser::FinishPipeline(std::unique_ptr<Pipeline> pipeline) {
+  if (pipeline == nullptr) return;
+  FlushBatch();
+  pipeline->queue.Close();
+  pipeline->consumer.join();
+  pipeline_ = nullptr;
+  if (pipeline->stopped.load()) std::rethrow_exception(pipeline->error);
+
+  const SpscQueue<Pipeline::Slot> &queue = pipeline->queue;
+  KALDILM_LOG << "N-grams were consumed on a separate thread. Parsing waited "
+              << queue.ProducerWaitSeconds() << " s in "
+              << queue.ProducerStalls() << " stalls for them to be consumed, "
+              << "and consuming waited " << queue.ConsumerWaitSeconds()
+              << " s in " << queue.ConsumerStalls()
+              << " stalls for them to be parsed.";
+}
+
+void ArpaFileParser::ConsumePipelinedBatches() {
+  while (Pipeline::Slot *slot = pipeline_->queue.BeginPop()) {
+    if (!pipeline_->stopped.load()) {
+      try {
+        ConsumeNGrams(slot->batch);
+      } catch (...) {
+        pipeline_->error = std::current_exception();
+        pipeline_->stopped.store(true);
+      }
+    }
+    slot->batch.Clear();
+    slot->text.clear();
+    pipeline_->queue.EndPop();
+  }
+}
+
+void ArpaFileParser::ConsumeNGrams(const NGramBatch &batch) {
+  int32_t line_number = line_number_;
+  StringPiece current_line = current_line_;
+  NGram ngram;
+  for (int32_t i = 0; i != batch.Size(); ++i) {
+    line_number_ = batch.line_numbers[i];
+    current_line_ = batch.lines[i];
+    ngram.words.assign(batch.Words(i), batch.Words(i) + batch.order);
+    ngram.logprob = batch.logprobs[i];
+    ngram.backoff = batch.backoffs[i];
+    ConsumeNGram(ngram);
+  }
+  line_number_ = line_number;
+  current_line_ = current_line;
+}
+
+void ArpaFileParser::ConsumeNGram(const NGram &) {
+  KALDILM_ERR << "Either ConsumeNGram() or ConsumeNGrams() must be overridden";
 }
 
 std::string ArpaFileParser::LineReference() const {
   std::ostringstream ss;
-  ss << "line " << line_number_ << " [" << current_line_ << "]";
+  ss << "line " << line_number_;
+  // Lines of an ARPA cache have no text.
+  if (current_line_.data != nullptr) ss << " [" << current_line_ << "]";
+  return ss.str();
+}
+
+std::string ArpaFileParser::LineReference(const NGramBatch &batch,
+                                          int32_t i) const {
+  std::ostringstream ss;
+  ss << "line " << batch.line_numbers[i];
+  if (batch.lines[i].data != nullptr) ss << " [" << batch.lines[i] << "]";
   return ss.str();
 }
 
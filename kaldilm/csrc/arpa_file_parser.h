@@ -10,18 +10,28 @@
 #define KALDILM_CSRC_ARPA_FILE_PARSER_H_
 
 #include <cstdint>
+#include <memory>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include "fst/symbol-table.h"
+#include "kaldilm/csrc/compile_stats.h"
+#include "kaldilm/csrc/string_utils.h"
 
 namespace kaldilm {
 
+class ArpaCacheWriter;
+class MemoryLineReader;
+class StreamLineReader;
+class ThreadPool;
+
 /**
   Options that control ArpaFileParser
 */
 struct ArpaParseOptions {
   enum OovHandling {
-    kRaiseError,      ///< Abort on OOV words
+    kRaiseError,      ///< Throw std::runtime_error on OOV words.
     kAddToSymbols,    ///< Add novel words to the symbol table.
     kReplaceWithUnk,  ///< Replace OOV words with "<unk>".
     kSkipNGram        ///< Skip n-gram with OOV word and continue.
@@ -45,7 +55,26 @@ struct ArpaParseOptions {
   // Maximum LM order. -1 means to use the largest order in the file.
   // If max_order is 1, it consumes ngram data up to unigram
   // If max_order is 2, it consumes ngram data up to bigram
+  // Sections of higher orders are skipped without being parsed, so errors
+  // in them are not reported.
   int32_t max_order = -1;
+
+  /// Number of threads used to tokenize, convert and look up the lines of
+  /// the \N-grams: sections. It takes effect only when reading from memory
+  /// or from a memory-mapped file. Unless it is 1, ConsumeNGrams() also
+  /// runs on a thread of its own, concurrently with parsing, if the derived
+  /// class allows it; see CanConsumeConcurrently(). N-grams are delivered
+  /// in file order either way. ArpaLmCompiler also uses it to sort arcs and
+  /// to remove redundant states.
+  /// 1 disables parallel parsing; <= 0 uses all available cores.
+  int32_t num_threads = 1;
+
+  /// If not empty, the n-grams read are also written to this file as an
+  /// ARPA cache, which Read(filename) accepts in place of the ARPA file;
+  /// see arpa_cache.h. Only the orders up to max_order are cached. The file
+  /// is not kept if an n-gram is skipped for an OOV word, and kReplaceWithUnk
+  /// is not allowed, since the cache would not hold the whole model.
+  std::string cache_filename;
 };
 
 /**
@@ -58,6 +87,32 @@ struct NGram {
                                ///< Defaults to zero if not specified.
 };
 
+/**
+   A block of consecutive n-grams of the same order, in file order. The
+   words of the i-th n-gram are Words(i)[0], ..., Words(i)[order - 1].
+*/
+struct NGramBatch {
+  int32_t order = 0;
+  std::vector<int32_t> words;         ///< `order` symbols per n-gram.
+  std::vector<float> logprobs;        ///< Log-prob of each n-gram.
+  std::vector<float> backoffs;        ///< Log-backoff weight of each n-gram.
+  std::vector<int32_t> line_numbers;  ///< Line of each n-gram in the file.
+  std::vector<StringPiece> lines;     ///< Text of those lines. Valid only
+                                      ///< inside ConsumeNGrams().
+
+  int32_t Size() const { return static_cast<int32_t>(logprobs.size()); }
+  const int32_t *Words(int32_t i) const { return words.data() + i * order; }
+
+  /// Remove all n-grams, keeping the order and the allocated memory.
+  void Clear() {
+    words.clear();
+    logprobs.clear();
+    backoffs.clear();
+    line_numbers.clear();
+    lines.clear();
+  }
+};
+
 /**
     ArpaFileParser is an abstract base class for ARPA LM file conversion.
 
@@ -78,11 +133,36 @@ class ArpaFileParser {
   virtual ~ArpaFileParser() = default;
 
   /// Read ARPA LM file from a stream.
+  ///
+  /// Errors in the file are reported with KALDILM_ERR, i.e., thrown as
+  /// std::runtime_error. The parser must not be used again after that.
   void Read(std::istream &is);
 
+  /// Read ARPA LM file by memory-mapping it. Lines are tokenized in place
+  /// inside the mapping, so no per-line heap allocation takes place. The
+  /// n-grams and diagnostics are the same as for Read(std::istream &).
+  ///
+  /// gzip, xz and zstd compressed files are detected by their magic bytes
+  /// and decompressed on a background thread while being parsed, provided
+  /// support for the format was compiled in. So are ARPA caches, whose
+  /// n-grams are delivered without any text parsing; see arpa_cache.h.
+  ///
+  /// Files that cannot be mapped, e.g., pipes such as /dev/stdin, are read
+  /// as streams instead, as uncompressed text on this thread.
+  void Read(const std::string &filename);
+
+  /// Read ARPA LM, or an ARPA cache, from an in-memory buffer of `size`
+  /// bytes. The buffer must remain valid until Read() returns.
+  void Read(const char *data, std::size_t size);
+
   /// Parser options.
   const ArpaParseOptions &Options() const { return options_; }
 
+  /// What the last Read() took and produced: the "read" phase, bytes read,
+  /// and n-grams delivered and skipped per order, plus whatever the derived
+  /// class adds in ReadComplete(); see CompileStats.
+  const CompileStats &Stats() const { return stats_; }
+
  protected:
   /// Override called before reading starts. This is the point to prepare
   /// any state in the derived class.
@@ -92,10 +172,27 @@ class ArpaFileParser {
   /// number of n-grams has been read, and ngram_counts() is now valid.
   virtual void HeaderAvailable() {}
 
-  /// Pure override that must be implemented to process current n-gram. The
-  /// n-grams are sent in the file order, which guarantees that all
-  /// (k-1)-grams are processed before the first k-gram is.
-  virtual void ConsumeNGram(const NGram &) = 0;
+  /// Override function called to process a batch of n-grams. The batches
+  /// are sent in the file order, which guarantees that all (k-1)-grams are
+  /// processed before the first k-gram is. Diagnostics of the parser are
+  /// never delayed past the batch of the n-grams preceding them.
+  ///
+  /// The default implementation calls ConsumeNGram() for every n-gram, with
+  /// LineNumber() and LineReference() referring to the n-gram's line.
+  virtual void ConsumeNGrams(const NGramBatch &batch);
+
+  /// Override to return true if ConsumeNGrams() may be called on another
+  /// thread while the following lines are parsed. It must then use only the
+  /// batch, Options(), NgramCounts(), ShouldWarn() and LineReference(batch,
+  /// i), and leave the symbol table alone, which the parser may be adding
+  /// to. The parser waits for the pending batches before it reports a
+  /// diagnostic or moves on to the next section, so that the diagnostics
+  /// are in order.
+  virtual bool CanConsumeConcurrently() const { return false; }
+
+  /// Override function called to process the current n-gram by the default
+  /// ConsumeNGrams(). One of the two must be overridden.
+  virtual void ConsumeNGram(const NGram &);
 
   /// Override function called after the last n-gram has been consumed.
   virtual void ReadComplete() {}
@@ -110,6 +207,11 @@ class ArpaFileParser {
   /// compiled, to print out as part of diagnostics.
   std::string LineReference() const;
 
+  /// Inside ConsumeNGrams(), returns a formatted reference to the line of
+  /// the i-th n-gram of the batch. The text of the line is not available
+  /// when reading an ARPA cache, so only its number is given then.
+  std::string LineReference(const NGramBatch &batch, int32_t i) const;
+
   /// Increments warning count, and returns true if a warning should be
   /// printed or false if the count has exceeded the set maximum.
   bool ShouldWarn();
@@ -117,13 +219,155 @@ class ArpaFileParser {
   /// N-gram counts. Valid from the point when HeaderAvailable() is called.
   const std::vector<int32_t> &NgramCounts() const { return ngram_counts_; }
 
+  /// For the derived class to add its phases and results, in ReadComplete().
+  /// skipped_ngrams is sized to the number of orders before
+  /// HeaderAvailable() is called.
+  CompileStats *MutableStats() { return &stats_; }
+
  private:
+  // Outcome of ParseNGramLine().
+  enum LineStatus {
+    kLineOk,           // All fields are parsed and words are resolved.
+    kLineUnresolved,   // Words are to be added to the symbol table.
+    kLineSkipped,      // An OOV word with kSkipNGram.
+    kBadColumnCount,
+    kBadLogprob,
+    kBadBackoff,
+    kBadSymbol,
+    kOovSymbol,        // An OOV word with kRaiseError.
+    kEpsilonSymbol,
+  };
+  struct ParsedChunk;
+  struct KnownWords;
+  struct Pipeline;
+
+  // Implements Read() for any source of lines; see StreamLineReader and
+  // MemoryLineReader in arpa_file_parser.cc.
+  template <class LineReader>
+  void ReadInternal(LineReader *reader);
+
+  void ReadMemory(const char *data, std::size_t size, const char *name);
+
+  // Deliver the n-grams of an ARPA cache; see arpa_cache.h.
+  void ReadCache(const char *data, std::size_t size, const char *name);
+
+  // Map a word of an ARPA cache to its symbol as ParseNGramLine() and
+  // FinishNGramLine() would. Return -1 if the n-gram is to be skipped.
+  int32_t ResolveCachedWord(const StringPiece &word);
+
+  // Throw std::runtime_error if the options are inconsistent. Called at the
+  // start of reading.
+  void CheckOptions() const;
+
+  // Called once the header is read and max_order is known. Return the
+  // writer of options_.cache_filename, or nullptr if it is empty, and
+  // make FlushBatch() pass it every batch.
+  std::unique_ptr<ArpaCacheWriter> StartCacheWriter();
+  // Complete the cache file, unless some n-gram has not made it into it.
+  void FinishCacheWriter(std::unique_ptr<ArpaCacheWriter> writer);
+
+  // Called once the header is read. Return the pipeline that runs
+  // ConsumeNGrams() on a thread of its own, or nullptr if it is not to be
+  // used, and make FlushBatch() hand it every batch.
+  std::unique_ptr<Pipeline> StartPipeline();
+  // Pass the last batch, wait for the consumer thread to finish, and report
+  // how long each side waited for the other.
+  void FinishPipeline(std::unique_ptr<Pipeline> pipeline);
+  // Run on the consumer thread of the pipeline.
+  void ConsumePipelinedBatches();
+
+  // Print how many warnings were suppressed, if any.
+  void WarnAboutWarningCount();
+
+  // Read lines of the \N-grams: section of the given order up to and
+  // including the line that terminates it, which is left in current_line_.
+  // Return the number of n-gram lines seen.
+  int32_t ReadNGramLines(StreamLineReader *reader, int32_t order);
+  int32_t ReadNGramLines(MemoryLineReader *reader, int32_t order);
+  template <class LineReader>
+  int32_t ReadNGramLinesSerially(LineReader *reader, int32_t order);
+
+  // Skip the remaining \N-grams: sections without parsing their lines, and
+  // leave the \end\ line in current_line_. A buffer in memory is searched
+  // for \end\ from its end, so the skipped sections are not even touched.
+  void SkipNGramSections(StreamLineReader *reader);
+  void SkipNGramSections(MemoryLineReader *reader);
+  template <class LineReader>
+  void SkipNGramSectionsSerially(LineReader *reader);
+
+  // Parallel mode helpers. ParseChunk() runs on the pool and must not
+  // modify the parser.
+  void ParseChunk(int32_t order, ParsedChunk *chunk) const;
+  void DeliverChunk(ParsedChunk *chunk, int32_t order, int32_t *ngram_count);
+  // Map the chunk-local words of a kLineUnresolved line to symbols, adding
+  // them to the symbol table and to known_words_->added. Return kLineOk or
+  // kEpsilonSymbol.
+  LineStatus ResolveLocalWords(ParsedChunk *chunk, int32_t order,
+                               int32_t *words, int32_t *bad_column);
+
+  // Split an n-gram data line into `columns`, and convert its fields into
+  // the output arguments. Symbols are only looked up, never added, so it is
+  // safe to call it concurrently. On failure, bad_column tells which column
+  // is at fault.
+  LineStatus ParseNGramLine(const StringPiece &line, int32_t order,
+                            std::vector<StringPiece> *columns,
+                            std::string *token, float *logprob,
+                            float *backoff, int32_t *words,
+                            int32_t *bad_column) const;
+
+  // Report the outcome of ParseNGramLine() for current_line_, whose columns
+  // must be in columns_, and add symbols if it is kLineUnresolved. Return
+  // true if the n-gram should be consumed.
+  bool FinishNGramLine(LineStatus status, int32_t bad_column, int32_t order,
+                       int32_t *words);
+
+  // Append the n-gram of current_line_ to batch_, and pass batch_ to
+  // ConsumeNGrams() once it is full. If copy_line is true, the text of
+  // current_line_ is copied, as it does not outlive the next line.
+  void AddToBatch(const int32_t *words, float logprob, float backoff,
+                  bool copy_line);
+  void FlushBatch();
+  // FlushBatch(), and wait until ConsumeNGrams() has returned for all the
+  // batches, so that the diagnostics of their n-grams come first.
+  void DrainBatches();
+
+  void WarnAboutDirective(int32_t order);
+
   ArpaParseOptions options_;
   fst::SymbolTable *symbols_;  // the pointer is not owned here.
   int32_t line_number_;
   uint32_t warning_count_;
-  std::string current_line_;
+  // The line being parsed. Points into either the input buffer or the line
+  // buffer of the stream reader.
+  StringPiece current_line_;
   std::vector<int32_t> ngram_counts_;
+
+  // Scratch space reused across lines to avoid per-line allocations.
+  std::vector<StringPiece> columns_;
+  std::string token_;
+
+  // N-grams not yet passed to ConsumeNGrams(), and the copied text of their
+  // lines with the offset of each line when reading from a stream.
+  NGramBatch batch_;
+  std::string batch_text_;
+  std::vector<std::size_t> batch_text_offsets_;
+
+  // Workers of the parallel mode; non-null only inside Read().
+  ThreadPool *pool_ = nullptr;
+  // Words the parallel mode has added to the symbol table in earlier
+  // sections; non-null only inside Read().
+  KnownWords *known_words_ = nullptr;
+
+  // Hands batches over to ConsumeNGrams() on another thread; non-null only
+  // inside Read().
+  Pipeline *pipeline_ = nullptr;
+
+  // Writer of options_.cache_filename; non-null only inside Read().
+  ArpaCacheWriter *cache_writer_ = nullptr;
+  // Whether an n-gram has been skipped for an OOV word.
+  bool ngrams_skipped_ = false;
+
+  CompileStats stats_;
 };
 
 }  // namespace kaldilm
@@ -14,13 +14,37 @@
 #define NDEBUG
 #endif
 
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#ifdef KALDILM_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef KALDILM_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef KALDILM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "fst/fstlib.h"
+#include "kaldilm/csrc/arpa_ngram_reader.h"
+#include "kaldilm/csrc/decompressing_stream.h"
 #include "kaldilm/csrc/log.h"
 
 namespace kaldilm {
@@ -153,9 +177,188 @@ void TestableArpaFileParser::Validate(
                     CompareNgrams));
 }
 
+// Every test LM is read through each of the ArpaFileParser::Read()
+// overloads, and with the parallel mode, which must all produce the same
+// n-grams, line numbers and warnings. Some are also read from an ARPA cache
+// written by WriteCache(). kReadPipe reads a FIFO by name, which cannot be
+// memory-mapped and is read as a stream, as are /dev/stdin and <(zcat lm.gz).
+// The compressed modes read a file compressed by Compress(), for each
+// format whose library kaldilm is built with.
+enum ReadMode {
+  kReadStream,
+  kReadMemory,
+  kReadMappedFile,
+  kReadMemoryInParallel,
+  kReadCache,
+  kReadPipe,
+  kReadGzipFile,
+  kReadXzFile,
+  kReadZstdFile
+};
+const ReadMode kAllReadModes[] = {
+    kReadStream,     kReadMemory, kReadMappedFile, kReadMemoryInParallel,
+#ifndef _WIN32
+    kReadPipe,
+#endif
+#ifdef KALDILM_HAVE_ZLIB
+    kReadGzipFile,
+#endif
+#ifdef KALDILM_HAVE_LZMA
+    kReadXzFile,
+#endif
+#ifdef KALDILM_HAVE_ZSTD
+    kReadZstdFile,
+#endif
+};
+
+const char kCacheFilename[] = "arpa_file_parser_test.tmp.cache";
+
+// Return data compressed in the given format, as a single member or frame.
+std::string Compress(const std::string &data, Compression compression) {
+  std::string ans;
+  switch (compression) {
+#ifdef KALDILM_HAVE_ZLIB
+    case Compression::kGzip: {
+      z_stream zs;
+      memset(&zs, 0, sizeof(zs));
+      int ret = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                             8, Z_DEFAULT_STRATEGY);
+      assert(ret == Z_OK);
+      ans.resize(deflateBound(&zs, data.size()));
+      zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+      zs.avail_in = data.size();
+      zs.next_out = reinterpret_cast<Bytef *>(&ans[0]);
+      zs.avail_out = ans.size();
+      ret = deflate(&zs, Z_FINISH);
+      assert(ret == Z_STREAM_END);
+      ans.resize(zs.total_out);
+      deflateEnd(&zs);
+      break;
+    }
+#endif
+#ifdef KALDILM_HAVE_LZMA
+    case Compression::kXz: {
+      ans.resize(lzma_stream_buffer_bound(data.size()));
+      std::size_t size = 0;
+      lzma_ret ret = lzma_easy_buffer_encode(
+          1, LZMA_CHECK_CRC64, nullptr,
+          reinterpret_cast<const uint8_t *>(data.data()), data.size(),
+          reinterpret_cast<uint8_t *>(&ans[0]), &size, ans.size());
+      assert(ret == LZMA_OK);
+      ans.resize(size);
+      break;
+    }
+#endif
+#ifdef KALDILM_HAVE_ZSTD
+    case Compression::kZstd: {
+      ans.resize(ZSTD_compressBound(data.size()));
+      std::size_t size =
+          ZSTD_compress(&ans[0], ans.size(), data.data(), data.size(), 1);
+      assert(!ZSTD_isError(size));
+      ans.resize(size);
+      break;
+    }
+#endif
+    default:
+      assert(false);
+  }
+  return ans;
+}
+
+Compression CompressionOf(ReadMode mode) {
+  switch (mode) {
+    case kReadGzipFile:
+      return Compression::kGzip;
+    case kReadXzFile:
+      return Compression::kXz;
+    case kReadZstdFile:
+      return Compression::kZstd;
+    default:
+      return Compression::kNone;
+  }
+}
+
+// Write data to filename, read it with parser, and remove the file.
+void ReadFile(const std::string &filename, const std::string &data,
+              ArpaFileParser *parser) {
+  {
+    std::ofstream os(filename, std::ios::binary);
+    os << data;
+  }
+  try {
+    parser->Read(filename);
+  } catch (...) {
+    std::remove(filename.c_str());
+    throw;
+  }
+  std::remove(filename.c_str());
+}
+
+int32 NumThreads(ReadMode mode) {
+  return mode == kReadMemoryInParallel ? 3 : 1;
+}
+
+void ReadWithMode(ReadMode mode, const std::string &lm,
+                  ArpaFileParser *parser) {
+  switch (mode) {
+    case kReadStream: {
+      std::istringstream stm(lm, std::ios_base::in);
+      parser->Read(stm);
+      break;
+    }
+    case kReadMemory:
+    case kReadMemoryInParallel:
+      parser->Read(lm.data(), lm.size());
+      break;
+    case kReadMappedFile:
+      ReadFile("arpa_file_parser_test.tmp.arpa", lm, parser);
+      break;
+    case kReadCache:
+      // Written from lm by WriteCache().
+      parser->Read(std::string(kCacheFilename));
+      break;
+    case kReadPipe: {
+#ifndef _WIN32
+      std::string filename = "arpa_file_parser_test.tmp.fifo";
+      std::remove(filename.c_str());
+      int ret = mkfifo(filename.c_str(), 0600);
+      assert(ret == 0);
+      // Opening either end of a FIFO blocks until the other end is opened.
+      std::thread writer([&filename, &lm] {
+        std::ofstream os(filename, std::ios::binary);
+        os << lm;
+      });
+      parser->Read(filename);
+      writer.join();
+      std::remove(filename.c_str());
+#endif
+      break;
+    }
+    case kReadGzipFile:
+    case kReadXzFile:
+    case kReadZstdFile:
+      ReadFile("arpa_file_parser_test.tmp.arpa.z",
+               Compress(lm, CompressionOf(mode)), parser);
+      break;
+  }
+}
+
+// Write an ARPA cache of lm, adding its words to a copy of symbols, or
+// keeping them as integers if symbols is NULL.
+void WriteCache(const std::string &lm, const fst::SymbolTable *symbols) {
+  ArpaParseOptions options;
+  options.bos_symbol = 1;
+  options.eos_symbol = 2;
+  options.oov_handling = ArpaParseOptions::kAddToSymbols;
+  options.cache_filename = kCacheFilename;
+  std::unique_ptr<fst::SymbolTable> copy(symbols ? symbols->Copy() : NULL);
+  TestableArpaFileParser parser(options, copy.get());
+  parser.Read(lm.data(), lm.size());
+}
+
 // Read integer LM (no symbols) with log base conversion.
-void ReadIntegerLmLogconvExpectSuccess() {
-  KALDILM_LOG << "ReadIntegerLmLogconvExpectSuccess()";
+void ReadIntegerLmLogconvExpectSuccess(ReadMode mode) {
+  KALDILM_LOG << "ReadIntegerLmLogconvExpectSuccess(" << mode << ")";
 
   static std::string integer_lm =
       "\
@@ -192,14 +395,296 @@ ngram 3=2\n\
   ArpaParseOptions options;
   options.bos_symbol = 1;
   options.eos_symbol = 2;
+  options.num_threads = NumThreads(mode);
+
+  if (mode == kReadCache) WriteCache(integer_lm, NULL);
+  TestableArpaFileParser parser(options, NULL);
+  ReadWithMode(mode, integer_lm, &parser);
+  parser.Validate(MakeCountedArray(expect_counts),
+                  MakeCountedArray(expect_ngrams));
+}
+
+// With max_order, higher order sections are skipped without being parsed,
+// so they may even hold lines that are not n-grams.
+void ReadIntegerLmMaxOrder(ReadMode mode) {
+  KALDILM_LOG << "ReadIntegerLmMaxOrder(" << mode << ")";
+
+  static std::string integer_lm =
+      "\
+\\data\\\n\
+ngram 1=2\n\
+ngram 2=1\n\
+ngram 3=1\n\
+\n\
+\\1-grams:\n\
+-5.2\t4\t-3.3\n\
+-3.4\t5\n\
+\n\
+\\2-grams:\n\
+-1.4\t4 5\n\
+\n\
+\\3-grams:\n\
+this line is never parsed\n\
+\n\
+\\end\\\n\
+\n";
+
+  int32 expect_counts[] = {2, 1, 1};
+  NGramTestData expect_ngrams[] = {{7, -5.2, {4, 0, 0}, -3.3},
+                                   {8, -3.4, {5, 0, 0}, 0.0},
+                                   {11, -1.4, {4, 5, 0}, 0.0}};
+
+  ArpaParseOptions options;
+  options.bos_symbol = 1;
+  options.eos_symbol = 2;
+  options.max_order = 2;
+  options.num_threads = NumThreads(mode);
 
   TestableArpaFileParser parser(options, NULL);
-  std::istringstream stm(integer_lm, std::ios_base::in);
-  parser.Read(stm);
+  ReadWithMode(mode, integer_lm, &parser);
   parser.Validate(MakeCountedArray(expect_counts),
                   MakeCountedArray(expect_ngrams));
 }
 
+// ArpaNGramReader must deliver the n-grams of the file in order, in batches
+// of at most batch_size n-grams of the same order, and stop early without
+// hanging if the reader is dropped.
+void ReadIntegerLmInBatches(int32 num_threads, int32 batch_size) {
+  KALDILM_LOG << "ReadIntegerLmInBatches(" << num_threads << ", "
+              << batch_size << ")";
+
+  static std::string integer_lm =
+      "\
+\\data\\\n\
+ngram 1=3\n\
+ngram 2=2\n\
+ngram 3=1\n\
+\n\
+\\1-grams:\n\
+-5.2\t4\t-3.3\n\
+-3.4\t5\n\
+0\t1\t-2.5\n\
+\n\
+\\2-grams:\n\
+-1.4\t4 5\t-3.2\n\
+-1.3\t1 4\t-4.2\n\
+\n\
+\\3-grams:\n\
+-0.3\t1 4 5\n\
+\n\
+\\end\\";
+
+  NGramTestData expect_ngrams[] = {
+      {7, -5.2, {4, 0, 0}, -3.3},  {8, -3.4, {5, 0, 0}, 0.0},
+      {9, 0.0, {1, 0, 0}, -2.5},   {12, -1.4, {4, 5, 0}, -3.2},
+      {13, -1.3, {1, 4, 0}, -4.2}, {16, -0.3, {1, 4, 5}, 0.0}};
+
+  ArpaParseOptions options;
+  options.bos_symbol = 1;
+  options.eos_symbol = 2;
+  options.num_threads = num_threads;
+
+  std::vector<NGramTestData> ngrams;
+  {
+    ArpaNGramReader reader(options, NULL, batch_size);
+    reader.Start(integer_lm.data(), integer_lm.size());
+    NGramBatch batch;
+    int32 last_order = 0;
+    while (reader.Next(&batch)) {
+      assert(batch.Size() > 0 && batch.Size() <= batch_size);
+      assert(batch.order >= last_order);
+      last_order = batch.order;
+      for (int32 i = 0; i != batch.Size(); ++i) {
+        NGramTestData entry = {0};
+        entry.line_number = batch.line_numbers[i];
+        entry.logprob = batch.logprobs[i];
+        entry.backoff = batch.backoffs[i];
+        std::copy(batch.Words(i), batch.Words(i) + batch.order, entry.words);
+        ngrams.push_back(entry);
+      }
+    }
+    assert(reader.Stats().ngrams == std::vector<int64_t>({3, 2, 1}));
+  }
+  assert(ngrams.size() == sizeof(expect_ngrams) / sizeof(expect_ngrams[0]));
+  assert(std::equal(ngrams.begin(), ngrams.end(), expect_ngrams,
+                    CompareNgrams));
+
+  ArpaNGramReader dropped(options, NULL, 1);
+  dropped.Start(integer_lm.data(), integer_lm.size());
+  NGramBatch batch;
+  assert(dropped.Next(&batch) && batch.Size() == 1);
+}
+
+// Consumes n-grams on the pipeline thread, and fails at the n-gram of the
+// given line.
+class FailingParser : public ArpaFileParser {
+ public:
+  FailingParser(const ArpaParseOptions &options, int32 fail_at_line)
+      : ArpaFileParser(options, NULL), fail_at_line_(fail_at_line) {}
+
+ protected:
+  void ConsumeNGrams(const NGramBatch &batch) override {
+    for (int32 i = 0; i != batch.Size(); ++i) {
+      if (batch.line_numbers[i] == fail_at_line_) {
+        KALDILM_ERR << "failed at line " << fail_at_line_;
+      }
+    }
+  }
+  bool CanConsumeConcurrently() const override { return true; }
+
+ private:
+  int32 fail_at_line_;
+};
+
+// Return the message of the error reading lm throws, or "" if none.
+std::string ReadError(const std::string &lm, ReadMode mode,
+                      int32 fail_at_line) {
+  ArpaParseOptions options;
+  options.bos_symbol = 1;
+  options.eos_symbol = 2;
+  options.num_threads = NumThreads(mode);
+  FailingParser parser(options, fail_at_line);
+  try {
+    ReadWithMode(mode, lm, &parser);
+  } catch (const std::runtime_error &e) {
+    return e.what();
+  }
+  return "";
+}
+
+// Errors are thrown as std::runtime_error, whichever thread finds them:
+// the parsing thread, a worker, or the consumer of the pipeline.
+void ReadErrorTests() {
+  KALDILM_LOG << "ReadErrorTests()";
+  std::string bad_lm =
+      "\\data\\\nngram 1=3\nngram 2=2\n\n"
+      "\\1-grams:\n-1\t1\n-1\t2\n-1\t4\n\n"
+      "\\2-grams:\n-1\t1 4\nx\t4 2\n\n\\end\\\n";
+  std::string good_lm = bad_lm;
+  good_lm.replace(good_lm.find("x\t"), 1, "-1");
+
+  // A FIFO is not read to its end after an error, so kReadPipe is left out.
+  for (ReadMode mode : {kReadStream, kReadMemory, kReadMappedFile,
+                        kReadMemoryInParallel}) {
+    KALDILM_LOG << "ReadErrorTests(" << mode << ")";
+    std::string error = ReadError(bad_lm, mode, -1);
+    assert(error.find("line 12") != std::string::npos);
+    assert(error.find("invalid n-gram logprob 'x'") != std::string::npos);
+
+    assert(ReadError(good_lm, mode, -1).empty());
+    assert(ReadError(good_lm, mode, 11) == "failed at line 11");
+  }
+
+  ArpaParseOptions options;
+  options.bos_symbol = 1;
+  options.eos_symbol = 2;
+  for (int32 num_threads : {1, 3}) {
+    options.num_threads = num_threads;
+    ArpaNGramReader reader(options, NULL, 1);
+    reader.Start(bad_lm.data(), bad_lm.size());
+    NGramBatch batch;
+    int32 num_ngrams = 0;
+    try {
+      while (reader.Next(&batch)) ++num_ngrams;
+      assert(false);
+    } catch (const std::runtime_error &e) {
+      assert(std::string(e.what()).find("line 12") != std::string::npos);
+    }
+    assert(num_ngrams == 4);
+  }
+}
+
+// Return data decompressed by DecompressingStreamBuf, or throw its error.
+std::string Decompress(const std::string &data) {
+  DecompressingStreamBuf buf(data.data(), data.size(),
+                             DetectCompression(data.data(), data.size()));
+  std::istream is(&buf);
+  is.exceptions(std::ios::badbit);
+  std::string ans;
+  char block[4096];
+  while (is.read(block, sizeof(block)) || is.gcount() != 0) {
+    ans.append(block, is.gcount());
+  }
+  return ans;
+}
+
+// Return the message of the error decompressing data throws, or "" if none.
+std::string DecompressError(const std::string &data) {
+  try {
+    Decompress(data);
+  } catch (const std::runtime_error &e) {
+    return e.what();
+  }
+  return "";
+}
+
+// Decompress data in each format kaldilm is built with: several blocks of
+// it, nothing, several members or frames, and truncated data, which is
+// also read by the parser.
+void DecompressionTests() {
+  std::vector<Compression> compressions;
+#ifdef KALDILM_HAVE_ZLIB
+  compressions.push_back(Compression::kGzip);
+#endif
+#ifdef KALDILM_HAVE_LZMA
+  compressions.push_back(Compression::kXz);
+#endif
+#ifdef KALDILM_HAVE_ZSTD
+  compressions.push_back(Compression::kZstd);
+#endif
+  const int32 num_bigrams = 200000;
+  std::ostringstream os;
+  os << "\\data\\\nngram 1=2\nngram 2=" << num_bigrams << "\n\n"
+     << "\\1-grams:\n-1\t1\n-1\t2\n\n\\2-grams:\n";
+  for (int32 i = 0; i != num_bigrams; ++i) {
+    os << "-0." << i % 97 << "\t" << 3 + i % 1000 << " "
+       << 3 + i * 7919 % 100003 << "\n";
+  }
+  os << "\n\\end\\\n";
+  std::string lm = os.str();
+  assert(lm.size() > (2 << 20));
+
+  for (Compression compression : compressions) {
+    KALDILM_LOG << "DecompressionTests(" << CompressionName(compression)
+                << ")";
+    std::string compressed = Compress(lm, compression);
+    assert(DetectCompression(compressed.data(), compressed.size()) ==
+           compression);
+    assert(Decompress(compressed) == lm);
+    assert(Decompress(Compress("", compression)).empty());
+
+    std::string head = lm.substr(0, 1000), tail = lm.substr(1000);
+    assert(Decompress(Compress(head, compression) +
+                      Compress(tail, compression) +
+                      Compress(head, compression)) == head + tail + head);
+
+    for (std::size_t size : {compressed.size() / 2, compressed.size() - 1}) {
+      std::string error = DecompressError(compressed.substr(0, size));
+      assert(error.find("Failed to decompress") != std::string::npos);
+      assert(error.find("truncated") != std::string::npos);
+    }
+
+    ArpaParseOptions options;
+    options.bos_symbol = 1;
+    options.eos_symbol = 2;
+    FailingParser parser(options, -1);
+    std::string error;
+    try {
+      ReadFile("arpa_file_parser_test.tmp.arpa.z",
+               compressed.substr(0, compressed.size() / 2), &parser);
+    } catch (const std::runtime_error &e) {
+      error = e.what();
+    }
+    assert(error.find("truncated") != std::string::npos);
+  }
+
+#ifdef KALDILM_HAVE_ZLIB
+  // Like gzip, ignore trailing data that does not start another member.
+  std::string padded = Compress(lm, Compression::kGzip) + std::string(8, '\0');
+  assert(Decompress(padded) == lm);
+#endif
+}
+
 // \xCE\xB2 = UTF-8 for Greek beta, to churn some UTF-8 cranks.
 static std::string symbolic_lm =
     "\
@@ -254,7 +739,8 @@ NGramTestData expect_symbolic_full[] = {
     {25, -0.3, {1, 4, 5}, 0.0},  {26, -0.2, {1, 4, 2}, 0.0}};
 
 // This is run with all possible oov setting and yields same result.
-void ReadSymbolicLmNoOovImpl(ArpaParseOptions::OovHandling oov) {
+void ReadSymbolicLmNoOovImpl(ArpaParseOptions::OovHandling oov,
+                             ReadMode mode) {
   int32 expect_counts[] = {4, 2, 2};
   TestSymbolTable symbols;
   symbols.AddSymbol("\xCE\xB2", 5);
@@ -264,50 +750,55 @@ void ReadSymbolicLmNoOovImpl(ArpaParseOptions::OovHandling oov) {
   options.eos_symbol = 2;
   options.unk_symbol = 3;
   options.oov_handling = oov;
+  options.num_threads = NumThreads(mode);
   TestableArpaFileParser parser(options, &symbols);
-  std::istringstream stm(symbolic_lm, std::ios_base::in);
-  parser.Read(stm);
+  ReadWithMode(mode, symbolic_lm, &parser);
   parser.Validate(MakeCountedArray(expect_counts),
                   MakeCountedArray(expect_symbolic_full));
   assert(symbols.NumSymbols() == 6);
 }
 
 void ReadSymbolicLmNoOovTests() {
-  KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kRaiseError)";
-  ReadSymbolicLmNoOovImpl(ArpaParseOptions::kRaiseError);
-  KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kAddToSymbols)";
-  ReadSymbolicLmNoOovImpl(ArpaParseOptions::kAddToSymbols);
-  KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kReplaceWithUnk)";
-  ReadSymbolicLmNoOovImpl(ArpaParseOptions::kReplaceWithUnk);
-  KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kSkipNGram)";
-  ReadSymbolicLmNoOovImpl(ArpaParseOptions::kSkipNGram);
+  for (ReadMode mode : kAllReadModes) {
+    KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kRaiseError, " << mode << ")";
+    ReadSymbolicLmNoOovImpl(ArpaParseOptions::kRaiseError, mode);
+    KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kAddToSymbols, " << mode << ")";
+    ReadSymbolicLmNoOovImpl(ArpaParseOptions::kAddToSymbols, mode);
+    KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kReplaceWithUnk, " << mode << ")";
+    ReadSymbolicLmNoOovImpl(ArpaParseOptions::kReplaceWithUnk, mode);
+    KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kSkipNGram, " << mode << ")";
+    ReadSymbolicLmNoOovImpl(ArpaParseOptions::kSkipNGram, mode);
+  }
 }
 
 // This is run with all possible oov setting and yields same result.
 void ReadSymbolicLmWithOovImpl(ArpaParseOptions::OovHandling oov,
                                CountedArray<NGramTestData> expect_ngrams,
-                               fst::SymbolTable *symbols) {
+                               fst::SymbolTable *symbols, ReadMode mode,
+                               CompileStats *stats = NULL) {
   int32 expect_counts[] = {4, 2, 2};
   ArpaParseOptions options;
   options.bos_symbol = 1;
   options.eos_symbol = 2;
   options.unk_symbol = 3;
   options.oov_handling = oov;
+  options.num_threads = NumThreads(mode);
   TestableArpaFileParser parser(options, symbols);
-  std::istringstream stm(symbolic_lm, std::ios_base::in);
-  parser.Read(stm);
+  ReadWithMode(mode, symbolic_lm, &parser);
   parser.Validate(MakeCountedArray(expect_counts), expect_ngrams);
+  if (stats != NULL) *stats = parser.Stats();
 }
 
-void ReadSymbolicLmWithOovAddToSymbols() {
+void ReadSymbolicLmWithOovAddToSymbols(ReadMode mode) {
   TestSymbolTable symbols;
   ReadSymbolicLmWithOovImpl(ArpaParseOptions::kAddToSymbols,
-                            MakeCountedArray(expect_symbolic_full), &symbols);
+                            MakeCountedArray(expect_symbolic_full), &symbols,
+                            mode);
   assert(symbols.NumSymbols() == 6);
   assert(symbols.Find("\xCE\xB2") == 5);
 }
 
-void ReadSymbolicLmWithOovReplaceWithUnk() {
+void ReadSymbolicLmWithOovReplaceWithUnk(ReadMode mode) {
   NGramTestData expect_symbolic_unk_b[] = {
       {15, -5.2, {4, 0, 0}, -3.3}, {16, -3.4, {3, 0, 0}, 0.0},
       {17, 0.0, {1, 0, 0}, -2.5},  {18, -4.3, {2, 0, 0}, 0.0},
@@ -318,11 +809,12 @@ void ReadSymbolicLmWithOovReplaceWithUnk() {
 
   TestSymbolTable symbols;
   ReadSymbolicLmWithOovImpl(ArpaParseOptions::kReplaceWithUnk,
-                            MakeCountedArray(expect_symbolic_unk_b), &symbols);
+                            MakeCountedArray(expect_symbolic_unk_b), &symbols,
+                            mode);
   assert(symbols.NumSymbols() == 5);
 }
 
-void ReadSymbolicLmWithOovSkipNGram() {
+void ReadSymbolicLmWithOovSkipNGram(ReadMode mode) {
   NGramTestData expect_symbolic_no_b[] = {{15, -5.2, {4, 0, 0}, -3.3},
                                           {17, 0.0, {1, 0, 0}, -2.5},
                                           {18, -4.3, {2, 0, 0}, 0.0},
@@ -332,25 +824,128 @@ void ReadSymbolicLmWithOovSkipNGram() {
                                           {26, -0.2, {1, 4, 2}, 0.0}};
 
   TestSymbolTable symbols;
+  CompileStats stats;
   ReadSymbolicLmWithOovImpl(ArpaParseOptions::kSkipNGram,
-                            MakeCountedArray(expect_symbolic_no_b), &symbols);
+                            MakeCountedArray(expect_symbolic_no_b), &symbols,
+                            mode, &stats);
   assert(symbols.NumSymbols() == 5);
+
+  int64_t expect_delivered[] = {3, 1, 1};
+  int64_t expect_skipped[] = {1, 1, 1};
+  assert(stats.ngrams ==
+         std::vector<int64_t>(expect_delivered, expect_delivered + 3));
+  assert(stats.skipped_ngrams ==
+         std::vector<int64_t>(expect_skipped, expect_skipped + 3));
+  assert(stats.phases.size() == 1 && stats.phases[0].name == "read");
+  assert(stats.bytes_read > 0);
+}
+
+// Words of a cache are mapped to symbols when it is read, so it gives the
+// same n-grams as the text for any symbol table and OOV handling.
+void ReadSymbolicLmFromCacheTests() {
+  TestSymbolTable symbols;
+  WriteCache(symbolic_lm, &symbols);
+  KALDILM_LOG << "ReadSymbolicLmNoOovImpl(kRaiseError, " << kReadCache << ")";
+  ReadSymbolicLmNoOovImpl(ArpaParseOptions::kRaiseError, kReadCache);
+  KALDILM_LOG << "ReadSymbolicLmWithOovAddToSymbols(" << kReadCache << ")";
+  ReadSymbolicLmWithOovAddToSymbols(kReadCache);
+  KALDILM_LOG << "ReadSymbolicLmWithOovReplaceWithUnk(" << kReadCache << ")";
+  ReadSymbolicLmWithOovReplaceWithUnk(kReadCache);
+  KALDILM_LOG << "ReadSymbolicLmWithOovSkipNGram(" << kReadCache << ")";
+  ReadSymbolicLmWithOovSkipNGram(kReadCache);
+  std::remove(kCacheFilename);
+}
+
+// Read lm with kAddToSymbols, and return the words and line numbers of its
+// n-grams, and the words added to symbols.
+void ReadAddingSymbols(const std::string &lm, int32 num_threads,
+                       TestSymbolTable *symbols, std::vector<int32> *words,
+                       std::vector<int32> *line_numbers) {
+  ArpaParseOptions options;
+  options.bos_symbol = 1;
+  options.eos_symbol = 2;
+  options.oov_handling = ArpaParseOptions::kAddToSymbols;
+  options.num_threads = num_threads;
+  ArpaNGramReader reader(options, symbols, 4096);
+  reader.Start(lm.data(), lm.size());
+  NGramBatch batch;
+  while (reader.Next(&batch)) {
+    for (int32 i = 0; i != batch.Size(); ++i) {
+      words->insert(words->end(), batch.Words(i), batch.Words(i) + batch.order);
+      line_numbers->push_back(batch.line_numbers[i]);
+    }
+  }
+}
+
+// The parallel mode adds the words of each chunk to the symbol table in
+// file order, so new words get the same symbols as with the serial reader,
+// also when they first appear in later chunks of a section, or after the
+// section that added the words the workers look up by themselves.
+void ReadLmAddingSymbolsInParallel() {
+  KALDILM_LOG << "ReadLmAddingSymbolsInParallel()";
+  // A few chunks of bigrams, every third of which has a new word after a
+  // word seen before, and trigrams of those words, with a few new ones.
+  const int32 num_bigrams = 150000, num_trigrams = 100000;
+  std::ostringstream os;
+  os << "\\data\\\nngram 1=2\nngram 2=" << num_bigrams
+     << "\nngram 3=" << num_trigrams << "\n\n"
+     << "\\1-grams:\n-1\t<s>\n-1\t</s>\n\n\\2-grams:\n";
+  for (int32 i = 0; i != num_bigrams; ++i) {
+    os << "-0.5\tw" << i * 7919 % (i / 3 + 1) << " w" << i / 3 << "\n";
+  }
+  os << "\n\\3-grams:\n";
+  for (int32 i = 0; i != num_trigrams; ++i) {
+    os << "-0.5\tw" << i % 50000 << " w" << i * 7919 % 50000 << " "
+       << (i % 1000 == 0 ? "x" : "w") << i / 2 << "\n";
+  }
+  os << "\n\\end\\\n";
+  std::string lm = os.str();
+
+  TestSymbolTable serial_symbols;
+  std::vector<int32> serial_words, serial_lines;
+  ReadAddingSymbols(lm, 1, &serial_symbols, &serial_words, &serial_lines);
+  assert(serial_symbols.NumSymbols() == 5 + num_bigrams / 3 + 100);
+
+  TestSymbolTable symbols;
+  std::vector<int32> words, lines;
+  ReadAddingSymbols(lm, 3, &symbols, &words, &lines);
+  assert(words == serial_words);
+  assert(lines == serial_lines);
+  assert(symbols.NumSymbols() == serial_symbols.NumSymbols());
+  for (int32 id = 0; id != symbols.NumSymbols(); ++id) {
+    assert(symbols.Find(id) == serial_symbols.Find(id));
+  }
 }
 
 void ReadSymbolicLmWithOovTests() {
-  KALDILM_LOG << "ReadSymbolicLmWithOovAddToSymbols()";
-  ReadSymbolicLmWithOovAddToSymbols();
-  KALDILM_LOG << "ReadSymbolicLmWithOovReplaceWithUnk()";
-  ReadSymbolicLmWithOovReplaceWithUnk();
-  KALDILM_LOG << "ReadSymbolicLmWithOovSkipNGram()";
-  ReadSymbolicLmWithOovSkipNGram();
+  for (ReadMode mode : kAllReadModes) {
+    KALDILM_LOG << "ReadSymbolicLmWithOovAddToSymbols(" << mode << ")";
+    ReadSymbolicLmWithOovAddToSymbols(mode);
+    KALDILM_LOG << "ReadSymbolicLmWithOovReplaceWithUnk(" << mode << ")";
+    ReadSymbolicLmWithOovReplaceWithUnk(mode);
+    KALDILM_LOG << "ReadSymbolicLmWithOovSkipNGram(" << mode << ")";
+    ReadSymbolicLmWithOovSkipNGram(mode);
+  }
 }
 
 }  // namespace
 }  // namespace kaldilm
 
 int main(int argc, char *argv[]) {
-  kaldilm::ReadIntegerLmLogconvExpectSuccess();
+  for (kaldilm::ReadMode mode : kaldilm::kAllReadModes) {
+    kaldilm::ReadIntegerLmLogconvExpectSuccess(mode);
+    kaldilm::ReadIntegerLmMaxOrder(mode);
+  }
+  kaldilm::ReadIntegerLmLogconvExpectSuccess(kaldilm::kReadCache);
+  for (int32 num_threads : {1, 3}) {
+    kaldilm::ReadIntegerLmInBatches(num_threads, 1);
+    kaldilm::ReadIntegerLmInBatches(num_threads, 2);
+    kaldilm::ReadIntegerLmInBatches(num_threads, 4096);
+  }
   kaldilm::ReadSymbolicLmNoOovTests();
   kaldilm::ReadSymbolicLmWithOovTests();
+  kaldilm::ReadSymbolicLmFromCacheTests();
+  kaldilm::ReadLmAddingSymbolsInParallel();
+  kaldilm::ReadErrorTests();
+  kaldilm::DecompressionTests();
 }
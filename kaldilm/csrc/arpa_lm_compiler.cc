@@ -12,40 +12,25 @@
 #include <algorithm>
 #include <cassert>
 #include <limits>
+#include <memory>
+#include <numeric>
 #include <sstream>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
 
+#include "kaldilm/csrc/hist_key.h"
+#include "kaldilm/csrc/history_tracker.h"
 #include "kaldilm/csrc/log.h"
-#include "kaldilm/csrc/remove_eps_local.h"
+#include "kaldilm/csrc/thread_pool.h"
 
 namespace kaldilm {
 
-/// A hashing function-object for vectors.
-template <typename Int>
-struct VectorHasher {  // hashing function for vector<Int>.
-  size_t operator()(const std::vector<Int> &x) const noexcept {
-    size_t ans = 0;
-    typename std::vector<Int>::const_iterator iter = x.begin(), end = x.end();
-    for (; iter != end; ++iter) {
-      ans *= kPrime;
-      ans += *iter;
-    }
-    return ans;
-  }
-  VectorHasher() {  // Check we're instantiated with an integer type.
-    static_assert(std::is_integral<Int>::value, "");
-  }
-
- private:
-  static const int kPrime = 7853;
-};
-
 class ArpaLmCompilerImplInterface {
  public:
   virtual ~ArpaLmCompilerImplInterface() = default;
-  virtual void ConsumeNGram(const NGram &ngram, bool is_highest) = 0;
+  virtual void ConsumeNGrams(const NGramBatch &batch, bool is_highest) = 0;
+  // Fill in how the histories were tracked.
+  virtual void GetHistoryStats(CompileStats *stats) const = 0;
 };
 
 namespace {
@@ -53,108 +38,104 @@ namespace {
 typedef int32_t StateId;
 typedef int32_t Symbol;
 
-// GeneralHistKey can represent state history in an arbitrarily large n
-// n-gram model with symbol ids fitting int32_t.
-class GeneralHistKey {
- public:
-  // Construct key from being and end iterators.
-  template <class InputIt>
-  GeneralHistKey(InputIt begin, InputIt end) : vector_(begin, end) {}
-  // Construct empty history key.
-  GeneralHistKey() : vector_() {}
-  // Return tails of the key as a GeneralHistKey. The tails of an n-gram
-  // w[1..n] is the sequence w[2..n] (and the heads is w[1..n-1], but the
-  // key class does not need this operartion).
-  GeneralHistKey Tails() const {
-    return GeneralHistKey(vector_.begin() + 1, vector_.end());
-  }
-  // Keys are equal if represent same state.
-  friend bool operator==(const GeneralHistKey &a, const GeneralHistKey &b) {
-    return a.vector_ == b.vector_;
-  }
-  // Public typename HashType for hashing.
-  struct HashType : public std::unary_function<GeneralHistKey, size_t> {
-    size_t operator()(const GeneralHistKey &key) const {
-      return VectorHasher<Symbol>().operator()(key.vector_);
-    }
-  };
-
- private:
-  std::vector<Symbol> vector_;
-};
-
-// OptimizedHistKey combines 3 21-bit symbol ID values into one 64-bit
-// machine word. allowing significant memory reduction and some runtime
-// benefit over GeneralHistKey. Since 3 symbols are enough to track history
-// in a 4-gram model, this optimized key is used for smaller models with up
-// to 4-gram and symbol values up to 2^21-1.
-//
-// See GeneralHistKey for interface requirements of a key class.
-class OptimizedHistKey {
- public:
-  enum {
-    kShift = 21,  // 21 * 3 = 63 bits for data.
-    kMaxData = (1 << kShift) - 1
-  };
-  template <class InputIt>
-  OptimizedHistKey(InputIt begin, InputIt end) : data_(0) {
-    for (uint32 shift = 0; begin != end; ++begin, shift += kShift) {
-      data_ |= static_cast<uint64_t>(*begin) << shift;
-    }
-  }
-  OptimizedHistKey() : data_(0) {}
-  OptimizedHistKey Tails() const { return OptimizedHistKey(data_ >> kShift); }
-  friend bool operator==(const OptimizedHistKey &a, const OptimizedHistKey &b) {
-    return a.data_ == b.data_;
-  }
-  struct HashType : public std::unary_function<OptimizedHistKey, size_t> {
-    size_t operator()(const OptimizedHistKey &key) const { return key.data_; }
-  };
+// A VectorFst keeps the arcs of each state in a vector of its own, so there is
+// nothing to reserve in advance.
+void ReserveTotalArcs(fst::StdVectorFst *fst, std::size_t n) {}
+void ReserveTotalArcs(CsrFst *fst, std::size_t n) { fst->ReserveTotalArcs(n); }
 
- private:
-  explicit OptimizedHistKey(uint64_t data) : data_(data) {}
-  uint64_t data_;
-};
+// The input label of the last arc of state s, which must have arcs.
+Symbol LastILabel(const fst::StdVectorFst &fst, StateId s) {
+  fst::ArcIterator<fst::StdVectorFst> aiter(fst, s);
+  aiter.Seek(fst.NumArcs(s) - 1);
+  return aiter.Value().ilabel;
+}
+Symbol LastILabel(const CsrFst &fst, StateId s) {
+  return fst.Arcs(s)[fst.NumArcs(s) - 1].ilabel;
+}
 
 }  // namespace
 
-template <class HistKey>
+// FstType is fst::StdVectorFst or CsrFst.
+template <class HistKey, class FstType>
 class ArpaLmCompilerImpl : public ArpaLmCompilerImplInterface {
  public:
-  ArpaLmCompilerImpl(ArpaLmCompiler *parent, fst::StdVectorFst *fst,
-                     Symbol sub_eps);
+  ArpaLmCompilerImpl(ArpaLmCompiler *parent, FstType *fst, Symbol sub_eps);
 
-  virtual void ConsumeNGram(const NGram &ngram, bool is_highest);
+  virtual void ConsumeNGrams(const NGramBatch &batch, bool is_highest);
+  virtual void GetHistoryStats(CompileStats *stats) const {
+    stats->general_history_key = std::is_same<HistKey, GeneralHistKey>::value;
+    stats->trie_history = history_.UsesTrie();
+    stats->history_load_factor = history_.HashLoadFactor();
+  }
 
  private:
-  StateId AddStateWithBackoff(HistKey key, float backoff);
-  void CreateBackoff(HistKey key, StateId state, float weight);
+  // Add the i-th n-gram of the batch. If num_siblings is not 0, the n-gram is
+  // the first of that many in a row with the same history.
+  void ConsumeNGram(const NGramBatch &batch, int32_t i, bool is_highest,
+                    int32_t num_siblings);
+  // Return the number of n-grams from the i-th one on that share its history.
+  int32_t CountSiblings(const NGramBatch &batch, int32_t i) const;
+  // Prefetch the history map slots ConsumeNGram() is going to look up.
+  void PrefetchNGram(const NGramBatch &batch, int32_t i, bool is_highest);
+  StateId AddStateWithBackoff(const Symbol *begin, const Symbol *end,
+                              float backoff);
+  void AddNGramArc(StateId source, const fst::StdArc &arc);
+  void CreateBackoff(const Symbol *begin, const Symbol *end, StateId state,
+                     float weight);
 
   ArpaLmCompiler *parent_;  // Not owned.
-  fst::StdVectorFst *fst_;  // Not owned.
+  FstType *fst_;  // Not owned.
   Symbol bos_symbol_;
   Symbol eos_symbol_;
   Symbol sub_eps_;
 
   StateId eos_state_;
-  typedef std::unordered_map<HistKey, StateId, typename HistKey::HashType>
-      HistoryMap;
-  HistoryMap history_;
+  TrieHistoryTracker<HistKey> history_;
+
+  // The state that got the last n-gram arc, the label of that arc, and
+  // whether the arcs of the state are known to be out of order.
+  StateId last_source_ = fst::kNoStateId;
+  Symbol last_label_ = 0;
+  bool last_source_unsorted_ = false;
 };
 
-template <class HistKey>
-ArpaLmCompilerImpl<HistKey>::ArpaLmCompilerImpl(ArpaLmCompiler *parent,
-                                                fst::StdVectorFst *fst,
-                                                Symbol sub_eps)
+template <class HistKey, class FstType>
+ArpaLmCompilerImpl<HistKey, FstType>::ArpaLmCompilerImpl(
+    ArpaLmCompiler *parent, FstType *fst, Symbol sub_eps)
     : parent_(parent),
       fst_(fst),
       bos_symbol_(parent->Options().bos_symbol),
       eos_symbol_(parent->Options().eos_symbol),
       sub_eps_(sub_eps) {
+  history_.SetMemoryBudget(parent->budget_.get());
+
+  // There is a history per n-gram of all but the highest order, plus the
+  // empty history. Orders above max_order are not read at all.
+  const std::vector<int32_t> &counts = parent->NgramCounts();
+  int32_t max_order = parent->Options().max_order;
+  if (max_order < 0 || max_order > counts.size()) max_order = counts.size();
+  std::vector<std::size_t> num_histories;
+  for (int32_t i = 0; i < max_order && i + 1 < counts.size(); ++i) {
+    num_histories.push_back(counts[i]);
+  }
+  history_.Reserve(num_histories);
+
+  // Every history gets a state, and so may the tails of the highest order
+  // n-grams, but these are rare. Add the 0-gram, and the start and </s>
+  // states for the case when <s> and </s> are kept.
+  std::size_t num_states = std::accumulate(
+      num_histories.begin(), num_histories.end(), std::size_t(3));
+  fst_->ReserveStates(num_states);
+  // Each n-gram adds an arc, and each state a backoff arc.
+  ReserveTotalArcs(fst_, std::accumulate(counts.begin(),
+                                         counts.begin() + max_order,
+                                         num_states));
+
   // The algorithm maintains state per history. The 0-gram is a special state
   // for empty history. All unigrams (including BOS) backoff into this state.
   StateId zerogram = fst_->AddState();
-  history_[HistKey()] = zerogram;
+  history_.Insert(nullptr, nullptr, zerogram);
+  if (!counts.empty()) fst_->ReserveArcs(zerogram, counts[0]);
 
   // Also, if </s> is not treated as epsilon, create a common end state for
   // all transitions accepting the </s>, since they do not back off. This small
@@ -165,9 +146,59 @@ ArpaLmCompilerImpl<HistKey>::ArpaLmCompilerImpl(ArpaLmCompiler *parent,
   }
 }
 
-template <class HistKey>
-void ArpaLmCompilerImpl<HistKey>::ConsumeNGram(const NGram &ngram,
-                                               bool is_highest) {
+template <class HistKey, class FstType>
+void ArpaLmCompilerImpl<HistKey, FstType>::ConsumeNGrams(
+    const NGramBatch &batch, bool is_highest) {
+  // Lookups of different n-grams are independent, so fetch the slots of a
+  // few n-grams ahead while working on the current one.
+  const int32_t kPrefetchDistance = 8;
+  int32_t n = batch.Size();
+  history_.StartOrder(batch.order);
+  for (int32_t i = 0; i < kPrefetchDistance && i < n; ++i) {
+    PrefetchNGram(batch, i, is_highest);
+  }
+  int32_t next_run = 0;  // Start of the next run of n-grams with same history.
+  for (int32_t i = 0; i != n; ++i) {
+    if (i + kPrefetchDistance < n) {
+      PrefetchNGram(batch, i + kPrefetchDistance, is_highest);
+    }
+    int32_t num_siblings = 0;
+    if (i == next_run) {
+      num_siblings = CountSiblings(batch, i);
+      next_run += num_siblings;
+    }
+    if (parent_->HasValidBosEos(batch, i)) {
+      ConsumeNGram(batch, i, is_highest, num_siblings);
+    }
+  }
+}
+
+template <class HistKey, class FstType>
+int32_t ArpaLmCompilerImpl<HistKey, FstType>::CountSiblings(
+    const NGramBatch &batch, int32_t i) const {
+  int32_t history_length = batch.order - 1;
+  const Symbol *history = batch.Words(i);
+  int32_t j = i + 1;
+  while (j != batch.Size() &&
+         std::equal(history, history + history_length, batch.Words(j))) {
+    ++j;
+  }
+  return j - i;
+}
+
+template <class HistKey, class FstType>
+inline void ArpaLmCompilerImpl<HistKey, FstType>::PrefetchNGram(
+    const NGramBatch &batch, int32_t i, bool is_highest) {
+  const Symbol *words = batch.Words(i);
+  const Symbol *words_end = words + batch.order;
+  history_.Prefetch(words, words_end - 1);
+  history_.Prefetch(words + (is_highest ? 1 : 0), words_end);
+}
+
+template <class HistKey, class FstType>
+inline void ArpaLmCompilerImpl<HistKey, FstType>::ConsumeNGram(
+    const NGramBatch &batch, int32_t i, bool is_highest,
+    int32_t num_siblings) {
   // Generally, we do the following. Suppose we are adding an n-gram "A B
   // C". Then find the node for "A B", add a new node for "A B C", and connect
   // them with the arc accepting "C" with the specified weight. Also, add a
@@ -192,21 +223,31 @@ void ArpaLmCompilerImpl<HistKey>::ConsumeNGram(const NGram &ngram,
   // of the n-gram is applied to its source node as final weight. If <s> and
   // </s> are preserved, then a special final node for </s> is allocated and
   // used as the destination of the "</s>" acceptor arc.
-  HistKey heads(ngram.words.begin(), ngram.words.end() - 1);
-  typename HistoryMap::iterator source_it = history_.find(heads);
-  if (source_it == history_.end()) {
+  const Symbol *words = batch.Words(i);
+  const Symbol *words_end = words + batch.order;
+  const StateId *source_it = history_.Find(words, words_end - 1);
+  if (source_it == nullptr) {
     // There was no "A B", therefore the probability of "A B C" is zero.
     // Print a warning and discard current n-gram.
+    ++parent_->skipped_ngrams_[batch.order - 1];
     if (parent_->ShouldWarn())
-      KALDILM_WARN << parent_->LineReference()
+      KALDILM_WARN << parent_->LineReference(batch, i)
                    << " skipped: no parent (n-1)-gram exists";
     return;
   }
 
-  StateId source = source_it->second;
+  StateId source = *source_it;
+  // In a sorted file, all n-grams with this history follow in a row, and
+  // give all the arcs of the source state but its backoff arc. Size the arc
+  // array once instead of growing it arc by arc. Reserve only if the state
+  // has no arcs of this order yet, so that unsorted input, where the runs
+  // are short and many, does not defeat the geometric growth.
+  if (num_siblings > 1 && fst_->NumArcs(source) <= 1) {
+    fst_->ReserveArcs(source, fst_->NumArcs(source) + num_siblings);
+  }
   StateId dest;
-  Symbol sym = ngram.words.back();
-  float weight = -ngram.logprob;
+  Symbol sym = words_end[-1];
+  float weight = -batch.logprobs[i];
   if (sym == sub_eps_ || sym == 0) {
     KALDILM_ERR << " <eps> or disambiguation symbol " << sym
                 << "found in the ARPA file. ";
@@ -226,9 +267,8 @@ void ArpaLmCompilerImpl<HistKey>::ConsumeNGram(const NGram &ngram,
     // non-highest, will create one (unless there are duplicate n-grams
     // in the grammar, which cannot be reliably detected if highest order,
     // so we better do not do that at all).
-    dest = AddStateWithBackoff(
-        HistKey(ngram.words.begin() + (is_highest ? 1 : 0), ngram.words.end()),
-        -ngram.backoff);
+    dest = AddStateWithBackoff(words + (is_highest ? 1 : 0), words_end,
+                               -batch.backoffs[i]);
   }
 
   if (sym == bos_symbol_) {
@@ -245,93 +285,180 @@ void ArpaLmCompilerImpl<HistKey>::ConsumeNGram(const NGram &ngram,
   }
 
   // Add arc from source to dest, whichever way it was found.
-  fst_->AddArc(source, fst::StdArc(sym, sym, weight, dest));
+  AddNGramArc(source, fst::StdArc(sym, sym, weight, dest));
   return;
 }
 
-// Find or create a new state for n-gram defined by key, and ensure it has a
-// backoff transition.  The key is either the current n-gram for all but
+// Add an n-gram arc, and record its source state as unsorted if the arc is
+// not in input label order. In a sorted ARPA file, the n-gram arcs of a
+// state come in a row, after its backoff arc if it has one, so comparing
+// with the last arc added is enough. A state that gets a second row of arcs
+// is assumed to be unsorted, unless its only arc so far precedes the row.
+template <class HistKey, class FstType>
+inline void ArpaLmCompilerImpl<HistKey, FstType>::AddNGramArc(
+    StateId source, const fst::StdArc &arc) {
+  bool unsorted;
+  if (source == last_source_) {
+    unsorted = !last_source_unsorted_ && arc.ilabel < last_label_;
+  } else {
+    // The only arc is usually the backoff arc. It is a unigram arc of the
+    // zerogram if the row of unigrams was broken by the <s> unigram, which
+    // adds its arc to the start state when sub_eps_ is 0.
+    std::size_t num_arcs = fst_->NumArcs(source);
+    unsorted = num_arcs > 1 ||
+               (num_arcs == 1 && arc.ilabel < LastILabel(*fst_, source));
+    last_source_ = source;
+    last_source_unsorted_ = false;
+  }
+  if (unsorted) {
+    if (parent_->ilabel_sort_) parent_->unsorted_states_.push_back(source);
+    last_source_unsorted_ = true;
+  }
+  last_label_ = arc.ilabel;
+  fst_->AddArc(source, arc);
+}
+
+// Find or create a new state for n-gram [begin, end), and ensure it has a
+// backoff transition.  The n-gram is either the current one for all but
 // highest orders, or the tails of the n-gram for the highest order. The
 // latter arises from the chain-collapsing optimization described above.
-template <class HistKey>
-StateId ArpaLmCompilerImpl<HistKey>::AddStateWithBackoff(HistKey key,
-                                                         float backoff) {
-  typename HistoryMap::iterator dest_it = history_.find(key);
-  if (dest_it != history_.end()) {
+template <class HistKey, class FstType>
+StateId ArpaLmCompilerImpl<HistKey, FstType>::AddStateWithBackoff(
+    const Symbol *begin, const Symbol *end, float backoff) {
+  const StateId *dest_it = history_.Find(begin, end);
+  if (dest_it != nullptr) {
     // Found an existing state in the history map. Invariant: if the state in
     // the map, then its backoff arc is in the FST. We are done.
-    return dest_it->second;
+    return *dest_it;
   }
   // Otherwise create a new state and its backoff arc, and register in the map.
   StateId dest = fst_->AddState();
-  history_[key] = dest;
-  CreateBackoff(key.Tails(), dest, backoff);
+  history_.Insert(begin, end, dest);
+  CreateBackoff(begin + 1, end, dest, backoff);
   return dest;
 }
 
-// Create a backoff arc for a state. Key is a backoff destination that may or
-// may not exist. When the destination is not found, naturally fall back to
-// the lower order model, and all the way down until one is found (since the
+// Create a backoff arc for a state. [begin, end) is a backoff destination that
+// may or may not exist. When the destination is not found, naturally fall back
+// to the lower order model, and all the way down until one is found (since the
 // 0-gram model is always present, the search is guaranteed to terminate).
-template <class HistKey>
-inline void ArpaLmCompilerImpl<HistKey>::CreateBackoff(HistKey key,
-                                                       StateId state,
-                                                       float weight) {
-  typename HistoryMap::iterator dest_it = history_.find(key);
-  while (dest_it == history_.end()) {
-    key = key.Tails();
-    dest_it = history_.find(key);
+template <class HistKey, class FstType>
+inline void ArpaLmCompilerImpl<HistKey, FstType>::CreateBackoff(
+    const Symbol *begin, const Symbol *end, StateId state, float weight) {
+  const StateId *dest_it = history_.Find(begin, end);
+  while (dest_it == nullptr) {
+    ++begin;
+    dest_it = history_.Find(begin, end);
   }
 
   // The arc should transduce either <eos> or #0 to <eps>, depending on the
   // epsilon substitution mode. This is the only case when input and output
   // label may differ.
-  fst_->AddArc(state, fst::StdArc(sub_eps_, 0, weight, dest_it->second));
+  fst_->AddArc(state, fst::StdArc(sub_eps_, 0, weight, *dest_it));
 }
 
 ArpaLmCompiler::~ArpaLmCompiler() {
   if (impl_ != NULL) delete impl_;
 }
 
+template <class HistKey>
+ArpaLmCompilerImplInterface *ArpaLmCompiler::CreateImpl() {
+  if (use_csr_) {
+    return new ArpaLmCompilerImpl<HistKey, CsrFst>(this, &csr_, sub_eps_);
+  }
+  return new ArpaLmCompilerImpl<HistKey, fst::StdVectorFst>(this, &fst_,
+                                                            sub_eps_);
+}
+
+template <int kNumWords, int kBits>
+bool ArpaLmCompiler::CreatePackedImpl(int64 max_symbol,
+                                      int32_t history_length) {
+  typedef PackedHistKey<kNumWords, kBits> HistKey;
+  if (history_length > HistKey::kCapacity || max_symbol >= HistKey::kMaxData) {
+    return false;
+  }
+  impl_ = CreateImpl<HistKey>();
+  KALDILM_LOG << "Using " << 64 * kNumWords << "-bit history keys with "
+              << kBits << " bits per symbol.";
+  return true;
+}
+
+void ArpaLmCompiler::SetMemoryBudget(std::size_t max_bytes,
+                                     const std::string &tmp_dir) {
+  KALDILM_ASSERT(impl_ == nullptr);
+  budget_.reset(new MemoryBudget(max_bytes, tmp_dir));
+}
+
 void ArpaLmCompiler::HeaderAvailable() {
   assert(impl_ == NULL);
-  // Use optimized implementation if the grammar is 4-gram or less, and the
-  // maximum attained symbol id will fit into the optimized range.
+  skipped_ngrams_.assign(NgramCounts().size(), 0);
+  if (use_csr_) csr_.SetMemoryBudget(budget_.get());
+  unsorted_states_ = SpillableArray<int32_t>(budget_.get());
+  // Use a packed key if the history of the grammar and the maximum attained
+  // symbol id fit into it.
   int64 max_symbol = 0;
-  if (Symbols() != NULL) max_symbol = Symbols()->AvailableKey() - 1;
+  if (Symbols() != NULL) {
+    max_symbol = Symbols()->AvailableKey() - 1;
+  } else {
+    // Symbols in the file are integers that may be anything up to int32 max.
+    max_symbol = std::numeric_limits<int32_t>::max();
+  }
   // If augmenting the symbol table, assume the worst case when all words in
   // the model being read are novel.
   if (Options().oov_handling == ArpaParseOptions::kAddToSymbols)
     max_symbol += NgramCounts()[0];
 
-  if (NgramCounts().size() <= 4 && max_symbol < OptimizedHistKey::kMaxData) {
-    impl_ = new ArpaLmCompilerImpl<OptimizedHistKey>(this, &fst_, sub_eps_);
-  } else {
-    impl_ = new ArpaLmCompilerImpl<GeneralHistKey>(this, &fst_, sub_eps_);
-    KALDILM_LOG << "Reverting to slower state tracking because model is large: "
-                << NgramCounts().size() << "-gram with symbols up to "
-                << max_symbol;
+  // The longest history is that of the (n-1)-grams of an n-gram model. Try
+  // the smallest keys first; for a given key size, any bit width that fits
+  // is as good as another.
+  int32_t history_length = NgramCounts().size() - 1;
+  if (use_general_hist_key_) {
+    impl_ = CreateImpl<GeneralHistKey>();
+    return;
+  }
+  if (CreatePackedImpl<1, 32>(max_symbol, history_length) ||
+      CreatePackedImpl<1, 21>(max_symbol, history_length) ||
+      CreatePackedImpl<1, 16>(max_symbol, history_length) ||
+      CreatePackedImpl<2, 32>(max_symbol, history_length) ||
+      CreatePackedImpl<2, 21>(max_symbol, history_length) ||
+      CreatePackedImpl<2, 16>(max_symbol, history_length) ||
+      CreatePackedImpl<3, 32>(max_symbol, history_length) ||
+      CreatePackedImpl<3, 21>(max_symbol, history_length) ||
+      CreatePackedImpl<3, 16>(max_symbol, history_length)) {
+    return;
   }
+  impl_ = CreateImpl<GeneralHistKey>();
+  KALDILM_LOG << "Reverting to slower state tracking because model is large: "
+              << NgramCounts().size() << "-gram with symbols up to "
+              << max_symbol;
 }
 
-void ArpaLmCompiler::ConsumeNGram(const NGram &ngram) {
+bool ArpaLmCompiler::HasValidBosEos(const NGramBatch &batch, int32_t i) {
   // <s> is invalid in tails, </s> in heads of an n-gram.
-  for (int i = 0; i < ngram.words.size(); ++i) {
-    if ((i > 0 && ngram.words[i] == Options().bos_symbol) ||
-        (i + 1 < ngram.words.size() &&
-         ngram.words[i] == Options().eos_symbol)) {
+  const int32_t *words = batch.Words(i);
+  for (int j = 0; j < batch.order; ++j) {
+    if ((j > 0 && words[j] == Options().bos_symbol) ||
+        (j + 1 < batch.order && words[j] == Options().eos_symbol)) {
+      ++skipped_ngrams_[batch.order - 1];
       if (ShouldWarn())
-        KALDILM_WARN << LineReference()
+        KALDILM_WARN << LineReference(batch, i)
                      << " skipped: n-gram has invalid BOS/EOS placement";
-      return;
+      return false;
     }
   }
+  return true;
+}
 
-  bool is_highest = ngram.words.size() == NgramCounts().size();
-  impl_->ConsumeNGram(ngram, is_highest);
+void ArpaLmCompiler::ConsumeNGrams(const NGramBatch &batch) {
+  bool is_highest = batch.order == NgramCounts().size();
+  PhaseTimer timer;
+  double start_cpu = ThreadCpuSeconds();
+  impl_->ConsumeNGrams(batch, is_highest);
+  build_stats_.wall_seconds += timer.WallSeconds();
+  build_stats_.cpu_seconds += ThreadCpuSeconds() - start_cpu;
 }
 
-void ArpaLmCompiler::RemoveRedundantStates() {
+void ArpaLmCompiler::RemoveRedundantStates(ThreadPool *pool) {
   fst::StdArc::Label backoff_symbol = sub_eps_;
   if (backoff_symbol == 0) {
     // The method of removing redundant states implemented in this function
@@ -345,43 +472,196 @@ void ArpaLmCompiler::RemoveRedundantStates() {
     // problem.
     return;
   }
+  if (use_csr_) {
+    csr_.RemoveRedundantStates(backoff_symbol, pool);
+    return;
+  }
 
-  fst::StdArc::StateId num_states = fst_.NumStates();
-
-  // replace the #0 symbols on the input of arcs out of redundant states (states
-  // that are not final and have only a backoff arc leaving them), with <eps>.
-  for (fst::StdArc::StateId state = 0; state < num_states; state++) {
-    if (fst_.NumArcs(state) == 1 &&
-        fst_.Final(state) == fst::TropicalWeight::Zero()) {
-      fst::MutableArcIterator<fst::StdVectorFst> iter(&fst_, state);
-      fst::StdArc arc = iter.Value();
-      if (arc.ilabel == backoff_symbol) {
-        arc.ilabel = 0;
-        iter.SetValue(arc);
+  // Redundant states are not final and have only a backoff arc leaving them.
+  // Kaldi replaces the #0 on their backoff arcs with <eps> and calls
+  // fst::RemoveEpsLocal(), which combines each arc into such a state with the
+  // backoff arc. Here arcs are redirected to the end of the backoff chain
+  // directly, in a single pass over the arcs, which gives the same FST up to
+  // the order of arcs. It never adds states or arcs.
+  typedef fst::StdArc Arc;
+  Arc::StateId num_states = fst_.NumStates();
+  auto is_redundant = [this, backoff_symbol](Arc::StateId s) {
+    return fst_.NumArcs(s) == 1 && fst_.Final(s) == Arc::Weight::Zero() &&
+           fst::ArcIterator<fst::StdVectorFst>(fst_, s).Value().ilabel ==
+               backoff_symbol;
+  };
+  Arc::StateId start = fst_.Start();
+  if (start != fst::kNoStateId && is_redundant(start)) {
+    // No arc enters the start state, which is kept with an epsilon arc.
+    fst::MutableArcIterator<fst::StdVectorFst> iter(&fst_, start);
+    Arc arc = iter.Value();
+    arc.ilabel = 0;
+    iter.SetValue(arc);
+  }
+  std::vector<char> redundant(num_states);
+  ParallelForRanges(pool, num_states, [&](int32_t i, std::size_t begin,
+                                          std::size_t end) {
+    for (Arc::StateId s = begin; s != end; ++s) redundant[s] = is_redundant(s);
+  });
+
+  // Find the arcs to redirect, and their new weights and destinations. The
+  // FST is only read here. It is changed afterwards on this thread, because
+  // changing an arc of a VectorFst also updates the properties of the FST.
+  struct Redirect {
+    Arc::StateId state;
+    std::size_t pos;
+    Arc arc;
+  };
+  std::vector<std::vector<Redirect>> redirects(NumRanges(pool, num_states));
+  ParallelForRanges(pool, num_states, [&](int32_t i, std::size_t begin,
+                                          std::size_t end) {
+    for (Arc::StateId s = begin; s != end; ++s) {
+      if (redundant[s]) continue;
+      std::size_t pos = 0;
+      for (fst::ArcIterator<fst::StdVectorFst> aiter(fst_, s); !aiter.Done();
+           aiter.Next(), ++pos) {
+        Arc arc = aiter.Value();
+        if (!redundant[arc.nextstate]) continue;
+        // A redundant state may back off to another one, but the chain is not
+        // longer than the order of the model.
+        do {
+          Arc backoff =
+              fst::ArcIterator<fst::StdVectorFst>(fst_, arc.nextstate).Value();
+          arc.weight = fst::Times(arc.weight, backoff.weight);
+          arc.nextstate = backoff.nextstate;
+        } while (redundant[arc.nextstate]);
+        redirects[i].push_back({s, pos, arc});
       }
     }
+  });
+  for (const std::vector<Redirect> &range : redirects) {
+    for (const Redirect &r : range) {
+      fst::MutableArcIterator<fst::StdVectorFst> iter(&fst_, r.state);
+      iter.Seek(r.pos);
+      iter.SetValue(r.arc);
+    }
   }
 
-  // we could call fst::RemoveEps, and it would have the same effect in normal
-  // cases, where backoff_symbol != 0 and there are no epsilons in unexpected
-  // places, but RemoveEpsLocal is a bit safer in case something weird is going
-  // on; it guarantees not to blow up the FST.
-  fst::RemoveEpsLocal(&fst_);
+  // No arc enters redundant states any more.
+  std::vector<Arc::StateId> dead;
+  for (Arc::StateId s = 0; s != num_states; ++s) {
+    if (redundant[s]) dead.push_back(s);
+  }
+  fst_.DeleteStates(dead);
   KALDILM_LOG << "Reduced num-states from " << num_states << " to "
               << fst_.NumStates();
 }
 
+void ArpaLmCompiler::ILabelSort(ThreadPool *pool) {
+  typedef fst::StdArc Arc;
+  std::sort(unsorted_states_.begin(), unsorted_states_.end());
+  unsorted_states_.resize(std::unique(unsorted_states_.begin(),
+                                      unsorted_states_.end()) -
+                          unsorted_states_.begin());
+  if (!unsorted_states_.empty()) {
+    KALDILM_LOG << "Arcs of " << unsorted_states_.size()
+                << " states were added out of input label order. "
+                << "Sorting them.";
+  }
+  if (use_csr_) {
+    csr_.ILabelSort(unsorted_states_, pool);
+  } else {
+    // The arcs are sorted in parallel, and written back on this thread,
+    // because changing an arc of a VectorFst also updates the properties
+    // of the FST. States are taken a block at a time, so that the sorted
+    // copies stay small even if no state is sorted.
+    const std::size_t kBlockSize = 1 << 16;
+    std::size_t num_states = unsorted_states_.size();
+    for (std::size_t block = 0; block < num_states; block += kBlockSize) {
+      const int32_t *states = unsorted_states_.data() + block;
+      std::size_t n = std::min(kBlockSize, num_states - block);
+      std::vector<std::vector<Arc>> sorted(NumRanges(pool, n));
+      ParallelForRanges(pool, n, [&](int32_t i, std::size_t begin,
+                                     std::size_t end) {
+        for (std::size_t j = begin; j != end; ++j) {
+          std::size_t first = sorted[i].size();
+          for (fst::ArcIterator<fst::StdVectorFst> aiter(fst_, states[j]);
+               !aiter.Done(); aiter.Next()) {
+            sorted[i].push_back(aiter.Value());
+          }
+          std::sort(sorted[i].begin() + first, sorted[i].end(),
+                    fst::ILabelCompare<Arc>());
+        }
+      });
+      // Ranges are in order, and each state has arcs.
+      const int32_t *s = states;
+      for (const std::vector<Arc> &arcs : sorted) {
+        for (auto arc = arcs.begin(); arc != arcs.end(); ++s) {
+          for (fst::MutableArcIterator<fst::StdVectorFst> aiter(&fst_, *s);
+               !aiter.Done(); aiter.Next()) {
+            aiter.SetValue(*arc++);
+          }
+        }
+      }
+    }
+  }
+  SpillableArray<int32_t>().swap(unsorted_states_);
+}
+
 void ArpaLmCompiler::Check() const {
-  if (fst_.Start() == fst::kNoStateId) {
+  StateId start = use_csr_ ? csr_.Start() : fst_.Start();
+  if (start == fst::kNoStateId) {
     KALDILM_ERR << "Arpa file did not contain the beginning-of-sentence symbol "
                 << Symbols()->Find(Options().bos_symbol) << ".";
   }
 }
 
 void ArpaLmCompiler::ReadComplete() {
-  fst_.SetInputSymbols(Symbols());
-  fst_.SetOutputSymbols(Symbols());
-  // RemoveRedundantStates();
+  CompileStats *stats = MutableStats();
+  build_stats_.name = "build";
+  build_stats_.peak_rss_bytes = PeakRssBytes();
+  stats->phases.push_back(build_stats_);
+  for (std::size_t i = 0; i != skipped_ngrams_.size(); ++i) {
+    stats->skipped_ngrams[i] += skipped_ngrams_[i];
+  }
+  impl_->GetHistoryStats(stats);
+
+  if (use_csr_) {
+    PhaseTimer timer;
+    csr_.Finish();
+    timer.Finish("finish", stats);
+    csr_.SetSymbols(Symbols());
+  } else {
+    fst_.SetInputSymbols(Symbols());
+    fst_.SetOutputSymbols(Symbols());
+  }
+  std::unique_ptr<ThreadPool> pool;
+  if (Options().num_threads != 1 &&
+      (ilabel_sort_ || remove_redundant_states_)) {
+    pool.reset(new ThreadPool(Options().num_threads));
+  }
+  // Sorting comes first, while unsorted_states_ has the current state ids.
+  // Removing redundant states keeps the order of arcs.
+  if (ilabel_sort_) {
+    PhaseTimer timer;
+    ILabelSort(pool.get());
+    timer.Finish("ilabel_sort", stats);
+  }
+  if (remove_redundant_states_) {
+    PhaseTimer timer;
+    RemoveRedundantStates(pool.get());
+    timer.Finish("remove_redundant_states", stats);
+  }
+  if (ilabel_sort_ && !use_csr_) {
+    // Changing arcs of a VectorFst clears the property.
+    fst_.SetProperties(fst::kILabelSorted, fst::kILabelSorted);
+  }
+
+  if (use_csr_) {
+    stats->num_states = csr_.NumStates();
+    stats->num_arcs = csr_.NumArcs();
+  } else {
+    stats->num_states = fst_.NumStates();
+    for (StateId s = 0; s != fst_.NumStates(); ++s) {
+      stats->num_arcs += fst_.NumArcs(s);
+    }
+  }
+  stats->peak_rss_bytes = PeakRssBytes();
   Check();
 }
 
@@ -6,40 +6,119 @@
 // Copyright 2009-2011 Gilles Boulianne
 // Copyright 2016 Smart Action LLC (kkm)
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "fst/fstlib.h"
 #include "fst/symbol-table.h"
 #include "kaldilm/csrc/arpa_file_parser.h"
+#include "kaldilm/csrc/compile_stats.h"
+#include "kaldilm/csrc/csr_fst.h"
 
 namespace kaldilm {
 
 class ArpaLmCompilerImplInterface;
+class ThreadPool;
 
 class ArpaLmCompiler : public ArpaFileParser {
  public:
+  // If use_csr is true, the model is compiled into a CsrFst, which is
+  // returned by Csr() and can be written as an fst::ConstFst, and Fst() stays
+  // empty. This needs about half the memory of compiling into a VectorFst and
+  // converting that.
   ArpaLmCompiler(const ArpaParseOptions &options, int sub_eps,
-                 fst::SymbolTable *symbols)
-      : ArpaFileParser(options, symbols), sub_eps_(sub_eps), impl_(nullptr) {}
+                 fst::SymbolTable *symbols, bool use_csr = false)
+      : ArpaFileParser(options, symbols),
+        sub_eps_(sub_eps),
+        use_csr_(use_csr),
+        impl_(nullptr) {}
   ~ArpaLmCompiler();
 
   const fst::StdVectorFst &Fst() const { return fst_; }
   fst::StdVectorFst *MutableFst() { return &fst_; }
 
+  const CsrFst &Csr() const { return csr_; }
+  CsrFst *MutableCsr() { return &csr_; }
+
+  // Keep the large arrays of the compiler, i.e., those of the history trie
+  // and of the CsrFst, within max_bytes of memory. Arrays that do not fit
+  // are moved to temporary files in tmp_dir; see MemoryBudget. The result
+  // is the same. A VectorFst cannot be moved, so this is mostly useful with
+  // use_csr. Must be called before Read().
+  void SetMemoryBudget(std::size_t max_bytes, const std::string &tmp_dir);
+
+  // Remove states that are not final and have only a backoff arc, once the
+  // model is read, by redirecting the arcs into them. This needs a
+  // disambiguation symbol (sub_eps != 0), and uses Options().num_threads
+  // threads. Never adds states or arcs. It is off by default.
+  void SetRemoveRedundantStates(bool remove) {
+    remove_redundant_states_ = remove;
+  }
+
+  // Sort the arcs of each state by input label once the model is read, and
+  // mark the FST as sorted. Arcs come in that order from an ARPA file whose
+  // n-grams are sorted the same way as the ids of their words, e.g., when
+  // the ids are assigned in the order of the unigram section. Only the
+  // states whose arcs come out of order are sorted, using
+  // Options().num_threads threads. It is off by default.
+  void SetILabelSort(bool sort) { ilabel_sort_ = sort; }
+
+  // Key histories with GeneralHistKey even if a packed key could hold them,
+  // e.g., to compare the two. It is slower, and off by default.
+  void SetUseGeneralHistKey(bool use) { use_general_hist_key_ = use; }
+
  protected:
   // ArpaFileParser overrides.
   void HeaderAvailable() override;
-  void ConsumeNGram(const NGram &ngram) override;
+  void ConsumeNGrams(const NGramBatch &batch) override;
   void ReadComplete() override;
+  // The model is built on a thread of its own while the file is parsed.
+  bool CanConsumeConcurrently() const override { return true; }
 
  private:
   // this function removes states that only have a backoff arc coming
-  // out of them.
-  void RemoveRedundantStates();
+  // out of them. If pool is not nullptr, it works on ranges of states in
+  // parallel.
+  void RemoveRedundantStates(ThreadPool *pool = nullptr);
+  // Sort the arcs of the states in unsorted_states_ by input label.
+  void ILabelSort(ThreadPool *pool = nullptr);
   void Check() const;
 
+  // Create impl_ with PackedHistKey<kNumWords, kBits> and return true, if
+  // the key can hold histories of the given length and symbols up to
+  // max_symbol.
+  template <int kNumWords, int kBits>
+  bool CreatePackedImpl(int64 max_symbol, int32_t history_length);
+
+  // Return a new ArpaLmCompilerImpl that compiles into fst_ or csr_.
+  template <class HistKey>
+  ArpaLmCompilerImplInterface *CreateImpl();
+
+  // Return false, after a warning, if <s> or </s> is misplaced in the i-th
+  // n-gram of the batch.
+  bool HasValidBosEos(const NGramBatch &batch, int32_t i);
+
   int sub_eps_;
+  bool use_csr_;
+  bool remove_redundant_states_ = false;
+  bool ilabel_sort_ = false;
+  bool use_general_hist_key_ = false;
+  // Declared before the arrays it accounts for, so that it outlives them.
+  std::unique_ptr<MemoryBudget> budget_;
+  // States whose arcs were not added in input label order. A state may be
+  // listed more than once.
+  SpillableArray<int32_t> unsorted_states_;
   ArpaLmCompilerImplInterface *impl_;  // Owned.
+  // Time spent in impl_->ConsumeNGrams(), and n-grams it skipped per order.
+  // Updated on the thread that consumes the n-grams.
+  PhaseStats build_stats_;
+  std::vector<int64_t> skipped_ngrams_;
   fst::StdVectorFst fst_;
-  template <class HistKey>
+  CsrFst csr_;
+  template <class HistKey, class FstType>
   friend class ArpaLmCompilerImpl;
 };
 
@@ -0,0 +1,425 @@
+// kaldilm/csrc/arpa_lm_compiler_benchmark.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+// Time the stages of compiling a synthetic ARPA model: tokenization, float
+// parsing and symbol lookup on their own, and then the compilation with each
+// history key, its history tracking and arc sorting, epsilon removal and
+// serialization. The model is generated from a seed, and is the same on
+// every platform for the same options.
+//
+// Usage:
+//   arpa_lm_compiler_benchmark [options]
+//
+// Options:
+//   --vocab-size=N     Number of words besides <s> and </s> (20000).
+//   --order=N          Order of the model (3).
+//   --counts=N2,..,Nn  N-grams of orders 2 to n (10 times vocab-size each).
+//                      Fewer may be generated if there are not that many
+//                      distinct ones.
+//   --sorted=BOOL      Whether the n-grams of each order are sorted (true).
+//   --seed=N           Seed of the generator (0).
+//   --hist-key=KEY     packed, general or both (both).
+//   --csr=BOOL         Compile into a CsrFst rather than a VectorFst (false).
+//   --num-threads=N    As ArpaParseOptions::num_threads (1).
+//   --write-arpa=FILE  Also write the generated model to FILE.
+//
+// The results are written to stdout as a JSON object, for tracking
+// throughput across releases; logs go to stderr.
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "fst/fstlib.h"
+#include "kaldilm/csrc/arpa_lm_compiler.h"
+#include "kaldilm/csrc/compile_stats.h"
+#include "kaldilm/csrc/log.h"
+#include "kaldilm/csrc/remove_eps_local.h"
+#include "kaldilm/csrc/string_utils.h"
+
+namespace kaldilm {
+
+struct BenchmarkOptions {
+  int32_t vocab_size = 20000;
+  int32_t order = 3;
+  std::vector<int32_t> counts;  // Of orders 2 and up.
+  bool sorted = true;
+  uint32_t seed = 0;
+  bool packed_key = true;
+  bool general_key = true;
+  bool csr = false;
+  int32_t num_threads = 1;
+  std::string write_arpa;
+};
+
+// The words of a generated model are indexes: 0 is <s>, 1 is </s> and
+// 2 + i is the i-th word of the vocabulary.
+static std::string Token(int32_t word) {
+  if (word == 0) return "<s>";
+  if (word == 1) return "</s>";
+  return "w" + std::to_string(word - 2);
+}
+
+// std::mt19937 gives the same numbers everywhere, but the standard
+// distributions do not, so they are done by hand.
+class Random {
+ public:
+  explicit Random(uint32_t seed) : gen_(seed) {}
+  uint32_t Uniform(uint32_t n) { return gen_() % n; }
+  float Real(float low, float high) {
+    return low + (high - low) * ((gen_() >> 8) * (1.0f / 16777216));
+  }
+
+ private:
+  std::mt19937 gen_;
+};
+
+struct SyntheticArpa {
+  std::string text;
+  std::vector<int32_t> counts;  // Per order, as in the \data\ section.
+  // Byte range of the lines of each n-gram section, by order.
+  std::vector<std::size_t> section_begin;
+  std::vector<std::size_t> section_end;
+};
+
+typedef std::vector<std::vector<int32_t>> NGrams;
+
+// Return up to `count` distinct n-grams, each a history of the lower order
+// n-grams followed by a word other than <s>.
+static NGrams GenerateOrder(const NGrams &lower, int32_t num_words,
+                            int32_t count, Random *random) {
+  NGrams histories;
+  for (const auto &ngram : lower) {
+    if (ngram.back() != 1) histories.push_back(ngram);  // Not ending in </s>.
+  }
+  NGrams ngrams;
+  // Duplicates are dropped, so top up a few times.
+  std::size_t target = count;
+  for (int32_t round = 0; round != 8 && ngrams.size() < target; ++round) {
+    for (std::size_t i = ngrams.size(); i < target; ++i) {
+      std::vector<int32_t> ngram = histories[random->Uniform(histories.size())];
+      ngram.push_back(1 + random->Uniform(num_words - 1));
+      ngrams.push_back(ngram);
+    }
+    std::sort(ngrams.begin(), ngrams.end());
+    ngrams.erase(std::unique(ngrams.begin(), ngrams.end()), ngrams.end());
+  }
+  return ngrams;
+}
+
+static void Shuffle(NGrams *ngrams, Random *random) {
+  for (std::size_t i = ngrams->size(); i > 1; --i) {
+    std::swap((*ngrams)[i - 1], (*ngrams)[random->Uniform(i)]);
+  }
+}
+
+static SyntheticArpa GenerateArpa(const BenchmarkOptions &opts) {
+  Random random(opts.seed);
+  int32_t num_words = opts.vocab_size + 2;
+  std::vector<NGrams> orders(opts.order);
+  for (int32_t w = 0; w != num_words; ++w) orders[0].push_back({w});
+  for (int32_t k = 1; k < opts.order; ++k) {
+    orders[k] =
+        GenerateOrder(orders[k - 1], num_words, opts.counts[k - 1], &random);
+  }
+  if (!opts.sorted) {
+    for (NGrams &ngrams : orders) Shuffle(&ngrams, &random);
+  }
+
+  SyntheticArpa arpa;
+  std::ostringstream os;
+  os << "\\data\\\n";
+  for (const NGrams &ngrams : orders) {
+    arpa.counts.push_back(ngrams.size());
+    os << "ngram " << arpa.counts.size() << "=" << ngrams.size() << "\n";
+  }
+  char number[32];
+  for (int32_t k = 0; k != opts.order; ++k) {
+    os << "\n\\" << k + 1 << "-grams:\n";
+    arpa.section_begin.push_back(os.tellp());
+    for (const auto &ngram : orders[k]) {
+      bool is_bos = k == 0 && ngram[0] == 0;
+      snprintf(number, sizeof(number), "%.6f",
+               is_bos ? -99.0f : random.Real(-7, -0.1f));
+      os << number;
+      for (int32_t word : ngram) os << '\t' << Token(word);
+      if (k + 1 < opts.order && ngram.back() != 1) {
+        snprintf(number, sizeof(number), "%.6f", random.Real(-2, 0));
+        os << '\t' << number;
+      }
+      os << '\n';
+    }
+    arpa.section_end.push_back(os.tellp());
+  }
+  os << "\n\\end\\\n";
+  arpa.text = os.str();
+  return arpa;
+}
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+static std::string StageJson(double seconds, int64_t items) {
+  std::ostringstream os;
+  os << "{\"seconds\": " << seconds << ", \"items\": " << items
+     << ", \"items_per_second\": " << (seconds > 0 ? items / seconds : 0)
+     << "}";
+  return os.str();
+}
+
+// The fields of the n-gram lines, split as the parser does.
+struct Fields {
+  std::vector<StringPiece> fields;
+  std::vector<std::size_t> line_begin;  // Index of the first field per line.
+  std::vector<int32_t> line_order;
+};
+
+static std::string TimeTokenization(const SyntheticArpa &arpa,
+                                    Fields *fields) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<StringPiece> columns;
+  for (std::size_t k = 0; k != arpa.counts.size(); ++k) {
+    const char *p = arpa.text.data() + arpa.section_begin[k];
+    const char *end = arpa.text.data() + arpa.section_end[k];
+    while (p != end) {
+      const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+      SplitStringToPieces(StringPiece(p, eol), " \t", true, &columns);
+      fields->line_begin.push_back(fields->fields.size());
+      fields->line_order.push_back(k + 1);
+      fields->fields.insert(fields->fields.end(), columns.begin(),
+                            columns.end());
+      p = eol + 1;
+    }
+  }
+  fields->line_begin.push_back(fields->fields.size());
+  double seconds = Seconds(start);
+  KALDILM_LOG << "Tokenized " << fields->fields.size() << " fields in "
+              << seconds << " s";
+  return StageJson(seconds, fields->fields.size());
+}
+
+static std::string TimeFloatParsing(const Fields &fields) {
+  auto start = std::chrono::steady_clock::now();
+  int64_t num_floats = 0;
+  float sum = 0, x;
+  for (std::size_t i = 0; i + 1 != fields.line_begin.size(); ++i) {
+    const StringPiece *line = &fields.fields[fields.line_begin[i]];
+    std::size_t num_fields = fields.line_begin[i + 1] - fields.line_begin[i];
+    if (!ConvertStringToReal(line[0], &x)) KALDILM_ERR << "Bad logprob";
+    sum += x;
+    ++num_floats;
+    if (num_fields > fields.line_order[i] + 1) {
+      if (!ConvertStringToReal(line[fields.line_order[i] + 1], &x)) {
+        KALDILM_ERR << "Bad backoff";
+      }
+      sum += x;
+      ++num_floats;
+    }
+  }
+  double seconds = Seconds(start);
+  KALDILM_LOG << "Parsed " << num_floats << " floats in " << seconds
+              << " s (sum " << sum << ")";
+  return StageJson(seconds, num_floats);
+}
+
+static std::string TimeSymbolLookup(const Fields &fields,
+                                    const fst::SymbolTable &symbols) {
+  auto start = std::chrono::steady_clock::now();
+  int64_t num_words = 0, sum = 0;
+  std::string token;
+  for (std::size_t i = 0; i + 1 != fields.line_begin.size(); ++i) {
+    const StringPiece *line = &fields.fields[fields.line_begin[i]];
+    for (int32_t j = 1; j <= fields.line_order[i]; ++j) {
+      token.assign(line[j].data, line[j].size);
+      sum += symbols.Find(token);
+      ++num_words;
+    }
+  }
+  double seconds = Seconds(start);
+  KALDILM_LOG << "Looked up " << num_words << " words in " << seconds
+              << " s (sum " << sum << ")";
+  return StageJson(seconds, num_words);
+}
+
+// Compile the model with the given history key, and return the results as
+// a JSON object.
+static std::string RunCompiler(const BenchmarkOptions &opts,
+                               const SyntheticArpa &arpa, bool general_key) {
+  fst::SymbolTable symbols;
+  symbols.AddSymbol("<eps>", 0);
+  ArpaParseOptions options;
+  options.bos_symbol = symbols.AddSymbol("<s>");
+  options.eos_symbol = symbols.AddSymbol("</s>");
+  options.oov_handling = ArpaParseOptions::kAddToSymbols;
+  options.num_threads = opts.num_threads;
+
+  KALDILM_LOG << "Compiling with " << (general_key ? "general" : "packed")
+              << " history keys.";
+  ArpaLmCompiler compiler(options, 0, &symbols, opts.csr);
+  compiler.SetUseGeneralHistKey(general_key);
+  compiler.SetILabelSort(true);
+  compiler.Read(arpa.text.data(), arpa.text.size());
+
+  std::ostringstream os;
+  os << "{\"hist_key\": \"" << (general_key ? "general" : "packed")
+     << "\", \"compile\": " << compiler.Stats().ToJson();
+
+  // Backoff arcs are epsilons, as sub_eps is 0.
+  if (!opts.csr) {
+    fst::StdVectorFst fst(compiler.Fst());
+    auto start = std::chrono::steady_clock::now();
+    fst::RemoveEpsLocal(&fst);
+    double seconds = Seconds(start);
+    os << ", \"remove_eps_local\": "
+       << StageJson(seconds, compiler.Fst().NumStates());
+  }
+
+  std::ostringstream fst_stream;
+  fst::FstWriteOptions wopts("<memory>");
+  auto start = std::chrono::steady_clock::now();
+  if (opts.csr) {
+    compiler.Csr().Write(fst_stream, wopts);
+  } else {
+    compiler.Fst().Write(fst_stream, wopts);
+  }
+  double seconds = Seconds(start);
+  int64_t bytes = fst_stream.tellp();
+  os << ", \"serialize\": " << StageJson(seconds, bytes) << "}";
+  return os.str();
+}
+
+static void Run(const BenchmarkOptions &opts) {
+  auto start = std::chrono::steady_clock::now();
+  SyntheticArpa arpa = GenerateArpa(opts);
+  double generate_seconds = Seconds(start);
+  KALDILM_LOG << "Generated " << arpa.text.size() << " bytes of ARPA in "
+              << generate_seconds << " s";
+  if (!opts.write_arpa.empty()) {
+    std::ofstream os(opts.write_arpa, std::ios::binary);
+    os << arpa.text;
+    if (!os) KALDILM_ERR << "Failed to write " << opts.write_arpa;
+  }
+
+  fst::SymbolTable symbols;
+  symbols.AddSymbol("<eps>", 0);
+  for (int32_t w = 0; w != opts.vocab_size + 2; ++w) {
+    symbols.AddSymbol(Token(w));
+  }
+
+  Fields fields;
+  std::string tokenize = TimeTokenization(arpa, &fields);
+  std::string parse_floats = TimeFloatParsing(fields);
+  std::string symbol_lookup = TimeSymbolLookup(fields, symbols);
+  fields = Fields();
+
+  std::vector<std::string> runs;
+  if (opts.packed_key) runs.push_back(RunCompiler(opts, arpa, false));
+  if (opts.general_key) runs.push_back(RunCompiler(opts, arpa, true));
+
+  std::ostringstream os;
+  os << "{\"config\": {\"vocab_size\": " << opts.vocab_size
+     << ", \"order\": " << opts.order << ", \"counts\": [";
+  for (std::size_t k = 0; k != arpa.counts.size(); ++k) {
+    os << (k == 0 ? "" : ", ") << arpa.counts[k];
+  }
+  os << "], \"sorted\": " << (opts.sorted ? "true" : "false")
+     << ", \"seed\": " << opts.seed
+     << ", \"csr\": " << (opts.csr ? "true" : "false")
+     << ", \"num_threads\": " << opts.num_threads
+     << ", \"arpa_bytes\": " << arpa.text.size() << "}, \"stages\": {"
+     << "\"generate\": " << StageJson(generate_seconds, arpa.text.size())
+     << ", \"tokenize\": " << tokenize << ", \"parse_floats\": " << parse_floats
+     << ", \"symbol_lookup\": " << symbol_lookup << "}, \"runs\": [";
+  for (std::size_t i = 0; i != runs.size(); ++i) {
+    os << (i == 0 ? "" : ", ") << runs[i];
+  }
+  os << "]}";
+  std::cout << os.str() << std::endl;
+}
+
+static bool ParseBool(const std::string &value) {
+  if (value == "true" || value == "1") return true;
+  if (value == "false" || value == "0") return false;
+  KALDILM_ERR << "Invalid boolean value '" << value << "'";
+  return false;
+}
+
+static BenchmarkOptions ParseOptions(int argc, char *argv[]) {
+  BenchmarkOptions opts;
+  bool has_counts = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    std::size_t equal = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equal == std::string::npos) {
+      KALDILM_ERR << "Invalid argument '" << arg << "', expected --name=value";
+    }
+    std::string name = arg.substr(2, equal - 2);
+    std::string value = arg.substr(equal + 1);
+    if (name == "vocab-size") {
+      opts.vocab_size = atoi(value.c_str());
+    } else if (name == "order") {
+      opts.order = atoi(value.c_str());
+    } else if (name == "counts") {
+      std::vector<StringPiece> pieces;
+      SplitStringToPieces(StringPiece(value.data(), value.size()), ",", true,
+                          &pieces);
+      for (const StringPiece &piece : pieces) {
+        int32_t count;
+        if (!ConvertStringToInteger(piece, &count) || count <= 0) {
+          KALDILM_ERR << "Invalid count '" << piece << "'";
+        }
+        opts.counts.push_back(count);
+      }
+      has_counts = true;
+    } else if (name == "sorted") {
+      opts.sorted = ParseBool(value);
+    } else if (name == "seed") {
+      opts.seed = strtoul(value.c_str(), nullptr, 10);
+    } else if (name == "hist-key") {
+      opts.packed_key = value == "packed" || value == "both";
+      opts.general_key = value == "general" || value == "both";
+      if (!opts.packed_key && !opts.general_key) {
+        KALDILM_ERR << "Invalid history key '" << value << "'";
+      }
+    } else if (name == "csr") {
+      opts.csr = ParseBool(value);
+    } else if (name == "num-threads") {
+      opts.num_threads = atoi(value.c_str());
+    } else if (name == "write-arpa") {
+      opts.write_arpa = value;
+    } else {
+      KALDILM_ERR << "Unknown option --" << name;
+    }
+  }
+  if (opts.vocab_size < 1 || opts.order < 1) {
+    KALDILM_ERR << "vocab-size and order must be positive";
+  }
+  if (!has_counts) {
+    opts.counts.assign(opts.order - 1, 10 * opts.vocab_size);
+  }
+  if (opts.counts.size() != opts.order - 1) {
+    KALDILM_ERR << "Expected " << opts.order - 1 << " counts, for orders 2 to "
+                << opts.order << ", but got " << opts.counts.size();
+  }
+  return opts;
+}
+
+}  // namespace kaldilm
+
+int main(int argc, char *argv[]) {
+  kaldilm::Run(kaldilm::ParseOptions(argc, argv));
+}
@@ -14,11 +14,22 @@
 #define NDEBUG
 #endif
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
+#include "fst/script/print.h"
+#include "kaldilm/csrc/fst_arrays.h"
+#include "kaldilm/csrc/fst_text_writer.h"
 #include "kaldilm/csrc/log.h"
+#include "kaldilm/csrc/remove_eps_local.h"
 
 namespace kaldilm {
 
@@ -76,8 +87,20 @@ static fst::StdVectorFst *CreateGenFst(bool seps, const fst::SymbolTable *pst) {
   return genFst;
 }
 
-// Compile given ARPA file.
-ArpaLmCompiler *Compile(bool seps, const std::string &infile) {
+// How to compile the model in a test.
+struct CompileOptions {
+  bool use_csr = false;
+  // Move all arrays that can be moved to temporary files.
+  bool spill = false;
+  bool remove_redundant_states = false;
+  bool ilabel_sort = false;
+  int32_t num_threads = 1;
+  bool general_hist_key = false;
+};
+
+// Compile an ARPA model read from a stream.
+ArpaLmCompiler *Compile(bool seps, std::istream &is,
+                        const CompileOptions &opts = CompileOptions()) {
   ArpaParseOptions options;
   fst::SymbolTable symbols;
   // Use spaces on special symbols, so we rather fail than read them by mistake.
@@ -86,18 +109,27 @@ ArpaLmCompiler *Compile(bool seps, const std::string &infile) {
   options.bos_symbol = symbols.AddSymbol("<s>", kBos);
   options.eos_symbol = symbols.AddSymbol("</s>", kEos);
   options.oov_handling = ArpaParseOptions::kAddToSymbols;
+  options.num_threads = opts.num_threads;
 
   // Tests in this form cannot be run with epsilon substitution, unless every
   // random path is also fitted with a #0-transducing self-loop.
   ArpaLmCompiler *lm_compiler =
-      new ArpaLmCompiler(options, seps ? kDisambig : 0, &symbols);
-  {
-    std::ifstream inf(infile);
-    lm_compiler->Read(inf);
-  }
+      new ArpaLmCompiler(options, seps ? kDisambig : 0, &symbols, opts.use_csr);
+  if (opts.spill) lm_compiler->SetMemoryBudget(0, "");
+  lm_compiler->SetRemoveRedundantStates(opts.remove_redundant_states);
+  lm_compiler->SetILabelSort(opts.ilabel_sort);
+  lm_compiler->SetUseGeneralHistKey(opts.general_hist_key);
+  lm_compiler->Read(is);
   return lm_compiler;
 }
 
+// Compile given ARPA file.
+ArpaLmCompiler *Compile(bool seps, const std::string &infile,
+                        const CompileOptions &opts = CompileOptions()) {
+  std::ifstream inf(infile);
+  return Compile(seps, inf, opts);
+}
+
 // Add a state to an FSA after last_state, add a form last_state to the new
 // state, and return the new state.
 fst::StdArc::StateId AddToChainFsa(fst::StdMutableFst *fst,
@@ -153,10 +185,462 @@ bool CoverageTest(bool seps, const std::string &infile) {
   return ok;
 }
 
-bool ScoringTest(bool seps, const std::string &infile,
-                 const std::string &sentence, float expected) {
+// Write the model compiled by a CSR compiler as a ConstFst, and read it back.
+// Unless ilabel_sort is false, the arcs are sorted first; they must be sorted
+// anyway.
+fst::StdConstFst *ReadBackConstFst(ArpaLmCompiler *lm_compiler,
+                                   bool ilabel_sort = true) {
+  if (ilabel_sort) lm_compiler->MutableCsr()->ILabelSort();
+  std::stringstream ss;
+  lm_compiler->Csr().Write(ss, fst::FstWriteOptions("<test>"));
+  fst::StdConstFst *result =
+      fst::StdConstFst::Read(ss, fst::FstReadOptions("<test>"));
+  assert(result != nullptr);
+  assert(result->Properties(fst::kILabelSorted, false) == fst::kILabelSorted);
+  return result;
+}
+
+// Without epsilon substitution, no states are removed, and compiling into
+// CSR layout must give exactly the same FST, whether or not the arrays are
+// spilled to disk.
+bool ConstFstTest(const std::string &infile, bool spill = false) {
+  ArpaLmCompiler *lm_compiler = Compile(false, infile);
+  fst::ArcSort(lm_compiler->MutableFst(), fst::StdILabelCompare());
+  CompileOptions opts;
+  opts.use_csr = true;
+  opts.spill = spill;
+  ArpaLmCompiler *csr_compiler = Compile(false, infile, opts);
+  fst::StdConstFst *const_fst = ReadBackConstFst(csr_compiler);
+
+  bool ok = fst::Equal(lm_compiler->Fst(), *const_fst);
+  if (!ok) KALDILM_WARN << "ConstFst test failed on " << infile;
+  delete const_fst;
+  delete csr_compiler;
+  delete lm_compiler;
+  return ok;
+}
+
+// Make the backoff arcs of redundant states epsilon arcs, and remove them
+// with fst::RemoveEpsLocal().
+void RemoveEpsLocal(fst::StdVectorFst *fst) {
+  for (fst::StateIterator<fst::StdVectorFst> siter(*fst); !siter.Done();
+       siter.Next()) {
+    fst::StdArc::StateId s = siter.Value();
+    if (fst->Final(s) != fst::StdArc::Weight::Zero() || fst->NumArcs(s) != 1)
+      continue;
+    fst::MutableArcIterator<fst::StdVectorFst> aiter(fst, s);
+    fst::StdArc arc = aiter.Value();
+    if (arc.ilabel != kDisambig) continue;
+    arc.ilabel = arc.olabel = kEps;
+    aiter.SetValue(arc);
+  }
+  fst::RemoveEpsLocal(fst);
+  fst::ArcSort(fst, fst::StdILabelCompare());
+}
+
+// Sorting only the states whose arcs come out of order must give the same
+// FST as sorting all of them afterwards, in both layouts.
+bool ILabelSortTest(bool seps, const std::string &infile) {
+  ArpaLmCompiler *lm_compiler = Compile(seps, infile);
+  fst::ArcSort(lm_compiler->MutableFst(), fst::StdILabelCompare());
+  CompileOptions opts;
+  opts.ilabel_sort = true;
+  opts.num_threads = 2;
+  ArpaLmCompiler *sorted_compiler = Compile(seps, infile, opts);
+  opts.use_csr = true;
+  ArpaLmCompiler *csr_compiler = Compile(seps, infile, opts);
+  fst::StdConstFst *const_fst = ReadBackConstFst(csr_compiler, false);
+
+  bool ok = sorted_compiler->Fst().Properties(fst::kILabelSorted, false) ==
+                fst::kILabelSorted &&
+            fst::Equal(lm_compiler->Fst(), sorted_compiler->Fst()) &&
+            fst::Equal(lm_compiler->Fst(), *const_fst);
+  if (!ok) KALDILM_WARN << "ILabelSort test failed on " << infile;
+  delete const_fst;
+  delete csr_compiler;
+  delete sorted_compiler;
+  delete lm_compiler;
+  return ok;
+}
+
+// An SRILM-style model, with </s> as the first unigram and <s> as the
+// second, compiled without epsilon substitution. The <s> unigram adds its arc
+// to a new start state, between the unigram arcs of the zerogram. Reading the
+// symbols from a table where </s> has the highest id puts them out of order,
+// which ilabel_sort must notice.
+bool ILabelSortEosFirstTest(bool use_csr) {
+  fst::SymbolTable symbols;
+  symbols.AddSymbol("<eps>", 0);
+  ArpaParseOptions options;
+  options.bos_symbol = symbols.AddSymbol("<s>");
+  symbols.AddSymbol("a");
+  symbols.AddSymbol("b");
+  options.eos_symbol = symbols.AddSymbol("</s>");
+  options.oov_handling = ArpaParseOptions::kSkipNGram;
+  std::istringstream is(
+      "\\data\\\nngram 1=4\nngram 2=2\n\n"
+      "\\1-grams:\n-1.0\t</s>\n-99\t<s>\t-0.5\n-1.5\ta\t-0.3\n"
+      "-1.7\tb\t-0.2\n\n"
+      "\\2-grams:\n-0.5\t<s> a\n-0.6\ta b\n\n\\end\\\n");
+  ArpaLmCompiler lm_compiler(options, 0, &symbols, use_csr);
+  lm_compiler.SetILabelSort(true);
+  lm_compiler.Read(is);
+
+  bool ok = true;
+  if (use_csr) {
+    const CsrFst &fst = lm_compiler.Csr();
+    ok &= fst.IsILabelSorted();
+    for (fst::StdArc::StateId s = 0; s != fst.NumStates(); ++s) {
+      const fst::StdArc *arcs = fst.Arcs(s);
+      for (std::size_t i = 1; i < fst.NumArcs(s); ++i) {
+        ok &= arcs[i - 1].ilabel <= arcs[i].ilabel;
+      }
+    }
+  } else {
+    const fst::StdVectorFst &fst = lm_compiler.Fst();
+    ok &= fst.Properties(fst::kILabelSorted, false) == fst::kILabelSorted;
+    for (fst::StdArc::StateId s = 0; s != fst.NumStates(); ++s) {
+      fst::StdArc::Label last = 0;
+      for (fst::ArcIterator<fst::StdVectorFst> aiter(fst, s); !aiter.Done();
+           aiter.Next()) {
+        ok &= last <= aiter.Value().ilabel;
+        last = aiter.Value().ilabel;
+      }
+    }
+  }
+  if (!ok) {
+    KALDILM_WARN << "ILabelSort test failed with </s> first"
+                 << (use_csr ? " in CSR layout" : "");
+  }
+  return ok;
+}
+
+// Return the contents of the given file.
+std::string ReadText(const std::string &filename) {
+  std::ifstream is(filename);
+  std::ostringstream os;
+  os << is.rdbuf();
+  return os.str();
+}
+
+// Return the ARPA model with the n-grams of each section shuffled.
+std::string ShuffleNGrams(const std::string &lm) {
+  std::istringstream is(lm);
+  std::ostringstream os;
+  std::mt19937 gen(lm.size());
+  std::vector<std::string> ngrams;
+  std::string line;
+  bool in_section = false;
+  while (std::getline(is, line)) {
+    if (in_section && !line.empty()) {
+      ngrams.push_back(line);
+      continue;
+    }
+    std::shuffle(ngrams.begin(), ngrams.end(), gen);
+    for (const std::string &ngram : ngrams) os << ngram << "\n";
+    ngrams.clear();
+    in_section = line.size() > 7 && line.compare(line.size() - 7, 7,
+                                                  "-grams:") == 0;
+    os << line << "\n";
+  }
+  return os.str();
+}
+
+// Return the ARPA model with every other n-gram of the highest order
+// dropped, which leaves states with only a backoff arc.
+std::string DropHighestOrderNGrams(const std::string &lm) {
+  std::istringstream is(lm);
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(is, line)) lines.push_back(line);
+  std::size_t header = 0, section = 0;
+  for (std::size_t i = 0; i != lines.size(); ++i) {
+    if (lines[i].compare(0, 6, "ngram ") == 0) header = i;
+    if (lines[i].size() > 7 &&
+        lines[i].compare(lines[i].size() - 7, 7, "-grams:") == 0) {
+      section = i;
+    }
+  }
+  std::size_t end = section + 1;
+  while (end != lines.size() && !lines[end].empty()) ++end;
+  // Keep the n-grams at odd offsets from the section header.
+  lines[header] = lines[header].substr(0, lines[header].find('=') + 1) +
+                  std::to_string((end - section) / 2);
+  std::ostringstream os;
+  for (std::size_t i = 0; i != lines.size(); ++i) {
+    if (i <= section || i >= end || (i - section) % 2 == 1) {
+      os << lines[i] << "\n";
+    }
+  }
+  return os.str();
+}
+
+// With epsilon substitution, removing redundant states must remove some
+// states, and give the same FST in both layouts, in parallel or not, and
+// as fst::RemoveEpsLocal(), whether or not the n-grams are sorted. The
+// compiler does not run fst::RemoveEpsLocal(), but redirects the arcs into
+// each redundant state in place; see CsrFst::RemoveRedundantStates().
+bool RedundantStatesTest(const std::string &name, const std::string &lm) {
+  bool ok = true;
+  for (bool shuffle : {false, true}) {
+    std::string input = shuffle ? ShuffleNGrams(lm) : lm;
+    std::istringstream is(input);
+    std::unique_ptr<ArpaLmCompiler> lm_compiler(Compile(true, is));
+    fst::StdVectorFst eps_removed_fst(lm_compiler->Fst());
+    RemoveEpsLocal(&eps_removed_fst);
+
+    for (int32_t num_threads : {1, 2}) {
+      CompileOptions opts;
+      opts.remove_redundant_states = true;
+      opts.num_threads = num_threads;
+      std::istringstream reduced_is(input);
+      std::unique_ptr<ArpaLmCompiler> reduced_compiler(
+          Compile(true, reduced_is, opts));
+      fst::ArcSort(reduced_compiler->MutableFst(), fst::StdILabelCompare());
+      opts.use_csr = true;
+      std::istringstream csr_is(input);
+      std::unique_ptr<ArpaLmCompiler> csr_compiler(
+          Compile(true, csr_is, opts));
+      std::unique_ptr<fst::StdConstFst> const_fst(
+          ReadBackConstFst(csr_compiler.get()));
+
+      ok &= reduced_compiler->Fst().NumStates() <
+                lm_compiler->Fst().NumStates() &&
+            fst::Equal(reduced_compiler->Fst(), *const_fst) &&
+            fst::Equal(reduced_compiler->Fst(), eps_removed_fst);
+    }
+    if (!ok) {
+      KALDILM_WARN << "Redundant states test failed on " << name
+                   << (shuffle ? " shuffled" : "");
+      break;
+    }
+  }
+  return ok;
+}
+
+// Exporting the model into arrays must keep every arc and final weight, and
+// give the same arrays in parallel or not for the model compiled in CSR
+// layout, which is exported from its ConstFst as in arpa2fst().
+bool FstArraysTest(bool seps, const std::string &infile) {
+  CompileOptions opts;
+  opts.ilabel_sort = true;
+  ArpaLmCompiler *lm_compiler = Compile(seps, infile, opts);
+  opts.use_csr = true;
+  ArpaLmCompiler *csr_compiler = Compile(seps, infile, opts);
+  fst::StdConstFst *const_fst = ReadBackConstFst(csr_compiler);
+  const fst::StdVectorFst &fst = lm_compiler->Fst();
+  FstArrays arrays;
+  ExportFstArrays(fst, nullptr, &arrays);
+  FstArrays csr_arrays;
+  ThreadPool pool(2);
+  ExportFstArrays(*const_fst, &pool, &csr_arrays);
+
+  bool ok = arrays.start == fst.Start() &&
+            arrays.row_splits.size() == std::size_t(fst.NumStates()) + 1 &&
+            arrays.final_weight.size() == std::size_t(fst.NumStates());
+  for (fst::StdArc::StateId s = 0; ok && s != fst.NumStates(); ++s) {
+    ok &= arrays.final_weight[s] == fst.Final(s).Value();
+    int64_t i = arrays.row_splits[s];
+    for (fst::ArcIterator<fst::StdVectorFst> aiter(fst, s); !aiter.Done();
+         aiter.Next(), ++i) {
+      const fst::StdArc &arc = aiter.Value();
+      ok &= i < arrays.row_splits[s + 1] && arrays.src[i] == s &&
+            arrays.dst[i] == arc.nextstate && arrays.ilabel[i] == arc.ilabel &&
+            arrays.olabel[i] == arc.olabel &&
+            arrays.weight[i] == arc.weight.Value();
+    }
+    ok &= i == arrays.row_splits[s + 1];
+  }
+  ok &= arrays.start == csr_arrays.start &&
+        arrays.row_splits == csr_arrays.row_splits &&
+        arrays.src == csr_arrays.src && arrays.dst == csr_arrays.dst &&
+        arrays.ilabel == csr_arrays.ilabel &&
+        arrays.olabel == csr_arrays.olabel &&
+        arrays.weight == csr_arrays.weight &&
+        arrays.final_weight == csr_arrays.final_weight;
+  if (!ok) KALDILM_WARN << "FstArrays test failed on " << infile;
+  delete const_fst;
+  delete csr_compiler;
+  delete lm_compiler;
+  return ok;
+}
+
+// The text writer must write exactly what fst::FstPrinter writes, in
+// parallel or not.
+bool TextWriterTest(bool seps, const std::string &infile) {
   ArpaLmCompiler *lm_compiler = Compile(seps, infile);
-  const fst::SymbolTable *symbols = lm_compiler->Fst().InputSymbols();
+  std::ostringstream expected;
+  fst::FstPrinter<fst::StdArc> printer(lm_compiler->Fst(), nullptr, nullptr,
+                                       nullptr, false, false, "\t");
+  printer.Print(&expected, "<test>");
+  std::ostringstream os;
+  WriteFstText(lm_compiler->Fst(), nullptr, os);
+  std::string text;
+  ThreadPool pool(2);
+  WriteFstText(lm_compiler->Fst(), &pool, &text);
+
+  bool ok = os.str() == expected.str() && text == expected.str();
+  if (!ok) KALDILM_WARN << "Text writer test failed on " << infile;
+  delete lm_compiler;
+  return ok;
+}
+
+// Return a model of the given order, whose n-grams are the word sequences
+// of random sentences over a small vocabulary, sorted as the ids of their
+// words. The ids of the words of the sentences come after those of
+// num_extra_words unigrams that are not in any sentence.
+std::string HighOrderLm(int32_t order, int32_t num_extra_words) {
+  std::vector<std::string> vocab;
+  for (int32_t i = 0; i != num_extra_words; ++i) {
+    vocab.push_back("x" + std::to_string(i));
+  }
+  int32_t bos = vocab.size();
+  vocab.push_back("<s>");
+  int32_t eos = vocab.size();
+  vocab.push_back("</s>");
+  for (int32_t i = 0; i != 20; ++i) vocab.push_back("w" + std::to_string(i));
+
+  std::vector<std::set<std::vector<int32_t>>> ngrams(order);
+  for (int32_t w = 0; w != vocab.size(); ++w) ngrams[0].insert({w});
+  std::mt19937 gen(order);
+  std::uniform_int_distribution<int32_t> word(eos + 1, vocab.size() - 1);
+  for (int32_t n = 0; n != 200; ++n) {
+    std::vector<int32_t> sentence(1, bos);
+    for (int32_t i = 0; i != 15; ++i) sentence.push_back(word(gen));
+    sentence.push_back(eos);
+    for (std::size_t i = 0; i != sentence.size(); ++i) {
+      for (int32_t k = 1; k <= order && i + k <= sentence.size(); ++k) {
+        ngrams[k - 1].emplace(sentence.begin() + i, sentence.begin() + i + k);
+      }
+    }
+  }
+
+  std::ostringstream os;
+  os << "\\data\\\n";
+  for (int32_t k = 0; k != order; ++k) {
+    os << "ngram " << k + 1 << "=" << ngrams[k].size() << "\n";
+  }
+  for (int32_t k = 0; k != order; ++k) {
+    os << "\n\\" << k + 1 << "-grams:\n";
+    int32_t n = 0;
+    for (const std::vector<int32_t> &ngram : ngrams[k]) {
+      os << -0.1 * (1 + n++ % 30);
+      for (std::size_t i = 0; i != ngram.size(); ++i) {
+        os << (i == 0 ? '\t' : ' ') << vocab[ngram[i]];
+      }
+      if (k + 1 != order) os << '\t' << -0.05 * (1 + n % 7);
+      os << "\n";
+    }
+  }
+  os << "\n\\end\\\n";
+  return os.str();
+}
+
+// Packed history keys of every width must give the same FST as
+// GeneralHistKey. Histories of up to 12 ids of 16 bits, or 9 of 21 bits,
+// fit into a packed key; longer ones fall back to GeneralHistKey.
+bool HistKeyTest(bool seps, int32_t order, int32_t num_extra_words) {
+  std::string lm = HighOrderLm(order, num_extra_words);
+  std::istringstream is(lm);
+  ArpaLmCompiler *lm_compiler = Compile(seps, is);
+  CompileOptions opts;
+  opts.general_hist_key = true;
+  std::istringstream general_is(lm);
+  ArpaLmCompiler *general_compiler = Compile(seps, general_is, opts);
+
+  bool wide_symbols = num_extra_words >= (1 << 16);
+  bool expect_general = order - 1 > (wide_symbols ? 9 : 12);
+  bool ok = lm_compiler->Stats().general_history_key == expect_general &&
+            general_compiler->Stats().general_history_key &&
+            lm_compiler->Fst().NumStates() > num_extra_words &&
+            fst::Equal(lm_compiler->Fst(), general_compiler->Fst());
+  if (!ok) {
+    KALDILM_WARN << "History key test failed on a " << order << "-gram with "
+                 << num_extra_words << " extra words";
+  }
+  delete general_compiler;
+  delete lm_compiler;
+  return ok;
+}
+
+// Return the ARPA file with the count of each order in its \\data\\ section
+// multiplied by factor.
+std::string ScaleNgramCounts(const std::string &infile, double factor) {
+  std::ifstream is(infile);
+  std::ostringstream os;
+  std::string line;
+  while (std::getline(is, line)) {
+    std::size_t eq = line.find('=');
+    if (line.compare(0, 6, "ngram ") == 0 && eq != std::string::npos) {
+      int64_t count = std::stoll(line.substr(eq + 1));
+      line = line.substr(0, eq + 1) + std::to_string(int64_t(count * factor));
+    }
+    os << line << "\n";
+  }
+  return os.str();
+}
+
+// The FST is pre-sized from the \\data\\ counts. Counts larger than the
+// actual ones must give the same FST, in both layouts and on the pipeline
+// thread. Smaller ones are an error, found only after the n-grams of the
+// order have been added beyond what was reserved. Negative ones are
+// rejected with the header, before anything is reserved.
+bool WrongCountsTest(bool seps, const std::string &infile) {
+  bool ok = true;
+  for (bool use_csr : {false, true}) {
+    for (int32_t num_threads : {1, 2}) {
+      CompileOptions opts;
+      opts.use_csr = use_csr;
+      opts.num_threads = num_threads;
+      std::unique_ptr<ArpaLmCompiler> expected(Compile(seps, infile, opts));
+      std::istringstream is(ScaleNgramCounts(infile, 1000));
+      std::unique_ptr<ArpaLmCompiler> lm_compiler(Compile(seps, is, opts));
+      if (use_csr) {
+        std::unique_ptr<fst::StdConstFst> expected_fst(
+            ReadBackConstFst(expected.get()));
+        std::unique_ptr<fst::StdConstFst> const_fst(
+            ReadBackConstFst(lm_compiler.get()));
+        ok &= fst::Equal(*expected_fst, *const_fst);
+      } else {
+        ok &= fst::Equal(expected->Fst(), lm_compiler->Fst());
+      }
+
+      std::istringstream small_is(ScaleNgramCounts(infile, 0.5));
+      std::string error;
+      try {
+        delete Compile(seps, small_is, opts);
+      } catch (const std::runtime_error &e) {
+        error = e.what();
+      }
+      ok &= error.find("header said there would be") != std::string::npos;
+
+      std::istringstream negative_is(ScaleNgramCounts(infile, -1));
+      error.clear();
+      try {
+        delete Compile(seps, negative_is, opts);
+      } catch (const std::runtime_error &e) {
+        error = e.what();
+      }
+      ok &= error.find("line 2 [") != std::string::npos &&
+            error.find("invalid ngram order or count") != std::string::npos;
+    }
+  }
+  if (!ok) KALDILM_WARN << "Wrong counts test failed on " << infile;
+  return ok;
+}
+
+bool ScoringTest(bool seps, const std::string &infile,
+                 const std::string &sentence, float expected,
+                 const CompileOptions &opts = CompileOptions()) {
+  bool use_csr = opts.use_csr;
+  ArpaLmCompiler *lm_compiler = Compile(seps, infile, opts);
+  std::unique_ptr<fst::StdConstFst> const_fst;
+  if (use_csr) const_fst.reset(ReadBackConstFst(lm_compiler));
+  const fst::StdFst &lm_fst =
+      use_csr ? static_cast<const fst::StdFst &>(*const_fst)
+              : lm_compiler->Fst();
+  const fst::SymbolTable *symbols = use_csr ? lm_compiler->Csr().Symbols()
+                                            : lm_compiler->Fst().InputSymbols();
 
   // Create a sentence FST for scoring.
   fst::StdVectorFst sentFst;
@@ -183,7 +667,8 @@ bool ScoringTest(bool seps, const std::string &infile,
 
   // Do the composition and extract final weight.
   fst::StdVectorFst composed;
-  fst::Compose(sentFst, lm_compiler->Fst(), &composed);
+  fst::Compose(sentFst, lm_fst, &composed);
+  const_fst.reset();
   delete lm_compiler;
 
   if (composed.Start() == fst::kNoStateId) {
@@ -221,6 +706,54 @@ bool RunAllTests(bool seps) {
   ok &=
       kaldilm::ScoringTest(seps, dir + "/test_data/input.arpa", "a b", 4.36082);
 
+  // The same with the model compiled into CSR layout.
+  kaldilm::CompileOptions opts;
+  opts.use_csr = true;
+  ok &= kaldilm::ScoringTest(seps, dir + "/test_data/input.arpa", "b b b a",
+                             59.2649, opts);
+  ok &= kaldilm::ScoringTest(seps, dir + "/test_data/input.arpa", "a b",
+                             4.36082, opts);
+
+  // Removing redundant states does not change the scores.
+  opts.use_csr = false;
+  opts.remove_redundant_states = true;
+  opts.num_threads = 2;
+  ok &= kaldilm::ScoringTest(seps, dir + "/test_data/input.arpa", "b b b a",
+                             59.2649, opts);
+  ok &= kaldilm::ILabelSortTest(seps, dir + "/test_data/input.arpa");
+  ok &= kaldilm::ILabelSortTest(seps, dir + "/test_data/missing_backoffs.arpa");
+  if (!seps) {
+    ok &= kaldilm::ILabelSortEosFirstTest(false);
+    ok &= kaldilm::ILabelSortEosFirstTest(true);
+  }
+  ok &= kaldilm::FstArraysTest(seps, dir + "/test_data/input.arpa");
+  ok &= kaldilm::FstArraysTest(seps, dir + "/test_data/missing_backoffs.arpa");
+  ok &= kaldilm::TextWriterTest(seps, dir + "/test_data/input.arpa");
+  ok &= kaldilm::TextWriterTest(seps, dir + "/test_data/unused_backoffs.arpa");
+  ok &= kaldilm::WrongCountsTest(seps, dir + "/test_data/input.arpa");
+  ok &=
+      kaldilm::WrongCountsTest(seps, dir + "/test_data/missing_backoffs.arpa");
+  for (int32_t order = 5; order <= 12; ++order) {
+    ok &= kaldilm::HistKeyTest(seps, order, 0);
+    ok &= kaldilm::HistKeyTest(seps, order, 70000);
+  }
+  ok &= kaldilm::HistKeyTest(seps, 14, 0);
+  if (seps) {
+    for (const std::string &name : {"input.arpa", "missing_backoffs.arpa"}) {
+      ok &= kaldilm::RedundantStatesTest(
+          name, kaldilm::ReadText(dir + "/test_data/" + name));
+    }
+    ok &= kaldilm::RedundantStatesTest(
+        "a 5-gram",
+        kaldilm::DropHighestOrderNGrams(kaldilm::HighOrderLm(5, 0)));
+  }
+  if (!seps) {
+    ok &= kaldilm::ConstFstTest(dir + "/test_data/missing_backoffs.arpa");
+    ok &= kaldilm::ConstFstTest(dir + "/test_data/unused_backoffs.arpa");
+    ok &= kaldilm::ConstFstTest(dir + "/test_data/input.arpa");
+    ok &= kaldilm::ConstFstTest(dir + "/test_data/input.arpa", true);
+  }
+
   if (!ok) {
     KALDILM_WARN << "Tests " << (seps ? "with" : "without")
                  << " epsilon substitution FAILED";
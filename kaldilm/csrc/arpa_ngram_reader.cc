@@ -0,0 +1,114 @@
+// kaldilm/csrc/arpa_ngram_reader.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/arpa_ngram_reader.h"
+
+#include <algorithm>
+
+#include "kaldilm/csrc/log.h"
+
+namespace kaldilm {
+
+namespace {
+
+// Number of batches read ahead of Next().
+constexpr std::size_t kReadAhead = 4;
+
+// Thrown by ConsumeNGrams() once the reader is being destroyed, to abort
+// the parsing of the rest of the file.
+struct Cancelled {};
+
+}  // namespace
+
+ArpaNGramReader::ArpaNGramReader(const ArpaParseOptions &options,
+                                 fst::SymbolTable *symbols,
+                                 int32_t batch_size)
+    : ArpaFileParser(options, symbols),
+      batch_size_(batch_size),
+      queue_(kReadAhead) {
+  KALDILM_ASSERT(batch_size > 0);
+}
+
+ArpaNGramReader::~ArpaNGramReader() {
+  if (!thread_.joinable()) return;
+  stopped_.store(true);
+  // Give back the slots until the reading thread has closed the queue.
+  while (queue_.BeginPop() != nullptr) queue_.EndPop();
+  thread_.join();
+}
+
+template <class F>
+void ArpaNGramReader::StartThread(F read) {
+  KALDILM_ASSERT(!thread_.joinable());
+  thread_ = std::thread([this, read] {
+    try {
+      read();
+    } catch (const Cancelled &) {
+      // Nobody is left to take the n-grams.
+    } catch (...) {
+      // Rethrown by Next() after the n-grams read before the error.
+      error_ = std::current_exception();
+    }
+    if (pending_ != nullptr) Push();
+    queue_.Close();
+  });
+}
+
+void ArpaNGramReader::Start(const std::string &filename) {
+  StartThread([this, filename] { Read(filename); });
+}
+
+void ArpaNGramReader::Start(const char *data, std::size_t size) {
+  StartThread([this, data, size] { Read(data, size); });
+}
+
+bool ArpaNGramReader::Next(NGramBatch *batch) {
+  NGramBatch *slot = queue_.BeginPop();
+  if (slot == nullptr) {
+    if (thread_.joinable()) thread_.join();
+    if (error_ != nullptr) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+    return false;
+  }
+  std::swap(*slot, *batch);
+  queue_.EndPop();
+  return true;
+}
+
+void ArpaNGramReader::Push() {
+  queue_.EndPush();
+  pending_ = nullptr;
+}
+
+void ArpaNGramReader::ConsumeNGrams(const NGramBatch &batch) {
+  if (stopped_.load(std::memory_order_relaxed)) throw Cancelled();
+  if (pending_ != nullptr && pending_->order != batch.order) Push();
+  int32_t i = 0;
+  while (i != batch.Size()) {
+    if (pending_ == nullptr) {
+      pending_ = queue_.BeginPush();
+      pending_->Clear();
+      pending_->order = batch.order;
+    }
+    int32_t n = std::min(batch.Size() - i, batch_size_ - pending_->Size());
+    pending_->words.insert(pending_->words.end(), batch.Words(i),
+                           batch.Words(i + n));
+    pending_->logprobs.insert(pending_->logprobs.end(),
+                              batch.logprobs.begin() + i,
+                              batch.logprobs.begin() + i + n);
+    pending_->backoffs.insert(pending_->backoffs.end(),
+                              batch.backoffs.begin() + i,
+                              batch.backoffs.begin() + i + n);
+    pending_->line_numbers.insert(pending_->line_numbers.end(),
+                                  batch.line_numbers.begin() + i,
+                                  batch.line_numbers.begin() + i + n);
+    i += n;
+    if (pending_->Size() == batch_size_) Push();
+  }
+}
+
+}  // namespace kaldilm
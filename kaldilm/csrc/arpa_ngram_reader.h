@@ -0,0 +1,76 @@
+// kaldilm/csrc/arpa_ngram_reader.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_ARPA_NGRAM_READER_H_
+#define KALDILM_CSRC_ARPA_NGRAM_READER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <thread>
+
+#include "fst/symbol-table.h"
+#include "kaldilm/csrc/arpa_file_parser.h"
+#include "kaldilm/csrc/spsc_queue.h"
+
+namespace kaldilm {
+
+/**
+   Reads an ARPA file, or an ARPA cache, on a thread of its own, and hands
+   out its n-grams in batches: a pull interface over ArpaFileParser, e.g.,
+   for scanning or filtering a model before compiling it.
+
+   Each batch holds up to batch_size n-grams of the same order, in file
+   order, with their words, log-probs, backoffs and line numbers, but not
+   the text of their lines. Words are mapped to symbols, and diagnostics
+   are reported, as by any ArpaFileParser. With kAddToSymbols, the symbol
+   table is added to while the file is read, so it must not be used until
+   Next() has returned false.
+ */
+class ArpaNGramReader : public ArpaFileParser {
+ public:
+  ArpaNGramReader(const ArpaParseOptions &options, fst::SymbolTable *symbols,
+                  int32_t batch_size);
+  /// If the n-grams have not all been taken, reading is aborted at the next
+  /// batch, without parsing the rest of the file.
+  ~ArpaNGramReader() override;
+
+  /// Start reading filename, as Read(const std::string &) would.
+  void Start(const std::string &filename);
+  /// Start reading an in-memory buffer, which must remain valid until
+  /// Next() has returned false or the reader is destroyed.
+  void Start(const char *data, std::size_t size);
+
+  /// Wait for the next batch, and swap it into *batch, whose memory is
+  /// reused. Return false once all the n-grams have been delivered and the
+  /// reading is done; Stats() are valid then. If reading failed, the error
+  /// is thrown instead, once the n-grams before it have been delivered.
+  bool Next(NGramBatch *batch);
+
+ protected:
+  void ConsumeNGrams(const NGramBatch &batch) override;
+  bool CanConsumeConcurrently() const override { return true; }
+
+ private:
+  template <class F>
+  void StartThread(F read);
+
+  // Hand the batch being filled over to Next().
+  void Push();
+
+  int32_t batch_size_;
+  SpscQueue<NGramBatch> queue_;
+  // The slot being filled by ConsumeNGrams(), or nullptr.
+  NGramBatch *pending_ = nullptr;
+  // Set by the destructor to abort the reading.
+  std::atomic<bool> stopped_{false};
+  std::exception_ptr error_;  // Of the reading thread.
+  std::thread thread_;
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_ARPA_NGRAM_READER_H_
@@ -0,0 +1,118 @@
+// kaldilm/csrc/compile_stats.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/compile_stats.h"
+
+#include <limits>
+#include <sstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+namespace kaldilm {
+
+namespace {
+
+#ifdef _WIN32
+double FileTimeSeconds(const FILETIME &t) {
+  ULARGE_INTEGER n;
+  n.LowPart = t.dwLowDateTime;
+  n.HighPart = t.dwHighDateTime;
+  return n.QuadPart * 1e-7;  // In units of 100 ns.
+}
+#endif
+
+template <class T>
+void WriteJsonArray(std::ostream &os, const std::vector<T> &values) {
+  os << '[';
+  for (std::size_t i = 0; i != values.size(); ++i) {
+    if (i != 0) os << ", ";
+    os << values[i];
+  }
+  os << ']';
+}
+
+}  // namespace
+
+double ProcessCpuSeconds() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+    return 0;
+  return FileTimeSeconds(kernel) + FileTimeSeconds(user);
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+#endif
+}
+
+double ThreadCpuSeconds() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+    return 0;
+  return FileTimeSeconds(kernel) + FileTimeSeconds(user);
+#else
+  struct timespec t;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) != 0) return 0;
+  return t.tv_sec + t.tv_nsec * 1e-9;
+#endif
+}
+
+int64_t PeakRssBytes() {
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;  // Already in bytes.
+#else
+  return static_cast<int64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+void PhaseTimer::Finish(const std::string &name, CompileStats *stats) const {
+  PhaseStats phase;
+  phase.name = name;
+  phase.wall_seconds = WallSeconds();
+  phase.cpu_seconds = ProcessCpuSeconds() - start_cpu_;
+  phase.peak_rss_bytes = PeakRssBytes();
+  stats->phases.push_back(phase);
+}
+
+std::string CompileStats::ToJson() const {
+  std::ostringstream os;
+  os.precision(std::numeric_limits<double>::max_digits10);
+  // Phase names are plain identifiers, so they need no escaping.
+  os << "{\"phases\": [";
+  for (std::size_t i = 0; i != phases.size(); ++i) {
+    const PhaseStats &phase = phases[i];
+    if (i != 0) os << ", ";
+    os << "{\"name\": \"" << phase.name << "\", "
+       << "\"wall_seconds\": " << phase.wall_seconds << ", "
+       << "\"cpu_seconds\": " << phase.cpu_seconds << ", "
+       << "\"peak_rss_bytes\": " << phase.peak_rss_bytes << "}";
+  }
+  os << "], \"bytes_read\": " << bytes_read << ", \"ngrams\": ";
+  WriteJsonArray(os, ngrams);
+  os << ", \"skipped_ngrams\": ";
+  WriteJsonArray(os, skipped_ngrams);
+  os << ", \"num_states\": " << num_states << ", \"num_arcs\": " << num_arcs
+     << ", \"general_history_key\": "
+     << (general_history_key ? "true" : "false")
+     << ", \"trie_history\": " << (trie_history ? "true" : "false")
+     << ", \"history_load_factor\": " << history_load_factor
+     << ", \"peak_rss_bytes\": " << peak_rss_bytes << "}";
+  return os.str();
+}
+
+}  // namespace kaldilm
@@ -0,0 +1,104 @@
+// kaldilm/csrc/compile_stats.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_COMPILE_STATS_H_
+#define KALDILM_CSRC_COMPILE_STATS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace kaldilm {
+
+/// Resources used by one phase of a compilation.
+struct PhaseStats {
+  std::string name;
+  double wall_seconds = 0;
+  /// CPU time of all threads of the process, unless noted otherwise.
+  double cpu_seconds = 0;
+  /// Peak resident memory of the process at the end of the phase.
+  int64_t peak_rss_bytes = 0;
+};
+
+/**
+   What reading and compiling an ARPA file took, and what it produced; see
+   ArpaFileParser::Stats().
+
+   The phases are listed in the order they ran:
+
+     - "read": parsing the file, and building the model from the n-grams.
+     - "build": the part of "read" spent building the model, i.e., tracking
+       histories and adding states and arcs. Its CPU time is that of the
+       building thread only. With num_threads other than 1, it overlaps
+       with parsing, and its wall time may exceed "read" minus parsing.
+     - "finish": moving the arcs into place (CsrFst only).
+     - "ilabel_sort" and "remove_redundant_states", if requested.
+
+   Callers may append their own phases, e.g., arpa2fst adds "write" and
+   "print".
+ */
+struct CompileStats {
+  std::vector<PhaseStats> phases;
+
+  int64_t bytes_read = 0;
+  /// N-grams passed on to the compiler, per order.
+  std::vector<int64_t> ngrams;
+  /// N-grams skipped per order, for OOV words, for a missing lower order
+  /// n-gram, or for a misplaced <s> or </s>.
+  std::vector<int64_t> skipped_ngrams;
+
+  /// Size of the resulting FST.
+  int64_t num_states = 0;
+  int64_t num_arcs = 0;
+
+  /// Whether histories were keyed by a vector of words rather than packed
+  /// into integers, which is slower; see ArpaLmCompiler.
+  bool general_history_key = false;
+  /// Whether the n-grams came sorted, so that histories were tracked in a
+  /// trie to the end; see TrieHistoryTracker.
+  bool trie_history = false;
+  /// Number of entries divided by the number of slots of the hash map of
+  /// histories.
+  double history_load_factor = 0;
+
+  /// Peak resident memory of the process when the stats were taken.
+  int64_t peak_rss_bytes = 0;
+
+  /// Return the stats as a JSON object, with the field names above.
+  std::string ToJson() const;
+};
+
+/// CPU time used so far by all threads of the process, in seconds.
+double ProcessCpuSeconds();
+/// CPU time used so far by the calling thread, in seconds.
+double ThreadCpuSeconds();
+/// Peak resident memory of the process, in bytes, or 0 where unknown, e.g.,
+/// on Windows.
+int64_t PeakRssBytes();
+
+/// Measures a phase from its construction on.
+class PhaseTimer {
+ public:
+  PhaseTimer()
+      : start_(std::chrono::steady_clock::now()),
+        start_cpu_(ProcessCpuSeconds()) {}
+
+  double WallSeconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_)
+        .count();
+  }
+
+  /// Append the phase, as measured so far, to stats->phases.
+  void Finish(const std::string &name, CompileStats *stats) const;
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+  double start_cpu_;
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_COMPILE_STATS_H_
@@ -0,0 +1,329 @@
+// kaldilm/csrc/csr_fst.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/csr_fst.h"
+
+#include <algorithm>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <vector>
+
+#include "kaldilm/csrc/log.h"
+#include "kaldilm/csrc/thread_pool.h"
+
+namespace kaldilm {
+
+namespace {
+
+// The state record of fst::ConstFst<fst::StdArc, uint32>, as it is stored in
+// the file.
+struct ConstState {
+  fst::TropicalWeight final;
+  uint32_t pos;         // Index of the first arc of the state.
+  uint32_t narcs;       // Number of arcs.
+  uint32_t niepsilons;  // Number of arcs with an input epsilon.
+  uint32_t noepsilons;  // Number of arcs with an output epsilon.
+};
+
+// File versions of fst::ConstFst.
+constexpr int32_t kConstFstFileVersion = 2;
+constexpr int32_t kConstFstAlignedFileVersion = 1;
+
+}  // namespace
+
+constexpr uint32_t CsrFst::kParked;
+
+void CsrFst::SetMemoryBudget(MemoryBudget *budget) {
+  KALDILM_ASSERT(final_.empty());
+  budget_ = budget;
+  final_ = SpillableArray<Weight>(budget);
+  first_arc_ = SpillableArray<uint32_t>(budget);
+  num_arcs_ = SpillableArray<uint32_t>(budget);
+  arcs_ = SpillableArray<Arc>(budget);
+  parked_arcs_ = SpillableArray<Arc>(budget);
+  stray_arcs_ = SpillableArray<std::pair<StateId, Arc>>(budget);
+}
+
+CsrFst::StateId CsrFst::AddState() {
+  KALDILM_ASSERT(!finished_);
+  final_.push_back(Weight::Zero());
+  first_arc_.push_back(kParked);
+  num_arcs_.push_back(0);
+  parked_arcs_.emplace_back();
+  return final_.size() - 1;
+}
+
+void CsrFst::ReserveStates(StateId n) {
+  final_.reserve(n);
+  first_arc_.reserve(n);
+  num_arcs_.reserve(n);
+  parked_arcs_.reserve(n);
+}
+
+void CsrFst::AddArc(StateId s, const Arc &arc) {
+  KALDILM_ASSERT(!finished_);
+  uint32_t n = num_arcs_[s]++;
+  if (n == 0) {
+    parked_arcs_[s] = arc;
+    return;
+  }
+  if (arcs_.size() + 2 >= kParked) {
+    KALDILM_ERR << "The FST has too many arcs for the ConstFst layout";
+  }
+  if (n == 1) {
+    // The arcs of s start at the end of the array.
+    first_arc_[s] = arcs_.size();
+    arcs_.push_back(parked_arcs_[s]);
+    arcs_.push_back(arc);
+    last_state_ = s;
+  } else if (s == last_state_) {
+    arcs_.push_back(arc);
+  } else {
+    stray_arcs_.emplace_back(s, arc);
+  }
+}
+
+std::size_t CsrFst::NumArcs() const {
+  return std::accumulate(num_arcs_.begin(), num_arcs_.end(), std::size_t(0));
+}
+
+void CsrFst::SetSymbols(const fst::SymbolTable *symbols) {
+  symbols_.reset(symbols != nullptr ? symbols->Copy() : nullptr);
+}
+
+void CsrFst::Finish() {
+  KALDILM_ASSERT(!finished_);
+  finished_ = true;
+
+  // Place the arcs of the states that got only one.
+  StateId num_states = NumStates();
+  for (StateId s = 0; s != num_states; ++s) {
+    if (num_arcs_[s] == 0) {
+      first_arc_[s] = 0;
+    } else if (num_arcs_[s] == 1) {
+      first_arc_[s] = arcs_.size();
+      arcs_.push_back(parked_arcs_[s]);
+    }
+  }
+  SpillableArray<Arc>(budget_).swap(parked_arcs_);
+  if (arcs_.size() >= kParked) {
+    KALDILM_ERR << "The FST has too many arcs for the ConstFst layout";
+  }
+  if (stray_arcs_.empty()) return;
+
+  // Some arcs were added out of order, probably because the ARPA file is not
+  // sorted. Append them to the arcs of their states, keeping the order in
+  // which they were added. The strays of each state are counted first, so
+  // that each can be put into its final place without sorting them.
+  KALDILM_LOG << stray_arcs_.size() << " of " << NumArcs()
+              << " arcs were added out of order. Rearranging arcs.";
+  // The number of stray arcs of each state, then where the next one goes.
+  SpillableArray<uint32_t> next(budget_);
+  next.resize(num_states, 0);
+  for (const auto &stray : stray_arcs_) ++next[stray.first];
+  SpillableArray<Arc> arcs(budget_);
+  arcs.resize(arcs_.size() + stray_arcs_.size());
+  uint32_t begin = 0;
+  for (StateId s = 0; s != num_states; ++s) {
+    uint32_t num_in_place = num_arcs_[s] - next[s];
+    std::copy(arcs_.begin() + first_arc_[s],
+              arcs_.begin() + first_arc_[s] + num_in_place,
+              arcs.begin() + begin);
+    first_arc_[s] = begin;
+    next[s] = begin + num_in_place;
+    begin += num_arcs_[s];
+  }
+  for (const auto &stray : stray_arcs_) {
+    arcs[next[stray.first]++] = stray.second;
+  }
+  arcs_.swap(arcs);
+  SpillableArray<std::pair<StateId, Arc>>(budget_).swap(stray_arcs_);
+}
+
+void CsrFst::ILabelSort() {
+  KALDILM_ASSERT(finished_);
+  StateId num_states = NumStates();
+  for (StateId s = 0; s != num_states; ++s) {
+    auto begin = arcs_.begin() + first_arc_[s];
+    std::sort(begin, begin + num_arcs_[s], fst::ILabelCompare<Arc>());
+  }
+  ilabel_sorted_ = true;
+}
+
+void CsrFst::ILabelSort(const SpillableArray<StateId> &states,
+                        ThreadPool *pool) {
+  KALDILM_ASSERT(finished_);
+  ParallelForRanges(pool, states.size(), [&](int32_t i, std::size_t begin,
+                                             std::size_t end) {
+    for (std::size_t j = begin; j != end; ++j) {
+      auto first = arcs_.begin() + first_arc_[states[j]];
+      std::sort(first, first + num_arcs_[states[j]], fst::ILabelCompare<Arc>());
+    }
+  });
+  ilabel_sorted_ = true;
+}
+
+void CsrFst::RemoveRedundantStates(Arc::Label backoff_symbol,
+                                   ThreadPool *pool) {
+  KALDILM_ASSERT(finished_);
+  KALDILM_ASSERT(backoff_symbol != 0);
+  StateId num_states = NumStates();
+  if (start_ != fst::kNoStateId && IsRedundant(start_, backoff_symbol)) {
+    // No arc enters the start state, which is kept as RemoveEpsLocal() does,
+    // with the backoff arc turned into an epsilon arc.
+    arcs_[first_arc_[start_]].ilabel = 0;
+  }
+
+  // Mark redundant states with kNoStateId and number the others. Each range
+  // of states counts its states first, to know where its numbers start.
+  SpillableArray<StateId> new_ids(budget_);
+  new_ids.resize(num_states);
+  int32_t num_ranges = NumRanges(pool, num_states);
+  std::vector<StateId> first_ids(num_ranges + 1, 0);
+  ParallelForRanges(pool, num_states, [&](int32_t i, std::size_t begin,
+                                          std::size_t end) {
+    for (StateId s = begin; s != end; ++s) {
+      new_ids[s] = IsRedundant(s, backoff_symbol) ? fst::kNoStateId : 0;
+      if (new_ids[s] == 0) ++first_ids[i + 1];
+    }
+  });
+  std::partial_sum(first_ids.begin(), first_ids.end(), first_ids.begin());
+  StateId num_kept = first_ids.back();
+  ParallelForRanges(pool, num_states, [&](int32_t i, std::size_t begin,
+                                          std::size_t end) {
+    StateId id = first_ids[i];
+    for (StateId s = begin; s != end; ++s) {
+      if (new_ids[s] != fst::kNoStateId) new_ids[s] = id++;
+    }
+  });
+
+  // Bypass redundant states. A redundant state may back off to another one,
+  // but the chain is not longer than the order of the model. The arcs of
+  // redundant states are only read, so they keep the old state ids, and
+  // ranges write disjoint sets of arcs.
+  ParallelForRanges(pool, num_states, [&](int32_t i, std::size_t begin,
+                                          std::size_t end) {
+    for (StateId s = begin; s != end; ++s) {
+      if (new_ids[s] == fst::kNoStateId) continue;
+      Arc *arc = arcs_.data() + first_arc_[s];
+      for (Arc *arc_end = arc + num_arcs_[s]; arc != arc_end; ++arc) {
+        while (new_ids[arc->nextstate] == fst::kNoStateId) {
+          const Arc &backoff = arcs_[first_arc_[arc->nextstate]];
+          arc->weight = fst::Times(arc->weight, backoff.weight);
+          arc->nextstate = backoff.nextstate;
+        }
+        arc->nextstate = new_ids[arc->nextstate];
+      }
+    }
+  });
+
+  // Drop them. Their arcs stay in the arc array, but are no longer referred
+  // to, and are not written.
+  for (StateId s = 0; s != num_states; ++s) {
+    StateId t = new_ids[s];
+    if (t == fst::kNoStateId) continue;
+    final_[t] = final_[s];
+    first_arc_[t] = first_arc_[s];
+    num_arcs_[t] = num_arcs_[s];
+  }
+  final_.resize(num_kept);
+  first_arc_.resize(num_kept);
+  num_arcs_.resize(num_kept);
+  if (start_ != fst::kNoStateId) start_ = new_ids[start_];
+  KALDILM_LOG << "Reduced num-states from " << num_states << " to "
+              << num_kept;
+}
+
+uint64_t CsrFst::ComputeProperties() const {
+  bool acceptor = true;
+  bool iepsilons = false;
+  bool oepsilons = false;
+  bool epsilons = false;
+  StateId num_states = NumStates();
+  for (StateId s = 0; s != num_states; ++s) {
+    const Arc *arc = Arcs(s);
+    for (const Arc *end = arc + num_arcs_[s]; arc != end; ++arc) {
+      if (arc->ilabel != arc->olabel) acceptor = false;
+      if (arc->ilabel == 0) iepsilons = true;
+      if (arc->olabel == 0) oepsilons = true;
+      if (arc->ilabel == 0 && arc->olabel == 0) epsilons = true;
+    }
+  }
+  uint64_t properties = fst::kExpanded;
+  properties |= acceptor ? fst::kAcceptor : fst::kNotAcceptor;
+  properties |= iepsilons ? fst::kIEpsilons : fst::kNoIEpsilons;
+  properties |= oepsilons ? fst::kOEpsilons : fst::kNoOEpsilons;
+  properties |= epsilons ? fst::kEpsilons : fst::kNoEpsilons;
+  if (ilabel_sorted_) properties |= fst::kILabelSorted;
+  return properties;
+}
+
+void CsrFst::Write(std::ostream &os, const fst::FstWriteOptions &opts) const {
+  KALDILM_ASSERT(finished_);
+  // This follows fst::ConstFst<fst::StdArc>::WriteFst().
+  bool write_isymbols = symbols_ != nullptr && opts.write_isymbols;
+  bool write_osymbols = symbols_ != nullptr && opts.write_osymbols;
+  if (opts.write_header) {
+    fst::FstHeader hdr;
+    hdr.SetFstType("const");
+    hdr.SetArcType(Arc::Type());
+    hdr.SetVersion(opts.align ? kConstFstAlignedFileVersion
+                              : kConstFstFileVersion);
+    hdr.SetProperties(ComputeProperties());
+    int32_t flags = 0;
+    if (write_isymbols) flags |= fst::FstHeader::HAS_ISYMBOLS;
+    if (write_osymbols) flags |= fst::FstHeader::HAS_OSYMBOLS;
+    if (opts.align) flags |= fst::FstHeader::IS_ALIGNED;
+    hdr.SetFlags(flags);
+    hdr.SetStart(start_);
+    hdr.SetNumStates(NumStates());
+    hdr.SetNumArcs(NumArcs());
+    hdr.Write(os, opts.source);
+  }
+  if (write_isymbols) symbols_->Write(os);
+  if (write_osymbols) symbols_->Write(os);
+  if (opts.align && !fst::AlignOutput(os)) {
+    KALDILM_ERR << "Could not align the output for " << opts.source;
+  }
+
+  // States, with their arcs numbered in state order.
+  const std::size_t kBufferSize = 4096;
+  std::vector<ConstState> buffer;
+  buffer.reserve(kBufferSize);
+  uint32_t pos = 0;
+  StateId num_states = NumStates();
+  for (StateId s = 0; s != num_states; ++s) {
+    ConstState state;
+    state.final = final_[s];
+    state.pos = pos;
+    state.narcs = num_arcs_[s];
+    state.niepsilons = 0;
+    state.noepsilons = 0;
+    const Arc *arc = Arcs(s);
+    for (const Arc *end = arc + num_arcs_[s]; arc != end; ++arc) {
+      if (arc->ilabel == 0) ++state.niepsilons;
+      if (arc->olabel == 0) ++state.noepsilons;
+    }
+    pos += state.narcs;
+    buffer.push_back(state);
+    if (buffer.size() == kBufferSize || s + 1 == num_states) {
+      os.write(reinterpret_cast<const char *>(buffer.data()),
+               buffer.size() * sizeof(ConstState));
+      buffer.clear();
+    }
+  }
+
+  if (opts.align && !fst::AlignOutput(os)) {
+    KALDILM_ERR << "Could not align the output for " << opts.source;
+  }
+  for (StateId s = 0; s != num_states; ++s) {
+    os.write(reinterpret_cast<const char *>(Arcs(s)),
+             num_arcs_[s] * sizeof(Arc));
+  }
+  os.flush();
+  if (!os) KALDILM_ERR << "Error writing FST to " << opts.source;
+}
+
+}  // namespace kaldilm
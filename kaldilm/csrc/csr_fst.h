@@ -0,0 +1,149 @@
+// kaldilm/csrc/csr_fst.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_CSR_FST_H_
+#define KALDILM_CSRC_CSR_FST_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <utility>
+
+#include "fst/fstlib.h"
+#include "fst/symbol-table.h"
+#include "kaldilm/csrc/spillable_array.h"
+
+namespace kaldilm {
+
+class ThreadPool;
+
+/**
+   An FST kept in compressed sparse row (CSR) layout: all arcs are in one
+   array, and every state refers to a contiguous range of it. This is the
+   layout of fst::ConstFst, and Write() produces a file that
+   fst::ConstFst<fst::StdArc> reads, or maps into memory.
+
+   It offers the subset of the fst::MutableFst interface that ArpaLmCompiler
+   needs to build a model, without keeping a vector per state as
+   fst::VectorFst does. Arcs are appended to the shared array as they come,
+   which relies on the way the compiler adds them:
+
+     - The first arc of a state is usually its backoff arc, added when the
+       state is created. It is parked aside until a second arc comes.
+     - All other arcs of a state usually come in one go, while the n-grams
+       having the state as history are read from a sorted ARPA file.
+
+   Arcs that do not follow this pattern are kept in a separate list, and
+   merged by Finish() at the cost of a temporary copy of the arc array.
+
+   Like fst::ConstFst<fst::StdArc>, it holds less than 2^32 arcs. Once
+   Finish() is called, no more states or arcs may be added.
+
+   Its arrays can be kept within a MemoryBudget, beyond which they are
+   moved to temporary files; see SetMemoryBudget().
+ */
+class CsrFst {
+ public:
+  typedef fst::StdArc Arc;
+  typedef Arc::StateId StateId;
+  typedef Arc::Weight Weight;
+
+  CsrFst() = default;
+  CsrFst(const CsrFst &) = delete;
+  CsrFst &operator=(const CsrFst &) = delete;
+
+  /// Account the memory of all arrays, including temporary ones, to budget.
+  /// Must be called before the first state is added.
+  void SetMemoryBudget(MemoryBudget *budget);
+
+  StateId AddState();
+  void AddArc(StateId s, const Arc &arc);
+  void SetStart(StateId s) { start_ = s; }
+  void SetFinal(StateId s, Weight weight) { final_[s] = weight; }
+
+  void ReserveStates(StateId n);
+  /// Make room for n arcs in total.
+  void ReserveTotalArcs(std::size_t n) { arcs_.reserve(n); }
+  /// Arcs of a state are stored contiguously anyway, so this is a no-op.
+  /// It exists for compatibility with fst::MutableFst.
+  void ReserveArcs(StateId s, std::size_t n) {}
+
+  StateId Start() const { return start_; }
+  Weight Final(StateId s) const { return final_[s]; }
+  StateId NumStates() const { return final_.size(); }
+  std::size_t NumArcs(StateId s) const { return num_arcs_[s]; }
+
+  /// Valid only after Finish().
+  std::size_t NumArcs() const;
+  /// Valid only after Finish(). The arcs of a state are
+  /// [Arcs(s), Arcs(s) + NumArcs(s)).
+  const Arc *Arcs(StateId s) const { return arcs_.data() + first_arc_[s]; }
+
+  /// The symbol table is copied.
+  void SetSymbols(const fst::SymbolTable *symbols);
+  const fst::SymbolTable *Symbols() const { return symbols_.get(); }
+
+  /// Move every arc into its place in the arc array. Must be called once,
+  /// after the last AddArc() and before any of the functions below.
+  void Finish();
+
+  /// Sort the arcs of each state by input label.
+  void ILabelSort();
+  /// Sort the arcs of the given states by input label, and mark the FST as
+  /// sorted. The arcs of all other states must be sorted already. If pool
+  /// is not nullptr, the states are sorted on it in parallel. States must
+  /// not be listed twice.
+  void ILabelSort(const SpillableArray<StateId> &states,
+                  ThreadPool *pool = nullptr);
+  bool IsILabelSorted() const { return ilabel_sorted_; }
+
+  /// Remove states that are not final and whose only arc is a backoff arc,
+  /// i.e., has the input label backoff_symbol. Arcs into such a state are
+  /// redirected to the destination of its backoff arc, with the backoff
+  /// weight added. This is what fst::RemoveEpsLocal() does once their
+  /// backoff arcs are made epsilon arcs, except that redirected arcs keep
+  /// their positions instead of moving to the end of their states. If pool
+  /// is not nullptr, ranges of states are processed on it in parallel.
+  void RemoveRedundantStates(Arc::Label backoff_symbol,
+                             ThreadPool *pool = nullptr);
+
+  /// Write the FST in the binary format of fst::ConstFst<fst::StdArc>.
+  /// Symbol tables are written as requested by opts.
+  void Write(std::ostream &os, const fst::FstWriteOptions &opts) const;
+
+ private:
+  // first_arc_[s] while the first arc of s is parked in parked_arcs_.
+  static constexpr uint32_t kParked = ~uint32_t(0);
+
+  // Whether s is not final and its only arc has the input label
+  // backoff_symbol.
+  bool IsRedundant(StateId s, Arc::Label backoff_symbol) const {
+    return num_arcs_[s] == 1 && final_[s] == Weight::Zero() &&
+           arcs_[first_arc_[s]].ilabel == backoff_symbol;
+  }
+
+  // Return the fst::FstProperties that hold for the arcs, e.g., kAcceptor.
+  uint64_t ComputeProperties() const;
+
+  MemoryBudget *budget_ = nullptr;  // Not owned.
+  StateId start_ = fst::kNoStateId;
+  SpillableArray<Weight> final_;
+  SpillableArray<uint32_t> first_arc_;  // Index of the first arc in arcs_.
+  SpillableArray<uint32_t> num_arcs_;
+  SpillableArray<Arc> arcs_;
+
+  // Used while building; see the class comment.
+  SpillableArray<Arc> parked_arcs_;
+  SpillableArray<std::pair<StateId, Arc>> stray_arcs_;
+  StateId last_state_ = fst::kNoStateId;  // Owner of the arcs at the end.
+
+  bool finished_ = false;
+  bool ilabel_sorted_ = false;
+  std::unique_ptr<fst::SymbolTable> symbols_;
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_CSR_FST_H_
@@ -0,0 +1,323 @@
+// kaldilm/csrc/decompressing_stream.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/decompressing_stream.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+#ifdef KALDILM_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef KALDILM_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef KALDILM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "kaldilm/csrc/log.h"
+
+namespace kaldilm {
+
+namespace {
+
+// Size of a decompressed block, and the number of blocks the decompressor
+// may run ahead of the reader.
+constexpr std::size_t kBlockSize = 1 << 20;
+constexpr std::size_t kMaxQueuedBlocks = 8;
+
+// Receives a full or, at the end, a partial block. Returns false if
+// decompression should stop because the reader is gone.
+using BlockSink = std::function<bool(std::string *block)>;
+
+bool HasPrefix(const char *data, std::size_t size, const char *magic,
+               std::size_t magic_size) {
+  return size >= magic_size && memcmp(data, magic, magic_size) == 0;
+}
+
+#ifdef KALDILM_HAVE_ZLIB
+// Return an empty string on success, or an error message.
+std::string DecompressGzip(const char *data, std::size_t size,
+                           const BlockSink &sink) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) return "inflateInit2 failed";
+
+  const char *in = data;
+  std::size_t remaining = size;
+  std::string block(kBlockSize, '\0');
+  zs.next_out = reinterpret_cast<Bytef *>(&block[0]);
+  zs.avail_out = kBlockSize;
+  std::string error;
+  bool stopped = false;  // The reader is gone.
+  while (true) {
+    if (zs.avail_in == 0 && remaining != 0) {
+      // avail_in is 32-bit, so feed large files piece by piece.
+      std::size_t n = std::min<std::size_t>(remaining, 1 << 30);
+      zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+      zs.avail_in = n;
+      in += n;
+      remaining -= n;
+    }
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    if (zs.avail_out == 0) {
+      if (!sink(&block)) {
+        stopped = true;
+        break;
+      }
+      block.resize(kBlockSize);
+      zs.next_out = reinterpret_cast<Bytef *>(&block[0]);
+      zs.avail_out = kBlockSize;
+    }
+    if (ret == Z_STREAM_END) {
+      // A .gz file may consist of several concatenated members. Like gzip
+      // itself, ignore trailing data that does not start another member.
+      const char *next =
+          zs.avail_in != 0 ? reinterpret_cast<const char *>(zs.next_in) : in;
+      if (!HasPrefix(next, zs.avail_in + remaining, "\x1f\x8b", 2)) break;
+      inflateReset(&zs);
+      continue;
+    }
+    if (ret != Z_OK) {
+      if (ret == Z_BUF_ERROR && zs.avail_in == 0 && remaining == 0) {
+        error = "unexpected end of gzip data; the file may be truncated";
+      } else {
+        error = std::string("gzip data error: ") +
+                (zs.msg != nullptr ? zs.msg : "unknown error");
+      }
+      break;
+    }
+  }
+  if (!stopped && error.empty() && zs.avail_out != kBlockSize) {
+    block.resize(kBlockSize - zs.avail_out);
+    sink(&block);
+  }
+  inflateEnd(&zs);
+  return error;
+}
+#endif
+
+#ifdef KALDILM_HAVE_LZMA
+std::string DecompressXz(const char *data, std::size_t size,
+                         const BlockSink &sink) {
+  lzma_stream strm = LZMA_STREAM_INIT;
+  if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+    return "lzma_stream_decoder failed";
+  }
+  strm.next_in = reinterpret_cast<const uint8_t *>(data);
+  strm.avail_in = size;
+  std::string block(kBlockSize, '\0');
+  strm.next_out = reinterpret_cast<uint8_t *>(&block[0]);
+  strm.avail_out = kBlockSize;
+  std::string error;
+  bool stopped = false;  // The reader is gone.
+  while (true) {
+    // All of the input is available up front, so LZMA_FINISH is used from
+    // the start; LZMA_CONCATENATED requires it to report the end.
+    lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+    if (strm.avail_out == 0) {
+      if (!sink(&block)) {
+        stopped = true;
+        break;
+      }
+      block.resize(kBlockSize);
+      strm.next_out = reinterpret_cast<uint8_t *>(&block[0]);
+      strm.avail_out = kBlockSize;
+    }
+    if (ret == LZMA_STREAM_END) break;
+    if (ret != LZMA_OK) {
+      std::ostringstream os;
+      if (ret == LZMA_BUF_ERROR) {
+        os << "unexpected end of xz data; the file may be truncated";
+      } else {
+        os << "xz data error (lzma_ret " << static_cast<int>(ret) << ")";
+      }
+      error = os.str();
+      break;
+    }
+  }
+  if (!stopped && error.empty() && strm.avail_out != kBlockSize) {
+    block.resize(kBlockSize - strm.avail_out);
+    sink(&block);
+  }
+  lzma_end(&strm);
+  return error;
+}
+#endif
+
+#ifdef KALDILM_HAVE_ZSTD
+std::string DecompressZstd(const char *data, std::size_t size,
+                           const BlockSink &sink) {
+  ZSTD_DStream *stream = ZSTD_createDStream();
+  if (stream == nullptr) return "ZSTD_createDStream failed";
+  ZSTD_initDStream(stream);
+
+  ZSTD_inBuffer in = {data, size, 0};
+  std::string block(kBlockSize, '\0');
+  ZSTD_outBuffer out = {&block[0], kBlockSize, 0};
+  std::string error;
+  bool stopped = false;  // The reader is gone.
+  while (true) {
+    std::size_t ret = ZSTD_decompressStream(stream, &out, &in);
+    if (ZSTD_isError(ret)) {
+      error = std::string("zstd data error: ") + ZSTD_getErrorName(ret);
+      break;
+    }
+    if (out.pos == out.size) {
+      if (!sink(&block)) {
+        stopped = true;
+        break;
+      }
+      block.resize(kBlockSize);
+      out.dst = &block[0];
+      out.pos = 0;
+    } else if (in.pos == in.size) {
+      // The decoder flushed everything it could, and there is no more input.
+      // A non-zero ret means the last frame is incomplete.
+      if (ret != 0) {
+        error = "unexpected end of zstd data; the file may be truncated";
+      }
+      break;
+    }
+  }
+  if (!stopped && error.empty() && out.pos != 0) {
+    block.resize(out.pos);
+    sink(&block);
+  }
+  ZSTD_freeDStream(stream);
+  return error;
+}
+#endif
+
+}  // namespace
+
+Compression DetectCompression(const char *data, std::size_t size) {
+  if (HasPrefix(data, size, "\x1f\x8b", 2)) return Compression::kGzip;
+  if (HasPrefix(data, size, "\xfd" "7zXZ\x00", 6)) return Compression::kXz;
+  if (HasPrefix(data, size, "\x28\xb5\x2f\xfd", 4)) return Compression::kZstd;
+  return Compression::kNone;
+}
+
+const char *CompressionName(Compression compression) {
+  switch (compression) {
+    case Compression::kGzip:
+      return "gzip";
+    case Compression::kXz:
+      return "xz";
+    case Compression::kZstd:
+      return "zstd";
+    default:
+      return "none";
+  }
+}
+
+DecompressingStreamBuf::DecompressingStreamBuf(const char *data,
+                                               std::size_t size,
+                                               Compression compression)
+    : data_(data), size_(size), compression_(compression) {
+  switch (compression) {
+    case Compression::kGzip:
+#ifndef KALDILM_HAVE_ZLIB
+      KALDILM_ERR << "kaldilm was built without zlib. Cannot read gzip input";
+#endif
+      break;
+    case Compression::kXz:
+#ifndef KALDILM_HAVE_LZMA
+      KALDILM_ERR << "kaldilm was built without liblzma. Cannot read xz input";
+#endif
+      break;
+    case Compression::kZstd:
+#ifndef KALDILM_HAVE_ZSTD
+      KALDILM_ERR << "kaldilm was built without zstd. Cannot read zstd input";
+#endif
+      break;
+    default:
+      KALDILM_ERR << "Input is not compressed";
+  }
+  thread_ = std::thread(&DecompressingStreamBuf::Decompress, this);
+}
+
+DecompressingStreamBuf::~DecompressingStreamBuf() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+void DecompressingStreamBuf::Decompress() {
+  BlockSink sink = [this](std::string *block) { return PushBlock(block); };
+  std::string error;
+  switch (compression_) {
+#ifdef KALDILM_HAVE_ZLIB
+    case Compression::kGzip:
+      error = DecompressGzip(data_, size_, sink);
+      break;
+#endif
+#ifdef KALDILM_HAVE_LZMA
+    case Compression::kXz:
+      error = DecompressXz(data_, size_, sink);
+      break;
+#endif
+#ifdef KALDILM_HAVE_ZSTD
+    case Compression::kZstd:
+      error = DecompressZstd(data_, size_, sink);
+      break;
+#endif
+    default:
+      break;
+  }
+  Finish(error);
+}
+
+bool DecompressingStreamBuf::PushBlock(std::string *block) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] {
+    return blocks_.size() < kMaxQueuedBlocks || cancelled_;
+  });
+  if (cancelled_) return false;
+  blocks_.emplace_back();
+  blocks_.back().swap(*block);
+  lock.unlock();
+  cond_.notify_all();
+  return true;
+}
+
+void DecompressingStreamBuf::Finish(const std::string &error) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    error_ = error;
+  }
+  cond_.notify_all();
+}
+
+DecompressingStreamBuf::int_type DecompressingStreamBuf::underflow() {
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return !blocks_.empty() || done_; });
+  if (blocks_.empty()) {
+    if (!error_.empty()) KALDILM_ERR << "Failed to decompress: " << error_;
+    return traits_type::eof();
+  }
+  current_.swap(blocks_.front());
+  blocks_.pop_front();
+  lock.unlock();
+  cond_.notify_all();
+
+  char *begin = &current_[0];
+  setg(begin, begin, begin + current_.size());
+  return traits_type::to_int_type(*gptr());
+}
+
+}  // namespace kaldilm
@@ -0,0 +1,89 @@
+// kaldilm/csrc/decompressing_stream.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_DECOMPRESSING_STREAM_H_
+#define KALDILM_CSRC_DECOMPRESSING_STREAM_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+namespace kaldilm {
+
+enum class Compression {
+  kNone,
+  kGzip,
+  kXz,
+  kZstd,
+};
+
+/// Detect the compression format of a file from its leading magic bytes.
+Compression DetectCompression(const char *data, std::size_t size);
+
+/// Return a human readable name of the format, e.g., "gzip".
+const char *CompressionName(Compression compression);
+
+/**
+   A read-only stream buffer that decompresses an in-memory buffer, e.g.,
+   a memory-mapped .arpa.gz file, on a background thread.
+
+   Decompressed data is handed to the reader through a bounded queue of
+   blocks, so decompression overlaps with whatever consumes the stream,
+   while memory usage stays at a few blocks regardless of the file size.
+
+   Errors of the decompressor, e.g., a truncated or corrupted file, are
+   reported with KALDILM_ERR on the reading thread once all data decoded
+   before the error has been consumed. The exception gets through an
+   std::istream only if badbit is set in its exceptions().
+
+   Usage:
+
+     DecompressingStreamBuf buf(data, size, Compression::kGzip);
+     std::istream is(&buf);
+     // read from is
+ */
+class DecompressingStreamBuf : public std::streambuf {
+ public:
+  /// The compressed data must stay valid during the lifetime of this object.
+  /// It fails if support for the given format was not compiled in.
+  DecompressingStreamBuf(const char *data, std::size_t size,
+                         Compression compression);
+  ~DecompressingStreamBuf() override;
+
+  DecompressingStreamBuf(const DecompressingStreamBuf &) = delete;
+  DecompressingStreamBuf &operator=(const DecompressingStreamBuf &) = delete;
+
+ protected:
+  int_type underflow() override;
+
+ private:
+  // Body of the background thread.
+  void Decompress();
+
+  // Called by the background thread. Return false if the reader is gone.
+  bool PushBlock(std::string *block);
+  void Finish(const std::string &error);
+
+  const char *data_;
+  std::size_t size_;
+  Compression compression_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::string> blocks_;  // Decompressed, not yet read.
+  bool done_ = false;               // No more blocks will be pushed.
+  bool cancelled_ = false;          // Set when the reader goes away.
+  std::string error_;
+
+  std::string current_;  // The block being read.
+  std::thread thread_;
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_DECOMPRESSING_STREAM_H_
@@ -0,0 +1,135 @@
+// kaldilm/csrc/flat_hash_map.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_FLAT_HASH_MAP_H_
+#define KALDILM_CSRC_FLAT_HASH_MAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace kaldilm {
+
+/// Finalizer of MurmurHash3. It spreads every input bit over the whole
+/// output, so that the low bits can be used as a table index.
+inline uint64_t MixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+   A hash map with open addressing and linear probing, storing keys and
+   values inline in a single array. Compared with std::unordered_map, it
+   needs no per-entry allocation, and a lookup usually touches a single
+   cache line.
+
+   It supports only what the LM compiler and the parser need: lookup,
+   insertion, prefetching and clearing. There is no erase. A key equal to
+   `empty_key`, given in the constructor, marks an unused slot and must
+   never be inserted. It is copied into every unused slot, so it should be
+   cheap to copy, e.g., need no allocation.
+
+   Hash must mix its input well, since the low bits of the hash value are
+   used as the index into the table; see MixHash().
+ */
+template <class Key, class Value, class Hash>
+class FlatHashMap {
+ public:
+  explicit FlatHashMap(const Key &empty_key) : empty_key_(empty_key) {
+    Rehash(kMinCapacity);
+  }
+
+  /// Make room for n entries in total without rehashing.
+  void Reserve(std::size_t n) {
+    std::size_t capacity = kMinCapacity;
+    while (capacity * kMaxLoadNum / kMaxLoadDen < n) capacity *= 2;
+    if (capacity > slots_.size()) Rehash(capacity);
+  }
+
+  /// Return a pointer to the value of the key, or nullptr if not found.
+  /// The pointer is invalidated by the next insertion.
+  Value *Find(const Key &key) {
+    for (std::size_t i = Hash()(key) & mask_;; i = (i + 1) & mask_) {
+      Slot &slot = slots_[i];
+      if (slot.first == key) return &slot.second;
+      if (slot.first == empty_key_) return nullptr;
+    }
+  }
+
+  const Value *Find(const Key &key) const {
+    return const_cast<FlatHashMap *>(this)->Find(key);
+  }
+
+  /// Insert a key that is not in the map yet.
+  void Insert(Key key, const Value &value) {
+    if ((size_ + 1) * kMaxLoadDen > slots_.size() * kMaxLoadNum) {
+      Rehash(slots_.size() * 2);
+    }
+    InsertUnique(std::move(key), value);
+    ++size_;
+  }
+
+  /// Hint that the key is about to be looked up.
+  void Prefetch(const Key &key) const {
+#if defined(__GNUC__)
+    __builtin_prefetch(&slots_[Hash()(key) & mask_]);
+#endif
+  }
+
+  std::size_t Size() const { return size_; }
+
+  /// Remove all entries, keeping the capacity.
+  void Clear() {
+    for (Slot &slot : slots_) slot.first = empty_key_;
+    size_ = 0;
+  }
+
+  /// Bytes used by the table, excluding memory owned by keys and values.
+  std::size_t MemoryUsage() const { return slots_.size() * sizeof(Slot); }
+
+  /// Entries per slot; at most kMaxLoadNum / kMaxLoadDen.
+  double LoadFactor() const {
+    return slots_.empty() ? 0.0 : static_cast<double>(size_) / slots_.size();
+  }
+
+ private:
+  typedef std::pair<Key, Value> Slot;
+
+  enum { kMinCapacity = 16 };
+  // The table is grown once it is 3/4 full.
+  enum { kMaxLoadNum = 3, kMaxLoadDen = 4 };
+
+  void InsertUnique(Key &&key, const Value &value) {
+    std::size_t i = Hash()(key) & mask_;
+    while (!(slots_[i].first == empty_key_)) i = (i + 1) & mask_;
+    slots_[i].first = std::move(key);
+    slots_[i].second = value;
+  }
+
+  // capacity must be a power of 2.
+  void Rehash(std::size_t capacity) {
+    std::vector<Slot> old(capacity, Slot(empty_key_, Value()));
+    old.swap(slots_);
+    mask_ = capacity - 1;
+    for (Slot &slot : old) {
+      if (!(slot.first == empty_key_)) {
+        InsertUnique(std::move(slot.first), slot.second);
+      }
+    }
+  }
+
+  Key empty_key_;
+  std::vector<Slot> slots_;
+  std::size_t mask_ = 0;
+  std::size_t size_ = 0;
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_FLAT_HASH_MAP_H_
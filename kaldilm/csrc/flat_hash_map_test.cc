@@ -0,0 +1,128 @@
+// kaldilm/csrc/flat_hash_map_test.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/flat_hash_map.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#include <cassert>
+#define NDEBUG
+#else
+#include <cassert>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "kaldilm/csrc/log.h"
+
+namespace kaldilm {
+
+struct IntHash {
+  std::size_t operator()(int64_t key) const { return MixHash(key); }
+};
+
+// Maps every key to one of a few slots, so that runs of occupied slots
+// are long and wrap around the end of the table.
+struct CollidingHash {
+  std::size_t operator()(int64_t key) const { return key % 3 - 1; }
+};
+
+typedef FlatHashMap<int64_t, int32_t, IntHash> IntMap;
+
+// Every entry must be found with its value, and nothing else.
+template <class Map>
+static void ExpectSameEntries(const Map &map,
+                              const std::unordered_map<int64_t, int32_t> &ref,
+                              const std::vector<int64_t> &missing) {
+  assert(map.Size() == ref.size());
+  for (const auto &entry : ref) {
+    const int32_t *value = map.Find(entry.first);
+    assert(value != nullptr && *value == entry.second);
+  }
+  for (int64_t key : missing) assert(map.Find(key) == nullptr);
+}
+
+// The table doubles once it gets 3/4 full, and keeps all entries across
+// each rehash.
+static void TestGrowth() {
+  IntMap map(-1);
+  const std::size_t slot_size = map.MemoryUsage() / 16;
+  std::unordered_map<int64_t, int32_t> ref;
+  std::mt19937 gen(20201017);
+  std::uniform_int_distribution<int64_t> key(0, int64_t(1) << 40);
+  int32_t num_rehashes = 0;
+  while (ref.size() != 100000) {
+    int64_t k = key(gen);
+    if (ref.count(k) != 0) continue;
+    std::size_t capacity = map.MemoryUsage() / slot_size;
+    int32_t value = ref.size();
+    map.Insert(k, value);
+    ref[k] = value;
+    assert(map.LoadFactor() <= 0.75);
+    if (map.MemoryUsage() != capacity * slot_size) {
+      // It grew exactly when the new entry would have exceeded 3/4.
+      assert(map.MemoryUsage() == 2 * capacity * slot_size);
+      assert(map.Size() * 4 == capacity * 3 + 4);
+      ++num_rehashes;
+      ExpectSameEntries(map, ref, {k + 1, -2});
+    }
+  }
+  assert(num_rehashes == 14);  // From 2^4 to 2^18 slots.
+  ExpectSameEntries(map, ref, {});
+
+  // Values can be updated through Find().
+  *map.Find(ref.begin()->first) = -5;
+  ref.begin()->second = -5;
+  ExpectSameEntries(map, ref, {});
+
+  map.Clear();
+  assert(map.Size() == 0);
+  assert(map.MemoryUsage() == (1 << 18) * slot_size);
+  for (const auto &entry : ref) assert(map.Find(entry.first) == nullptr);
+  map.Insert(3, 4);
+  ExpectSameEntries(map, {{3, 4}}, {-2});
+}
+
+// Reserve(n) makes room for n entries, so that no rehash happens until
+// then, and not for more than that if n is 3/4 of a power of 2.
+static void TestReserve() {
+  for (int64_t n : {0, 1, 12, 13, 1000, 49152, 49153}) {
+    IntMap map(-1);
+    map.Reserve(n);
+    std::size_t memory_usage = map.MemoryUsage();
+    for (int64_t i = 0; i != n; ++i) map.Insert(i, i);
+    assert(map.MemoryUsage() == memory_usage);
+    map.Insert(n, n);
+    if (n == 12 || n == 49152) assert(map.MemoryUsage() == 2 * memory_usage);
+    // Reserving less than the size does nothing.
+    map.Reserve(1);
+    assert(map.Size() == static_cast<std::size_t>(n + 1));
+    for (int64_t i = 0; i <= n; ++i) assert(*map.Find(i) == i);
+  }
+}
+
+// Linear probing must find keys past the end of the table, and keep
+// working when the runs are moved by a rehash.
+static void TestCollisions() {
+  FlatHashMap<int64_t, int32_t, CollidingHash> map(-1);
+  std::unordered_map<int64_t, int32_t> ref;
+  for (int64_t k = 0; k != 1000; ++k) {
+    map.Insert(k * 7, k);
+    ref[k * 7] = k;
+    if (k % 97 == 0) ExpectSameEntries(map, ref, {k * 7 + 1});
+  }
+  ExpectSameEntries(map, ref, {-7, 7001});
+}
+
+}  // namespace kaldilm
+
+int main(int argc, char *argv[]) {
+  kaldilm::TestGrowth();
+  kaldilm::TestReserve();
+  kaldilm::TestCollisions();
+}
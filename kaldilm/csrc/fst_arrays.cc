@@ -0,0 +1,63 @@
+// kaldilm/csrc/fst_arrays.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/fst_arrays.h"
+
+namespace kaldilm {
+
+namespace {
+
+using StateId = fst::StdArc::StateId;
+
+// Size the arrays for fst, and fill in the start state and the row splits.
+// The arcs and final weights are left to the caller, which fills them in
+// for ranges of states in parallel.
+void InitArrays(const fst::StdExpandedFst &fst, FstArrays *arrays) {
+  StateId num_states = fst.NumStates();
+  arrays->start = fst.Start();
+  arrays->row_splits.resize(num_states + 1);
+  arrays->row_splits[0] = 0;
+  for (StateId s = 0; s != num_states; ++s) {
+    arrays->row_splits[s + 1] = arrays->row_splits[s] + fst.NumArcs(s);
+  }
+  std::size_t num_arcs = arrays->row_splits.back();
+  arrays->src.resize(num_arcs);
+  arrays->dst.resize(num_arcs);
+  arrays->ilabel.resize(num_arcs);
+  arrays->olabel.resize(num_arcs);
+  arrays->weight.resize(num_arcs);
+  arrays->final_weight.resize(num_states);
+}
+
+inline void SetArc(StateId s, const fst::StdArc &arc, int64_t i,
+                   FstArrays *arrays) {
+  arrays->src[i] = s;
+  arrays->dst[i] = arc.nextstate;
+  arrays->ilabel[i] = arc.ilabel;
+  arrays->olabel[i] = arc.olabel;
+  arrays->weight[i] = arc.weight.Value();
+}
+
+}  // namespace
+
+void ExportFstArrays(const fst::StdExpandedFst &fst, ThreadPool *pool,
+                     FstArrays *arrays) {
+  InitArrays(fst, arrays);
+  // Arc iterators of VectorFst and ConstFst only read the FST, so states
+  // can be visited from several threads.
+  ParallelForRanges(
+      pool, fst.NumStates(),
+      [&fst, arrays](int32_t, std::size_t begin, std::size_t end) {
+        for (StateId s = begin; s != static_cast<StateId>(end); ++s) {
+          arrays->final_weight[s] = fst.Final(s).Value();
+          int64_t i = arrays->row_splits[s];
+          for (fst::ArcIterator<fst::StdExpandedFst> aiter(fst, s);
+               !aiter.Done(); aiter.Next(), ++i) {
+            SetArc(s, aiter.Value(), i, arrays);
+          }
+        }
+      });
+}
+
+}  // namespace kaldilm
@@ -0,0 +1,43 @@
+// kaldilm/csrc/fst_arrays.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_FST_ARRAYS_H_
+#define KALDILM_CSRC_FST_ARRAYS_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "fst/fstlib.h"
+#include "kaldilm/csrc/thread_pool.h"
+
+namespace kaldilm {
+
+/**
+   An FST as flat arrays, for consumers such as k2 and PyTorch that build
+   their own graphs from them.
+
+   The arcs of state s are [row_splits[s], row_splits[s + 1]) in src, dst,
+   ilabel, olabel and weight, in the order of the FST. Weights are costs,
+   i.e., negated natural log probabilities, as in the FST. A state that is
+   not final has a final weight of infinity.
+ */
+struct FstArrays {
+  int32_t start = -1;  // -1 if the FST is empty.
+  std::vector<int64_t> row_splits;  // Size is the number of states plus 1.
+  std::vector<int32_t> src;
+  std::vector<int32_t> dst;
+  std::vector<int32_t> ilabel;
+  std::vector<int32_t> olabel;
+  std::vector<float> weight;
+  std::vector<float> final_weight;  // Size is the number of states.
+};
+
+/// Export fst, e.g., ArpaLmCompiler::Fst(), into arrays. If pool is not
+/// nullptr, ranges of states are exported on it in parallel.
+void ExportFstArrays(const fst::StdExpandedFst &fst, ThreadPool *pool,
+                     FstArrays *arrays);
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_FST_ARRAYS_H_
@@ -0,0 +1,193 @@
+// kaldilm/csrc/fst_text_writer.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/fst_text_writer.h"
+
+#include <clocale>
+#include <cstdio>
+#include <future>
+#include <limits>
+#include <vector>
+
+namespace kaldilm {
+
+namespace {
+
+using StateId = fst::StdArc::StateId;
+using Weight = fst::StdArc::Weight;
+
+// Number of lines formatted by one task, roughly.
+constexpr int64_t kChunkLines = 1 << 16;
+
+// States at positions [begin, end) of the output, and their text.
+struct Chunk {
+  StateId begin = 0;
+  StateId end = 0;
+  std::string text;
+};
+
+// Return the state printed at position p. fst::FstPrinter prints the start
+// state first.
+inline StateId StateAt(StateId start, StateId p) {
+  return p == 0 ? start : (p <= start ? p - 1 : p);
+}
+
+inline void AppendInt(int64_t n, std::string *text) {
+  char buf[24];
+  char *end = buf + sizeof(buf);
+  char *p = end;
+  uint64_t u = n < 0 ? 0 - static_cast<uint64_t>(n) : n;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (n < 0) *--p = '-';
+  text->append(p, end);
+}
+
+// Append w as fst::FloatWeightTpl's operator<< writes it to a stream with
+// the default flags. point is the decimal point of the C locale, which
+// snprintf() uses, whereas the stream uses '.'.
+inline void AppendWeight(const Weight &w, char point, std::string *text) {
+  float value = w.Value();
+  if (value == std::numeric_limits<float>::infinity()) {
+    text->append("Infinity");
+  } else if (value == -std::numeric_limits<float>::infinity()) {
+    text->append("-Infinity");
+  } else if (value != value) {
+    text->append("BadNumber");
+  } else {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.6g", value);
+    if (point != '.') {
+      for (int i = 0; i != n; ++i) {
+        if (buf[i] == point) buf[i] = '.';
+      }
+    }
+    text->append(buf, n);
+  }
+}
+
+void FormatChunk(const fst::StdExpandedFst &fst, StateId start, char point,
+                 Chunk *chunk) {
+  std::string *text = &chunk->text;
+  text->clear();
+  for (StateId p = chunk->begin; p != chunk->end; ++p) {
+    StateId s = StateAt(start, p);
+    bool output = false;
+    for (fst::ArcIterator<fst::StdExpandedFst> aiter(fst, s); !aiter.Done();
+         aiter.Next()) {
+      const fst::StdArc &arc = aiter.Value();
+      AppendInt(s, text);
+      text->push_back('\t');
+      AppendInt(arc.nextstate, text);
+      text->push_back('\t');
+      AppendInt(arc.ilabel, text);
+      text->push_back('\t');
+      AppendInt(arc.olabel, text);
+      if (arc.weight != Weight::One()) {
+        text->push_back('\t');
+        AppendWeight(arc.weight, point, text);
+      }
+      text->push_back('\n');
+      output = true;
+    }
+    Weight final_weight = fst.Final(s);
+    if (final_weight != Weight::Zero() || !output) {
+      AppendInt(s, text);
+      if (final_weight != Weight::One()) {
+        text->push_back('\t');
+        AppendWeight(final_weight, point, text);
+      }
+      text->push_back('\n');
+    }
+  }
+}
+
+// Pass the text of fst to write(const std::string &) chunk by chunk.
+template <class Write>
+void WriteChunks(const fst::StdExpandedFst &fst, ThreadPool *pool,
+                 Write write) {
+  StateId start = fst.Start();
+  if (start == fst::kNoStateId) return;
+  StateId num_states = fst.NumStates();
+  char point = *localeconv()->decimal_point;
+
+  StateId next = 0;
+  auto cut = [&fst, start, num_states, &next](Chunk *chunk) {
+    chunk->begin = next;
+    int64_t num_lines = 0;
+    while (next != num_states && num_lines < kChunkLines) {
+      num_lines += fst.NumArcs(StateAt(start, next++)) + 1;
+    }
+    chunk->end = next;
+  };
+
+  if (pool == nullptr) {
+    Chunk chunk;
+    while (next != num_states) {
+      cut(&chunk);
+      FormatChunk(fst, start, point, &chunk);
+      write(chunk.text);
+    }
+    return;
+  }
+
+  // As in ArpaFileParser::ReadNGramLines(), one window of chunks is being
+  // formatted while the one before it is written. Chunks keep their
+  // buffers from one window to the next.
+  int32_t chunks_per_window = 2 * pool->NumThreads();
+  std::vector<Chunk> windows[2];
+  std::vector<std::future<void>> futures[2];
+  for (auto &window : windows) window.resize(chunks_per_window);
+
+  auto submit = [&](int32_t w) {
+    for (int32_t c = 0; c != chunks_per_window && next != num_states; ++c) {
+      Chunk *chunk = &windows[w][c];
+      cut(chunk);
+      futures[w].push_back(pool->Enqueue([&fst, start, point, chunk] {
+        FormatChunk(fst, start, point, chunk);
+      }));
+    }
+  };
+
+  int32_t cur = 0;
+  try {
+    submit(cur);
+    while (!futures[cur].empty()) {
+      submit(1 - cur);
+      for (std::size_t c = 0; c != futures[cur].size(); ++c) {
+        futures[cur][c].get();
+        write(windows[cur][c].text);
+      }
+      futures[cur].clear();
+      cur = 1 - cur;
+    }
+  } catch (...) {
+    // The tasks refer to the windows.
+    for (auto &window_futures : futures) {
+      for (auto &future : window_futures) {
+        if (future.valid()) future.wait();
+      }
+    }
+    throw;
+  }
+}
+
+}  // namespace
+
+void WriteFstText(const fst::StdExpandedFst &fst, ThreadPool *pool,
+                  std::ostream &os) {
+  WriteChunks(fst, pool, [&os](const std::string &text) {
+    os.write(text.data(), text.size());
+  });
+}
+
+void WriteFstText(const fst::StdExpandedFst &fst, ThreadPool *pool,
+                  std::string *text) {
+  WriteChunks(fst, pool,
+              [text](const std::string &chunk) { text->append(chunk); });
+}
+
+}  // namespace kaldilm
@@ -0,0 +1,38 @@
+// kaldilm/csrc/fst_text_writer.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_FST_TEXT_WRITER_H_
+#define KALDILM_CSRC_FST_TEXT_WRITER_H_
+
+#include <ostream>
+#include <string>
+
+#include "fst/fstlib.h"
+#include "kaldilm/csrc/thread_pool.h"
+
+namespace kaldilm {
+
+/**
+   Write fst in text format, byte for byte as fst::FstPrinter writes it
+   with a tab separator and no symbol tables, which is how Kaldi prints
+   FSTs: the start state first, and then the other states in order, each
+   with a line "src dst ilabel olabel [weight]" per arc, and a line
+   "state [weight]" if it is final or has no arcs. Weights equal to One()
+   are left out, and the others are printed as std::ostream prints floats
+   by default, i.e., with 6 significant digits.
+
+   If pool is not nullptr, ranges of states are formatted on it in
+   parallel, while the ranges before them are written, in order. Only a
+   few ranges per thread are held in memory at a time.
+ */
+void WriteFstText(const fst::StdExpandedFst &fst, ThreadPool *pool,
+                  std::ostream &os);
+
+/// The same, appending to *text.
+void WriteFstText(const fst::StdExpandedFst &fst, ThreadPool *pool,
+                  std::string *text);
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_FST_TEXT_WRITER_H_
@@ -0,0 +1,160 @@
+// kaldilm/csrc/hist_key.h
+//
+// This file is copied/modified from
+// https://github.com/kaldi-asr/kaldi/blob/master/src/lm/arpa-lm-compiler.cc
+//
+// Copyright 2009-2011 Gilles Boulianne
+// Copyright 2016 Smart Action LLC (kkm)
+// Copyright 2017 Xiaohui Zhang
+
+#ifndef KALDILM_CSRC_HIST_KEY_H_
+#define KALDILM_CSRC_HIST_KEY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "kaldilm/csrc/flat_hash_map.h"
+
+// Keys of the n-gram histories of ArpaLmCompiler, for the history trackers
+// of history_tracker.h. A key class must provide:
+//
+//   - a constructor from a range of symbol ids, the words of the history;
+//   - a default constructor for the empty history;
+//   - Invalid(), a key that no history maps to, cheap to copy;
+//   - Tails(), the key without the first word;
+//   - operator==, and a HashType whose values are mixed; see MixHash().
+
+namespace kaldilm {
+
+/// A hashing function-object for vectors.
+template <typename Int>
+struct VectorHasher {  // hashing function for vector<Int>.
+  size_t operator()(const std::vector<Int> &x) const noexcept {
+    size_t ans = 0;
+    typename std::vector<Int>::const_iterator iter = x.begin(), end = x.end();
+    for (; iter != end; ++iter) {
+      ans *= kPrime;
+      ans += *iter;
+    }
+    return ans;
+  }
+  VectorHasher() {  // Check we're instantiated with an integer type.
+    static_assert(std::is_integral<Int>::value, "");
+  }
+
+ private:
+  static const int kPrime = 7853;
+};
+
+// GeneralHistKey can represent state history in an arbitrarily large n
+// n-gram model with symbol ids fitting int32_t.
+//
+// The empty history is stored as a single epsilon (0), which is never in a
+// history, so that the invalid key can be the one without words. It then
+// needs no allocation, which matters as it fills every unused slot of the
+// hash map.
+class GeneralHistKey {
+ public:
+  // Construct key from being and end iterators.
+  template <class InputIt>
+  GeneralHistKey(InputIt begin, InputIt end) : vector_(begin, end) {
+    if (vector_.empty()) vector_.push_back(0);
+  }
+  // Construct empty history key.
+  GeneralHistKey() : vector_(1, 0) {}
+  // A key that no history maps to, for marking unused hash map slots.
+  static GeneralHistKey Invalid() {
+    return GeneralHistKey(std::vector<int32_t>());
+  }
+  // Return tails of the key as a GeneralHistKey. The tails of an n-gram
+  // w[1..n] is the sequence w[2..n] (and the heads is w[1..n-1], but the
+  // key class does not need this operartion).
+  GeneralHistKey Tails() const {
+    return GeneralHistKey(vector_.begin() + 1, vector_.end());
+  }
+  // Keys are equal if represent same state.
+  friend bool operator==(const GeneralHistKey &a, const GeneralHistKey &b) {
+    return a.vector_ == b.vector_;
+  }
+  // Public typename HashType for hashing.
+  struct HashType : public std::unary_function<GeneralHistKey, size_t> {
+    size_t operator()(const GeneralHistKey &key) const {
+      return MixHash(VectorHasher<int32_t>().operator()(key.vector_));
+    }
+  };
+
+ private:
+  explicit GeneralHistKey(std::vector<int32_t> &&vector)
+      : vector_(std::move(vector)) {}
+
+  std::vector<int32_t> vector_;
+};
+
+// PackedHistKey packs up to kCapacity symbol ids of kBits bits each into
+// kNumWords 64-bit machine words, e.g., 6 21-bit ids into 128 bits. This
+// avoids the heap allocation of GeneralHistKey and is much more compact,
+// so it is used whenever the history of the model and the largest symbol
+// id fit; see ArpaLmCompiler::HeaderAvailable().
+//
+// See GeneralHistKey for interface requirements of a key class.
+template <int kNumWords, int kBits>
+class PackedHistKey {
+ public:
+  // Max number of symbols in a key.
+  static constexpr int kCapacity = 64 * kNumWords / kBits;
+  // Symbol ids must be less than kMaxData, so that no key has all bits set.
+  static constexpr uint64_t kMaxData = (uint64_t(1) << kBits) - 1;
+
+  template <class InputIt>
+  PackedHistKey(InputIt begin, InputIt end) : PackedHistKey() {
+    for (int shift = 0; begin != end; ++begin, shift += kBits) {
+      uint64_t symbol = static_cast<uint64_t>(*begin);
+      int word = shift / 64, offset = shift % 64;
+      data_[word] |= symbol << offset;
+      // A symbol may straddle two words.
+      if (offset + kBits > 64) data_[word + 1] |= symbol >> (64 - offset);
+    }
+  }
+  PackedHistKey() {
+    for (int i = 0; i != kNumWords; ++i) data_[i] = 0;
+  }
+  // A key that no history maps to, for marking unused hash map slots.
+  static PackedHistKey Invalid() {
+    PackedHistKey key;
+    for (int i = 0; i != kNumWords; ++i) key.data_[i] = ~uint64_t(0);
+    return key;
+  }
+  // Shift the whole key right by one symbol.
+  PackedHistKey Tails() const {
+    PackedHistKey key;
+    for (int i = 0; i != kNumWords; ++i) {
+      key.data_[i] = data_[i] >> kBits;
+      if (i + 1 != kNumWords) key.data_[i] |= data_[i + 1] << (64 - kBits);
+    }
+    return key;
+  }
+  friend bool operator==(const PackedHistKey &a, const PackedHistKey &b) {
+    for (int i = 0; i != kNumWords; ++i) {
+      if (a.data_[i] != b.data_[i]) return false;
+    }
+    return true;
+  }
+  struct HashType : public std::unary_function<PackedHistKey, size_t> {
+    size_t operator()(const PackedHistKey &key) const {
+      uint64_t h = key.data_[0];
+      for (int i = 1; i != kNumWords; ++i) h = MixHash(h) ^ key.data_[i];
+      return MixHash(h);
+    }
+  };
+
+ private:
+  uint64_t data_[kNumWords];
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_HIST_KEY_H_
@@ -0,0 +1,94 @@
+// kaldilm/csrc/hist_key_test.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/hist_key.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#include <cassert>
+#define NDEBUG
+#else
+#include <cassert>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "kaldilm/csrc/log.h"
+
+namespace kaldilm {
+
+// Keys of histories must be equal, and hash equally, exactly when the
+// histories are, and Tails() must drop the first word. This is checked on
+// random histories of up to max_length words up to max_symbol, on the
+// largest ids, and on histories that differ in a single bit of one word,
+// which for packed keys may straddle two machine words. Symbol 0 is
+// epsilon, which is never in a history; packed keys do not tell a history
+// from the same one followed by 0.
+template <class HistKey>
+static void TestHistKey(int32_t max_length, int64_t max_symbol) {
+  typedef typename HistKey::HashType Hash;
+  std::mt19937 gen(20201017);
+  std::uniform_int_distribution<int64_t> symbol(1, max_symbol);
+  std::uniform_int_distribution<int32_t> length(0, max_length);
+  const HistKey invalid = HistKey::Invalid();
+  assert(HistKey() == HistKey(&max_length, &max_length));
+  assert(!(HistKey() == invalid));
+
+  for (int32_t n = 0; n != 10000; ++n) {
+    std::vector<int32_t> words(length(gen));
+    for (int32_t &w : words) w = symbol(gen);
+    if (n % 10 == 0) {
+      for (int32_t &w : words) w = max_symbol;
+    }
+    HistKey key(words.begin(), words.end());
+    assert(!(key == invalid));
+    assert(key == HistKey(words.data(), words.data() + words.size()));
+    assert(Hash()(key) == Hash()(HistKey(words.begin(), words.end())));
+
+    if (!words.empty()) {
+      assert(key.Tails() == HistKey(words.begin() + 1, words.end()));
+      std::vector<int32_t> heads(words.begin(), words.end() - 1);
+      assert(!(key == HistKey(heads.begin(), heads.end())));
+    }
+
+    for (std::size_t i = 0; i != words.size(); ++i) {
+      std::vector<int32_t> other = words;
+      int32_t bit = (n + i) % 32;
+      other[i] ^= int32_t(1) << bit;
+      if (other[i] <= 0 || other[i] > max_symbol) continue;
+      assert(!(key == HistKey(other.begin(), other.end())));
+    }
+  }
+}
+
+// Packed keys must hold kCapacity ids below kMaxData.
+template <int kNumWords, int kBits>
+static void TestPackedHistKey() {
+  typedef PackedHistKey<kNumWords, kBits> HistKey;
+  KALDILM_LOG << "TestPackedHistKey<" << kNumWords << ", " << kBits << ">";
+  static_assert(HistKey::kCapacity == 64 * kNumWords / kBits, "");
+  TestHistKey<HistKey>(HistKey::kCapacity,
+                       std::min<int64_t>(HistKey::kMaxData - 1, INT32_MAX));
+}
+
+}  // namespace kaldilm
+
+int main(int argc, char *argv[]) {
+  // All the widths that ArpaLmCompiler::HeaderAvailable() may pick.
+  kaldilm::TestPackedHistKey<1, 32>();
+  kaldilm::TestPackedHistKey<1, 21>();
+  kaldilm::TestPackedHistKey<1, 16>();
+  kaldilm::TestPackedHistKey<2, 32>();
+  kaldilm::TestPackedHistKey<2, 21>();
+  kaldilm::TestPackedHistKey<2, 16>();
+  kaldilm::TestPackedHistKey<3, 32>();
+  kaldilm::TestPackedHistKey<3, 21>();
+  kaldilm::TestPackedHistKey<3, 16>();
+
+  KALDILM_LOG << "TestGeneralHistKey";
+  kaldilm::TestHistKey<kaldilm::GeneralHistKey>(20, INT32_MAX);
+}
@@ -0,0 +1,325 @@
+// kaldilm/csrc/history_tracker.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_HISTORY_TRACKER_H_
+#define KALDILM_CSRC_HISTORY_TRACKER_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "kaldilm/csrc/flat_hash_map.h"
+#include "kaldilm/csrc/log.h"
+#include "kaldilm/csrc/spillable_array.h"
+
+namespace kaldilm {
+
+/**
+   History trackers map an n-gram history, given as a range of symbols, to
+   the FST state of the history. They are used by ArpaLmCompiler, which
+   looks up and inserts histories as follows:
+
+     - Insert(begin, end, state) is only called for histories that Find()
+       has just reported missing.
+     - The empty history is inserted first.
+
+   HistKey is a key class as described in hist_key.h.
+ */
+template <class HistKey>
+class HashHistoryTracker {
+ public:
+  HashHistoryTracker() : map_(HistKey::Invalid()) {}
+
+  /// Make room for n histories in total.
+  void Reserve(std::size_t n) { map_.Reserve(n); }
+
+  /// Return a pointer to the state of the history, or nullptr if it is not
+  /// known. The pointer is invalidated by the next insertion.
+  const int32_t *Find(const int32_t *begin, const int32_t *end) {
+    return map_.Find(HistKey(begin, end));
+  }
+
+  void Insert(const int32_t *begin, const int32_t *end, int32_t state) {
+    map_.Insert(HistKey(begin, end), state);
+  }
+
+  /// Hint that the history is about to be looked up.
+  void Prefetch(const int32_t *begin, const int32_t *end) const {
+    map_.Prefetch(HistKey(begin, end));
+  }
+
+  std::size_t Size() const { return map_.Size(); }
+  double LoadFactor() const { return map_.LoadFactor(); }
+
+ private:
+  FlatHashMap<HistKey, int32_t, typename HistKey::HashType> map_;
+};
+
+/**
+   A history tracker for n-grams that arrive sorted, as they do in most ARPA
+   files. The histories of length k form level k of a trie: node
+   (w_1 .. w_k) is the child of node (w_1 .. w_{k-1}) via the word w_k.
+
+   Nodes of a level are stored in flat arrays, and the children of every
+   node are a contiguous, sorted range of the next level, located through
+   a per-node offset (CSR layout). A lookup is thus a series of binary
+   searches within small ranges. Since consecutive n-grams of sorted input
+   share most of their prefix, the path of recent lookups is cached and
+   only the differing suffix is searched. It needs about 12 bytes per
+   history, several times less than a hash map, and accesses memory mostly
+   sequentially.
+
+   This works as long as the histories of each length are inserted in
+   increasing order of (parent node, word), which is the case for
+   histories created by the n-grams of a sorted file with symbol ids
+   assigned in the same order, e.g., by ArpaParseOptions::kAddToSymbols.
+   Unigrams may come in any order.
+
+   Histories shorter than the n-grams being added, i.e., those created for
+   the tails of the highest order n-grams, are kept in a hash tracker.
+   If an insertion breaks the order, all histories are moved to the hash
+   tracker, which is used from then on.
+
+   The arrays of the trie can be kept within a MemoryBudget, but those of
+   the hash tracker are always in memory.
+ */
+template <class HistKey>
+class TrieHistoryTracker {
+ public:
+  /// Must be called before the first insertion.
+  void SetMemoryBudget(MemoryBudget *budget) {
+    budget_ = budget;
+    unigram_nodes_ = SpillableArray<int32_t>(budget);
+  }
+
+  /// level_sizes[k] is the expected number of histories of length k + 1.
+  void Reserve(const std::vector<std::size_t> &level_sizes) {
+    for (std::size_t k = 0; k != level_sizes.size(); ++k) {
+      reserved_.push_back(level_sizes[k]);
+    }
+  }
+
+  /// Tell that n-grams of the given order are being added from now on.
+  void StartOrder(int32_t order) { order_ = order; }
+
+  const int32_t *Find(const int32_t *begin, const int32_t *end) {
+    if (!use_trie_) return hash_.Find(begin, end);
+    if (begin == end) return &root_state_;
+    int32_t node = FindNode(begin, end);
+    if (node != -1) return &levels_[end - begin - 1].states[node];
+    // Not in the trie. It may be a tail of a highest order n-gram.
+    if (hash_.Size() > 1) return hash_.Find(begin, end);
+    return nullptr;
+  }
+
+  void Insert(const int32_t *begin, const int32_t *end, int32_t state) {
+    int32_t length = end - begin;
+    if (length == 0) {
+      root_state_ = state;
+      hash_.Insert(begin, end, state);
+      return;
+    }
+    if (use_trie_) {
+      if (length < order_) {
+        hash_.Insert(begin, end, state);
+        return;
+      }
+      if (InsertIntoTrie(begin, end, state)) return;
+      SwitchToHash();
+    }
+    hash_.Insert(begin, end, state);
+  }
+
+  void Prefetch(const int32_t *begin, const int32_t *end) const {
+    if (!use_trie_) hash_.Prefetch(begin, end);
+  }
+
+  /// Whether all histories but the tails of the highest order n-grams are
+  /// still in the trie.
+  bool UsesTrie() const { return use_trie_; }
+  /// Load factor of the hash map of histories not in the trie.
+  double HashLoadFactor() const { return hash_.LoadFactor(); }
+
+ private:
+  struct Level {
+    explicit Level(MemoryBudget *budget)
+        : words(budget), states(budget), first_child(budget) {}
+
+    SpillableArray<int32_t> words;
+    SpillableArray<int32_t> states;
+    // first_child[i] is the index of the first child of node i in the next
+    // level. It is filled as the next level grows, so it may be shorter than
+    // words; see ChildRange().
+    SpillableArray<int32_t> first_child;
+  };
+
+  // The path of a recent lookup: nodes[d] is the node of words[0 .. d].
+  struct Finger {
+    std::vector<int32_t> words;
+    std::vector<int32_t> nodes;
+  };
+
+  // Return the children of node i of levels_[d] as [*begin, *end) of
+  // levels_[d + 1].
+  void ChildRange(int32_t d, int32_t i, int32_t *begin, int32_t *end) const {
+    const SpillableArray<int32_t> &first_child = levels_[d].first_child;
+    int32_t size = levels_[d + 1].words.size();
+    int32_t num_filled = first_child.size();
+    *begin = i < num_filled ? first_child[i] : size;
+    *end = i + 1 < num_filled ? first_child[i + 1] : size;
+  }
+
+  // Return the child of node `parent` of levels_[d - 1] via `word`, or -1.
+  // For d == 0, the parent is the root.
+  int32_t FindChild(int32_t d, int32_t parent, int32_t word) const {
+    if (d == 0) {
+      return word < static_cast<int32_t>(unigram_nodes_.size())
+                 ? unigram_nodes_[word]
+                 : -1;
+    }
+    int32_t begin, end;
+    ChildRange(d - 1, parent, &begin, &end);
+    const SpillableArray<int32_t> &words = levels_[d].words;
+    auto it = std::lower_bound(words.begin() + begin, words.begin() + end,
+                               word);
+    if (it == words.begin() + end || *it != word) return -1;
+    return it - words.begin();
+  }
+
+  // Return the node of the non-empty history [begin, end) in the trie, or
+  // -1 if it is not there.
+  int32_t FindNode(const int32_t *begin, const int32_t *end) {
+    int32_t length = end - begin;
+    if (length > static_cast<int32_t>(levels_.size())) return -1;
+
+    // Start from the cached path sharing the longest prefix. On a tie, reuse
+    // the least recently used one.
+    int32_t common = -1;
+    int32_t best = 0;
+    for (int32_t k = 1; k <= kNumFingers; ++k) {
+      int32_t f = (last_finger_ + k) % kNumFingers;
+      const std::vector<int32_t> &words = fingers_[f].words;
+      int32_t n = 0;
+      int32_t max_n = std::min<int32_t>(length, words.size());
+      while (n < max_n && words[n] == begin[n]) ++n;
+      if (n > common) {
+        common = n;
+        best = f;
+      }
+    }
+    last_finger_ = best;
+    Finger *finger = &fingers_[best];
+    finger->words.resize(common);
+    finger->nodes.resize(common);
+
+    int32_t node = common > 0 ? finger->nodes[common - 1] : -1;
+    for (int32_t d = common; d != length; ++d) {
+      node = FindChild(d, node, begin[d]);
+      if (node == -1) return -1;
+      finger->words.push_back(begin[d]);
+      finger->nodes.push_back(node);
+    }
+    return node;
+  }
+
+  // Append a history to the trie, starting a new level if it is longer than
+  // all before. Return false if it cannot be added in order.
+  bool InsertIntoTrie(const int32_t *begin, const int32_t *end,
+                      int32_t state) {
+    int32_t length = end - begin;
+    if (length > static_cast<int32_t>(levels_.size()) + 1) return false;
+    if (length > static_cast<int32_t>(levels_.size())) {
+      levels_.emplace_back(budget_);
+      if (length <= static_cast<int32_t>(reserved_.size())) {
+        levels_.back().words.reserve(reserved_[length - 1]);
+        levels_.back().states.reserve(reserved_[length - 1]);
+      }
+      last_parent_ = -1;
+    }
+
+    Level &level = levels_[length - 1];
+    int32_t word = end[-1];
+    int32_t index = level.words.size();
+    if (length == 1) {
+      // Unigrams are indexed directly by word.
+      if (word >= static_cast<int32_t>(unigram_nodes_.size())) {
+        unigram_nodes_.resize(word + 1, -1);
+      }
+      unigram_nodes_[word] = index;
+    } else {
+      int32_t parent = FindNode(begin, end - 1);
+      if (parent == -1) return false;
+      if (parent < last_parent_ ||
+          (parent == last_parent_ && word <= level.words.back())) {
+        return false;
+      }
+      SpillableArray<int32_t> &first_child = levels_[length - 2].first_child;
+      while (static_cast<int32_t>(first_child.size()) <= parent) {
+        first_child.push_back(index);
+      }
+      last_parent_ = parent;
+    }
+    level.words.push_back(word);
+    level.states.push_back(state);
+    return true;
+  }
+
+  // Move all histories of the trie to the hash tracker.
+  void SwitchToHash() {
+    KALDILM_LOG << "N-grams are not sorted. Switching from trie to hash "
+                << "based history tracking.";
+    std::size_t num_histories = hash_.Size();
+    for (const Level &level : levels_) num_histories += level.words.size();
+    hash_.Reserve(num_histories);
+
+    std::vector<int32_t> path;
+    if (!levels_.empty()) {
+      for (int32_t i = 0; i != levels_[0].words.size(); ++i) {
+        MoveToHash(0, i, &path);
+      }
+    }
+
+    use_trie_ = false;
+    std::vector<Level>().swap(levels_);
+    SpillableArray<int32_t>(budget_).swap(unigram_nodes_);
+    for (Finger &f : fingers_) f = Finger();
+  }
+
+  // Insert node i of levels_[d] and its descendants into the hash tracker.
+  // path holds the words leading to the node.
+  void MoveToHash(int32_t d, int32_t i, std::vector<int32_t> *path) {
+    path->push_back(levels_[d].words[i]);
+    hash_.Insert(path->data(), path->data() + path->size(),
+                 levels_[d].states[i]);
+    if (d + 1 < static_cast<int32_t>(levels_.size())) {
+      int32_t begin, end;
+      ChildRange(d, i, &begin, &end);
+      for (int32_t c = begin; c != end; ++c) MoveToHash(d + 1, c, path);
+    }
+    path->pop_back();
+  }
+
+  MemoryBudget *budget_ = nullptr;  // Not owned.
+  bool use_trie_ = true;
+  int32_t order_ = 0;  // Order of the n-grams being added.
+  int32_t root_state_ = -1;
+  std::vector<Level> levels_;  // levels_[k] has histories of k + 1.
+  SpillableArray<int32_t> unigram_nodes_;  // Node of each word in levels_[0].
+  int32_t last_parent_ = -1;  // Parent of the last node inserted.
+  std::vector<std::size_t> reserved_;
+
+  // Lookups of heads and of tails of n-grams alternate, so keep one cached
+  // path for each.
+  static constexpr int32_t kNumFingers = 2;
+  Finger fingers_[kNumFingers];
+  int32_t last_finger_ = 0;  // The most recently used one.
+
+  // Histories not in the trie; everything once use_trie_ is false.
+  HashHistoryTracker<HistKey> hash_;
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_HISTORY_TRACKER_H_
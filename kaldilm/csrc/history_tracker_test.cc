@@ -0,0 +1,214 @@
+// kaldilm/csrc/history_tracker_test.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/history_tracker.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#include <cassert>
+#define NDEBUG
+#else
+#include <cassert>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "kaldilm/csrc/hist_key.h"
+#include "kaldilm/csrc/log.h"
+#include "kaldilm/csrc/spillable_array.h"
+
+namespace kaldilm {
+
+typedef std::vector<int32_t> History;
+
+// Drives a TrieHistoryTracker the way ArpaLmCompiler does, and checks
+// every lookup against a std::map.
+template <class HistKey>
+class TrackerChecker {
+ public:
+  explicit TrackerChecker(MemoryBudget *budget) {
+    if (budget != nullptr) tracker_.SetMemoryBudget(budget);
+  }
+
+  // Add the n-grams of each order, in the given order. Each n-gram creates
+  // the state of its history, or, for the highest order, of its tails.
+  void AddNGrams(const std::vector<std::vector<History>> &ngrams) {
+    std::vector<std::size_t> level_sizes;
+    for (std::size_t k = 0; k + 1 < ngrams.size(); ++k) {
+      level_sizes.push_back(ngrams[k].size());
+    }
+    tracker_.Reserve(level_sizes);
+    Insert(History());
+    for (std::size_t k = 0; k != ngrams.size(); ++k) {
+      bool is_highest = k + 1 == ngrams.size();
+      tracker_.StartOrder(k + 1);
+      for (const History &ngram : ngrams[k]) {
+        assert(Find(History(ngram.begin(), ngram.end() - 1)) != nullptr);
+        History dest(ngram.begin() + (is_highest ? 1 : 0), ngram.end());
+        if (Find(dest) == nullptr) Insert(dest);
+      }
+    }
+  }
+
+  // Look up every history inserted, and the given ones.
+  void CheckAll(const std::vector<History> &histories) {
+    for (const auto &entry : map_) Find(entry.first);
+    for (const History &history : histories) Find(history);
+  }
+
+  const TrieHistoryTracker<HistKey> &Tracker() const { return tracker_; }
+
+ private:
+  const int32_t *Find(const History &history) {
+    const int32_t *state =
+        tracker_.Find(history.data(), history.data() + history.size());
+    auto it = map_.find(history);
+    if (it == map_.end()) {
+      assert(state == nullptr);
+    } else {
+      assert(state != nullptr && *state == it->second);
+    }
+    return state;
+  }
+
+  void Insert(const History &history) {
+    int32_t state = map_.size();
+    tracker_.Insert(history.data(), history.data() + history.size(), state);
+    map_[history] = state;
+  }
+
+  TrieHistoryTracker<HistKey> tracker_;
+  std::map<History, int32_t> map_;
+};
+
+// Return the n-grams up to the given order of random sentences over words
+// 1 to num_words, sorted, and some highest order n-grams whose tails are
+// not lower order n-grams.
+std::vector<std::vector<History>> RandomNGrams(int32_t order,
+                                               int32_t num_words) {
+  std::vector<std::set<History>> ngrams(order);
+  std::mt19937 gen(order);
+  std::uniform_int_distribution<int32_t> word(1, num_words);
+  for (int32_t n = 0; n != 300; ++n) {
+    History sentence;
+    for (int32_t i = 0; i != 12; ++i) sentence.push_back(word(gen));
+    for (std::size_t i = 0; i != sentence.size(); ++i) {
+      for (int32_t k = 1; k <= order && i + k <= sentence.size(); ++k) {
+        ngrams[k - 1].emplace(sentence.begin() + i, sentence.begin() + i + k);
+      }
+    }
+  }
+  if (order > 1) {
+    std::vector<History> heads(ngrams[order - 2].begin(),
+                               ngrams[order - 2].end());
+    for (std::size_t i = 0; i < heads.size(); i += 7) {
+      heads[i].push_back(num_words + 1 + i % 3);
+      ngrams[order - 1].insert(heads[i]);
+    }
+  }
+  std::vector<std::vector<History>> ans;
+  for (const std::set<History> &level : ngrams) {
+    ans.emplace_back(level.begin(), level.end());
+  }
+  return ans;
+}
+
+// Histories of all lengths that are not n-grams.
+std::vector<History> MissingHistories(
+    const std::vector<std::vector<History>> &ngrams) {
+  std::vector<History> ans;
+  for (const std::vector<History> &level : ngrams) {
+    for (std::size_t i = 0; i < level.size(); i += 5) {
+      History history = level[i];
+      history.back() += 1000;
+      ans.push_back(history);
+      history.insert(history.begin(), 1000);
+      ans.push_back(history);
+    }
+  }
+  return ans;
+}
+
+// With sorted n-grams, all histories stay in the trie but the tails of the
+// highest order n-grams, which go into the hash map. This is also the
+// case if the unigrams are not sorted, as long as the n-grams of each
+// higher order come in the order of their histories.
+template <class HistKey>
+void TestSortedNGrams(int32_t order, bool shuffle_unigrams, bool spill) {
+  KALDILM_LOG << "TestSortedNGrams(" << order << ", " << shuffle_unigrams
+              << ", " << spill << ")";
+  std::vector<std::vector<History>> ngrams = RandomNGrams(order, 30);
+  if (shuffle_unigrams) {
+    std::vector<History> &unigrams = ngrams[0];
+    std::shuffle(unigrams.begin(), unigrams.end(), std::mt19937(order));
+    std::map<int32_t, int32_t> rank;
+    for (std::size_t i = 0; i != unigrams.size(); ++i) {
+      rank[unigrams[i][0]] = i;
+    }
+    for (std::size_t k = 1; k < ngrams.size(); ++k) {
+      std::sort(ngrams[k].begin(), ngrams[k].end(),
+                [&rank](const History &a, const History &b) {
+                  if (a[0] != b[0]) return rank[a[0]] < rank[b[0]];
+                  return a < b;
+                });
+    }
+  }
+  std::unique_ptr<MemoryBudget> budget(spill ? new MemoryBudget(0, "")
+                                             : nullptr);
+  TrackerChecker<HistKey> checker(budget.get());
+  std::vector<std::vector<History>> lower(ngrams.begin(), ngrams.end() - 1);
+  checker.AddNGrams(lower);
+  double load_factor = checker.Tracker().HashLoadFactor();
+  assert(checker.Tracker().UsesTrie());
+
+  TrackerChecker<HistKey> full_checker(budget.get());
+  full_checker.AddNGrams(ngrams);
+  assert(full_checker.Tracker().UsesTrie());
+  full_checker.CheckAll(MissingHistories(ngrams));
+  if (order > 1) {
+    assert(full_checker.Tracker().HashLoadFactor() > load_factor);
+  }
+}
+
+// An n-gram out of order moves all histories to the hash map, and they
+// must all be found there. The highest order n-grams create no histories
+// in the trie, so their order does not matter.
+template <class HistKey>
+void TestUnsortedNGrams(int32_t order, int32_t unsorted_order) {
+  KALDILM_LOG << "TestUnsortedNGrams(" << order << ", " << unsorted_order
+              << ")";
+  std::vector<std::vector<History>> ngrams = RandomNGrams(order, 30);
+  std::vector<History> &level = ngrams[unsorted_order - 1];
+  std::swap(level[level.size() / 2], level[level.size() / 2 + 1]);
+  TrackerChecker<HistKey> checker(nullptr);
+  checker.AddNGrams(ngrams);
+  assert(checker.Tracker().UsesTrie() == (unsorted_order == order));
+  checker.CheckAll(MissingHistories(ngrams));
+}
+
+template <class HistKey>
+void TestTrieHistoryTracker() {
+  for (int32_t order : {1, 2, 3, 5}) {
+    TestSortedNGrams<HistKey>(order, false, false);
+    TestSortedNGrams<HistKey>(order, true, false);
+    TestSortedNGrams<HistKey>(order, false, true);
+  }
+  TestUnsortedNGrams<HistKey>(3, 2);
+  TestUnsortedNGrams<HistKey>(3, 3);
+  TestUnsortedNGrams<HistKey>(5, 2);
+  TestUnsortedNGrams<HistKey>(5, 4);
+}
+
+}  // namespace kaldilm
+
+int main(int argc, char *argv[]) {
+  kaldilm::TestTrieHistoryTracker<kaldilm::PackedHistKey<2, 16>>();
+  kaldilm::TestTrieHistoryTracker<kaldilm::GeneralHistKey>();
+}
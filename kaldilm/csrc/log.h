@@ -5,12 +5,22 @@
 #ifndef KALDILM_CSRC_LOG_H_
 #define KALDILM_CSRC_LOG_H_
 
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
 namespace kaldilm {
 
 enum class LogLevel {
   kInfo = 0,
   kWarn = 1,
-  kError = 2,  // abort the program
+  // Throw std::runtime_error with the message, or abort the program if an
+  // exception is already being thrown.
+  kError = 2,
 };
 
 class Logger {
@@ -33,6 +43,7 @@ class Logger {
         os_ << "[E] ";
         break;
     }
+    message_begin_ = os_.str().size();
   }
 
   template <typename T>
@@ -41,9 +52,16 @@ class Logger {
     return *this;
   }
 
-  ~Logger() {
+  ~Logger() noexcept(false) {
     std::cerr << os_.str() << "\n";
-    if (level_ == LogLevel::kError) abort();
+    if (level_ == LogLevel::kError) {
+#if __cplusplus >= 201703L
+      if (std::uncaught_exceptions() > 0) abort();
+#else
+      if (std::uncaught_exception()) abort();
+#endif
+      throw std::runtime_error(os_.str().substr(message_begin_));
+    }
   }
 
  private:
@@ -52,6 +70,7 @@ class Logger {
   const char *func_name_;
   uint32_t line_num_;
   LogLevel level_;
+  std::size_t message_begin_;  // Where the text after the header starts.
 };
 
 class Voidifier {
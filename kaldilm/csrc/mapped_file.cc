@@ -0,0 +1,107 @@
+// kaldilm/csrc/mapped_file.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/mapped_file.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace kaldilm {
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::string &filename) {
+  Close();
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) return false;
+  file_ = file;
+
+  LARGE_INTEGER size;
+  if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size) ||
+      size.QuadPart == 0) {
+    Close();
+    return false;
+  }
+  size_ = static_cast<std::size_t>(size.QuadPart);
+
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    Close();
+    return false;
+  }
+  mapping_ = mapping;
+
+  data_ = static_cast<const char *>(
+      MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if (data_ == nullptr) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_ != nullptr) UnmapViewOfFile(data_);
+  if (mapping_ != nullptr) CloseHandle(mapping_);
+  if (file_ != nullptr) CloseHandle(file_);
+  data_ = nullptr;
+  mapping_ = nullptr;
+  file_ = nullptr;
+  size_ = 0;
+}
+
+#else
+
+bool MappedFile::Open(const std::string &filename) {
+  Close();
+  // Pipes and devices report a size of 0, whatever they hold. They are
+  // checked before being opened, since opening a FIFO blocks until it has a
+  // writer, and closing it again may leave that writer without a reader.
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) return false;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  size_ = static_cast<std::size_t>(st.st_size);
+
+  void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping holds its own reference to the file.
+  close(fd);
+  if (p == MAP_FAILED) {
+    size_ = 0;
+    return false;
+  }
+  // ARPA files are read front to back exactly once.
+  madvise(p, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<const char *>(p);
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_ != nullptr) munmap(const_cast<char *>(data_), size_);
+  data_ = nullptr;
+  size_ = 0;
+}
+
+#endif
+
+}  // namespace kaldilm
@@ -0,0 +1,49 @@
+// kaldilm/csrc/mapped_file.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_MAPPED_FILE_H_
+#define KALDILM_CSRC_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <string>
+
+namespace kaldilm {
+
+/**
+   A read-only memory mapping of a whole file.
+
+   The mapping is released in the destructor. Only non-empty regular files
+   can be mapped; pipes, e.g., /dev/stdin, character devices and empty
+   files cannot, and have to be read as streams instead.
+*/
+class MappedFile {
+ public:
+  MappedFile() = default;
+  ~MappedFile() { Close(); }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  /// Map the given file. Return false if the file cannot be opened, is not a
+  /// non-empty regular file, or cannot be mapped.
+  bool Open(const std::string &filename);
+
+  /// Release the mapping. It is safe to call it more than once.
+  void Close();
+
+  const char *Data() const { return data_; }
+  std::size_t Size() const { return size_; }
+
+ private:
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+#ifdef _WIN32
+  void *file_ = nullptr;
+  void *mapping_ = nullptr;
+#endif
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_MAPPED_FILE_H_
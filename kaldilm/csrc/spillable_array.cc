@@ -0,0 +1,176 @@
+// kaldilm/csrc/spillable_array.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/spillable_array.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "kaldilm/csrc/log.h"
+
+namespace kaldilm {
+
+MemoryBudget::MemoryBudget(std::size_t max_bytes, const std::string &tmp_dir)
+    : max_bytes_(max_bytes), tmp_dir_(tmp_dir) {
+  if (tmp_dir_.empty()) {
+    const char *env = std::getenv("TMPDIR");
+    tmp_dir_ = env != nullptr && *env != '\0' ? env : "/tmp";
+  }
+#ifdef _WIN32
+  KALDILM_WARN << "Spilling to disk is not supported on Windows. Ignoring the "
+               << "memory budget.";
+  max_bytes_ = std::numeric_limits<std::size_t>::max();
+#endif
+}
+
+bool MemoryBudget::Charge(std::size_t n) {
+  if (n > max_bytes_ - used_bytes_) return false;
+  used_bytes_ += n;
+  return true;
+}
+
+int MemoryBudget::CreateSpillFile() {
+#ifdef _WIN32
+  KALDILM_ERR << "Spilling to disk is not supported on Windows";
+  return -1;
+#else
+  if (!has_spilled_) {
+    KALDILM_LOG << "Memory budget of " << (max_bytes_ >> 20) << " MB reached. "
+                << "Spilling arrays to " << tmp_dir_;
+    has_spilled_ = true;
+  }
+  std::string name = tmp_dir_ + "/kaldilm-XXXXXX";
+  std::vector<char> buf(name.begin(), name.end());
+  buf.push_back('\0');
+  int fd = mkstemp(buf.data());
+  if (fd == -1) {
+    KALDILM_ERR << "Failed to create a temporary file in " << tmp_dir_ << ": "
+                << std::strerror(errno);
+  }
+  unlink(buf.data());
+  return fd;
+#endif
+}
+
+SpillableBuffer::SpillableBuffer(SpillableBuffer &&other) noexcept
+    : budget_(other.budget_),
+      data_(other.data_),
+      size_(other.size_),
+      fd_(other.fd_) {
+  other.data_ = nullptr;
+  other.size_ = 0;
+  other.fd_ = -1;
+}
+
+SpillableBuffer &SpillableBuffer::operator=(SpillableBuffer &&other) noexcept {
+  if (this != &other) {
+    Free();
+    Swap(&other);
+  }
+  return *this;
+}
+
+void SpillableBuffer::Swap(SpillableBuffer *other) {
+  std::swap(budget_, other->budget_);
+  std::swap(data_, other->data_);
+  std::swap(size_, other->size_);
+  std::swap(fd_, other->fd_);
+}
+
+void SpillableBuffer::Resize(std::size_t n, std::size_t used) {
+  if (n == size_) return;
+  if (n == 0) {
+    Free();
+    return;
+  }
+  if (IsSpilled()) {
+    ResizeSpilled(n);
+    return;
+  }
+  if (budget_ != nullptr && n > size_ && !budget_->Charge(n - size_)) {
+    Spill(n, used);
+    return;
+  }
+  // Only the used part is copied if the block moves.
+  void *p = std::realloc(data_, n);
+  if (p == nullptr) {
+    if (budget_ != nullptr && n > size_) budget_->Refund(n - size_);
+    throw std::bad_alloc();
+  }
+  if (budget_ != nullptr && n < size_) budget_->Refund(size_ - n);
+  data_ = static_cast<char *>(p);
+  size_ = n;
+}
+
+void SpillableBuffer::Free() {
+  if (IsSpilled()) {
+#ifndef _WIN32
+    munmap(data_, size_);
+    close(fd_);
+#endif
+    fd_ = -1;
+  } else {
+    std::free(data_);
+    if (budget_ != nullptr) budget_->Refund(size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+}
+
+void SpillableBuffer::Spill(std::size_t n, std::size_t used) {
+  int fd = budget_->CreateSpillFile();
+  // The heap block stays with the buffer until the file is mapped, so that
+  // it is still there, and still accounted for, if that fails.
+  char *old_data = data_;
+  std::size_t old_size = size_;
+  data_ = nullptr;
+  size_ = 0;
+  fd_ = fd;
+  try {
+    ResizeSpilled(n);
+  } catch (...) {
+#ifndef _WIN32
+    close(fd_);
+#endif
+    fd_ = -1;
+    data_ = old_data;
+    size_ = old_size;
+    throw;
+  }
+  if (used != 0) std::memcpy(data_, old_data, used);
+  std::free(old_data);
+  budget_->Refund(old_size);
+}
+
+void SpillableBuffer::ResizeSpilled(std::size_t n) {
+#ifndef _WIN32
+  // The content is in the file, so it survives unmapping. The old mapping
+  // is kept until the new one exists, so the buffer is unchanged if growing
+  // fails.
+  if (ftruncate(fd_, n) != 0) {
+    KALDILM_ERR << "Failed to resize a temporary file to " << n
+                << " bytes: " << std::strerror(errno);
+  }
+  void *p = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (p == MAP_FAILED) {
+    KALDILM_ERR << "Failed to map a temporary file of " << n
+                << " bytes: " << std::strerror(errno);
+  }
+  if (data_ != nullptr) munmap(data_, size_);
+  data_ = static_cast<char *>(p);
+  size_ = n;
+#endif
+}
+
+}  // namespace kaldilm
@@ -0,0 +1,184 @@
+// kaldilm/csrc/spillable_array.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_SPILLABLE_ARRAY_H_
+#define KALDILM_CSRC_SPILLABLE_ARRAY_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace kaldilm {
+
+/**
+   A limit on the memory held by the SpillableArray objects sharing it.
+   An array that would take the total past the limit is moved into a
+   temporary file, which is mapped into memory. The data of spilled arrays
+   is then in the page cache, which the kernel writes back to disk and
+   evicts as needed, instead of in anonymous memory that has to stay
+   resident.
+
+   The temporary files should be on a local disk: files on a tmpfs are kept
+   in memory anyway. On Windows, arrays are never spilled.
+
+   It is not thread-safe.
+ */
+class MemoryBudget {
+ public:
+  /// Arrays may hold up to max_bytes of memory. Spill files are created in
+  /// tmp_dir, or, if it is empty, in $TMPDIR or /tmp.
+  MemoryBudget(std::size_t max_bytes, const std::string &tmp_dir);
+
+  MemoryBudget(const MemoryBudget &) = delete;
+  MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+  /// Account for n more bytes of memory. Return false, accounting nothing,
+  /// if that would exceed the budget.
+  bool Charge(std::size_t n);
+  void Refund(std::size_t n) { used_bytes_ -= n; }
+
+  /// Create an empty temporary file and return its file descriptor. The file
+  /// is already unlinked, so it goes away once closed.
+  int CreateSpillFile();
+
+  std::size_t MaxBytes() const { return max_bytes_; }
+  std::size_t UsedBytes() const { return used_bytes_; }
+
+ private:
+  std::size_t max_bytes_;
+  std::size_t used_bytes_ = 0;
+  std::string tmp_dir_;
+  bool has_spilled_ = false;
+};
+
+/**
+   Untyped storage of a SpillableArray: a block of memory allocated either
+   on the heap and accounted to a MemoryBudget, or in a mapped temporary
+   file. Without a budget, it is always on the heap.
+ */
+class SpillableBuffer {
+ public:
+  explicit SpillableBuffer(MemoryBudget *budget) : budget_(budget) {}
+  ~SpillableBuffer() { Free(); }
+
+  SpillableBuffer(SpillableBuffer &&other) noexcept;
+  SpillableBuffer &operator=(SpillableBuffer &&other) noexcept;
+
+  /// Change the size of the buffer to n bytes, keeping the first `used`
+  /// bytes of its content.
+  void Resize(std::size_t n, std::size_t used);
+  void Free();
+  void Swap(SpillableBuffer *other);
+
+  char *Data() const { return data_; }
+  std::size_t Size() const { return size_; }
+  bool IsSpilled() const { return fd_ != -1; }
+
+ private:
+  // Move the buffer into a new spill file of n bytes.
+  void Spill(std::size_t n, std::size_t used);
+  // Change the size of the spill file and map it again.
+  void ResizeSpilled(std::size_t n);
+
+  MemoryBudget *budget_;  // Not owned.
+  char *data_ = nullptr;
+  std::size_t size_ = 0;
+  int fd_ = -1;  // The spill file, if any.
+};
+
+/**
+   A growable array that moves into a temporary file once its MemoryBudget
+   is exhausted; see MemoryBudget. It has the subset of the std::vector
+   interface that the compiler uses for its large arrays.
+
+   Elements are moved around with memcpy() and never destroyed, so T must
+   be trivially destructible and copyable byte by byte, like integers and
+   arcs. Pointers into the array are invalidated when it grows.
+ */
+template <class T>
+class SpillableArray {
+  static_assert(std::is_trivially_destructible<T>::value,
+                "SpillableArray cannot hold objects that need destruction");
+
+ public:
+  typedef T value_type;
+  typedef T *iterator;
+  typedef const T *const_iterator;
+
+  /// If budget is nullptr, the array is always kept in memory.
+  explicit SpillableArray(MemoryBudget *budget = nullptr) : buffer_(budget) {}
+
+  SpillableArray(SpillableArray &&other) noexcept
+      : buffer_(std::move(other.buffer_)), size_(other.size_) {
+    other.size_ = 0;
+  }
+  SpillableArray &operator=(SpillableArray &&other) noexcept {
+    buffer_ = std::move(other.buffer_);
+    size_ = other.size_;
+    other.size_ = 0;
+    return *this;
+  }
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::size_t capacity() const { return buffer_.Size() / sizeof(T); }
+  bool IsSpilled() const { return buffer_.IsSpilled(); }
+
+  T *data() { return reinterpret_cast<T *>(buffer_.Data()); }
+  const T *data() const { return reinterpret_cast<const T *>(buffer_.Data()); }
+  iterator begin() { return data(); }
+  iterator end() { return data() + size_; }
+  const_iterator begin() const { return data(); }
+  const_iterator end() const { return data() + size_; }
+  T &operator[](std::size_t i) { return data()[i]; }
+  const T &operator[](std::size_t i) const { return data()[i]; }
+  T &back() { return data()[size_ - 1]; }
+  const T &back() const { return data()[size_ - 1]; }
+
+  void reserve(std::size_t n) {
+    if (n > capacity()) buffer_.Resize(n * sizeof(T), size_ * sizeof(T));
+  }
+
+  void resize(std::size_t n, const T &value = T()) {
+    reserve(n);
+    for (std::size_t i = size_; i < n; ++i) new (data() + i) T(value);
+    size_ = n;
+  }
+
+  void push_back(const T &value) {
+    if (size_ == capacity()) {
+      T copy(value);  // value may be in this array.
+      Grow();
+      new (data() + size_++) T(copy);
+    } else {
+      new (data() + size_++) T(value);
+    }
+  }
+
+  template <class... Args>
+  void emplace_back(Args &&... args) {
+    if (size_ == capacity()) Grow();
+    new (data() + size_++) T(std::forward<Args>(args)...);
+  }
+
+  void clear() { size_ = 0; }
+
+  void swap(SpillableArray &other) {
+    buffer_.Swap(&other.buffer_);
+    std::swap(size_, other.size_);
+  }
+
+ private:
+  void Grow() { reserve(std::max<std::size_t>(2 * capacity(), 16)); }
+
+  SpillableBuffer buffer_;
+  std::size_t size_ = 0;
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_SPILLABLE_ARRAY_H_
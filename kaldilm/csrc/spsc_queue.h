@@ -0,0 +1,145 @@
+// kaldilm/csrc/spsc_queue.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_SPSC_QUEUE_H_
+#define KALDILM_CSRC_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kaldilm {
+
+/**
+   A bounded queue handing items from one producer thread to one consumer
+   thread without locks. Items live in a ring of slots allocated up front:
+   the producer fills the slot returned by BeginPush() and publishes it with
+   EndPush(), and the consumer reads the slot returned by BeginPop() and
+   gives it back with EndPop(). Slots are reused, so items keep their
+   buffers from one round to the next.
+
+   A side that finds the queue full or empty yields for a while, and then
+   blocks on a condition variable, which the other side notifies only if
+   somebody is blocked. The time each side spends waiting tells which one
+   is the bottleneck.
+ */
+template <class T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(std::size_t capacity) : slots_(capacity) {}
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  /// Producer: wait for a free slot and return it.
+  T *BeginPush() {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    Wait([this, head] { return head - tail_.load() < slots_.size(); },
+         &producer_wait_);
+    return &slots_[head % slots_.size()];
+  }
+
+  /// Producer: publish the slot returned by BeginPush().
+  void EndPush() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1);
+    Notify();
+  }
+
+  /// Producer: wait until the consumer has given back every slot.
+  void WaitUntilEmpty() {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    Wait([this, head] { return tail_.load() == head; }, &producer_wait_);
+  }
+
+  /// Producer: signal that nothing more is pushed.
+  void Close() {
+    closed_.store(true);
+    Notify();
+  }
+
+  /// Consumer: wait for a published slot and return it, or return nullptr
+  /// once the queue is closed and empty.
+  T *BeginPop() {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    Wait([this, tail] { return head_.load() != tail || closed_.load(); },
+         &consumer_wait_);
+    // Everything is pushed before the queue is closed.
+    if (head_.load() == tail) return nullptr;
+    return &slots_[tail % slots_.size()];
+  }
+
+  /// Consumer: give back the slot returned by BeginPop().
+  void EndPop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1);
+    Notify();
+  }
+
+  /// Time spent, and number of times, waiting by either side. Read them
+  /// only once both sides are done.
+  double ProducerWaitSeconds() const { return producer_wait_.seconds; }
+  int64_t ProducerStalls() const { return producer_wait_.stalls; }
+  double ConsumerWaitSeconds() const { return consumer_wait_.seconds; }
+  int64_t ConsumerStalls() const { return consumer_wait_.stalls; }
+
+ private:
+  struct WaitStats {
+    double seconds = 0;
+    int64_t stalls = 0;
+  };
+
+  // Number of yields before a waiting side blocks.
+  enum { kYields = 16 };
+
+  // The indexes and blocked_ are sequentially consistent, so that either a
+  // side about to block sees the update of the other side, or the other
+  // side sees that it is blocked and notifies it.
+  template <class Ready>
+  void Wait(Ready ready, WaitStats *stats) {
+    if (ready()) return;
+    ++stats->stalls;
+    auto start = std::chrono::steady_clock::now();
+    for (int32_t i = 0; i < kYields && !ready(); ++i) {
+      std::this_thread::yield();
+    }
+    if (!ready()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ++blocked_;
+      cv_.wait(lock, ready);
+      --blocked_;
+    }
+    stats->seconds += std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  }
+
+  void Notify() {
+    if (blocked_.load() != 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
+    }
+  }
+
+  std::vector<T> slots_;
+  // Each index is written by one side only. The padding keeps them out of
+  // each other's cache line.
+  std::atomic<std::size_t> head_{0};  // Number of slots pushed.
+  char padding1_[64];
+  std::atomic<std::size_t> tail_{0};  // Number of slots popped.
+  char padding2_[64];
+  std::atomic<bool> closed_{false};
+  std::atomic<int32_t> blocked_{0};  // Number of sides waiting on cv_.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  WaitStats producer_wait_;
+  WaitStats consumer_wait_;
+};
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_SPSC_QUEUE_H_
@@ -6,6 +6,8 @@
 
 #include <string.h>
 
+#include <cstdint>
+#include <limits>
 #include <sstream>
 #include <string>
 
@@ -41,6 +43,22 @@ void SplitString(const std::string &s, const char *delim,
   }
 }
 
+void SplitStringToPieces(const StringPiece &s, const char *delim,
+                         bool omit_empty_strings,
+                         std::vector<StringPiece> *vec) {
+  vec->clear();
+
+  const char *p = s.begin();
+  const char *end = s.end();
+  const char *token = p;
+  for (; p != end; ++p) {
+    if (strchr(delim, *p) == nullptr || *p == '\0') continue;
+    if (!omit_empty_strings || token != p) vec->emplace_back(token, p);
+    token = p + 1;
+  }
+  if (!omit_empty_strings || token != end) vec->emplace_back(token, end);
+}
+
 bool ConvertStringToInteger(const std::string &s, int32_t *out) {
   std::stringstream ss;
   ss << s;
@@ -55,4 +73,123 @@ bool ConvertStringToReal(const std::string &s, float *out) {
   return (bool)ss;
 }
 
+namespace {
+
+// Exactly representable powers of ten as double.
+const double kPowersOfTen[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                               1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                               1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// Parse s as [+-]digits[.digits][(e|E)[+-]digits] into a decimal mantissa
+// and exponent. Return false if s has any other form, or has too many
+// significant digits to fit in 19 decimal digits.
+bool ParseDecimal(const StringPiece &s, bool *negative, uint64_t *mantissa,
+                  int32_t *exponent) {
+  const char *p = s.begin();
+  const char *end = s.end();
+  *negative = false;
+  if (p != end && (*p == '-' || *p == '+')) {
+    *negative = *p == '-';
+    ++p;
+  }
+
+  uint64_t m = 0;
+  int32_t num_digits = 0;  // Significant digits in m.
+  int32_t exp = 0;
+  bool has_digits = false;
+  for (; p != end && IsDigit(*p); ++p) {
+    has_digits = true;
+    if (m == 0 && *p == '0') continue;  // Leading zeros are not significant.
+    if (++num_digits > 19) return false;
+    m = m * 10 + (*p - '0');
+  }
+  if (p != end && *p == '.') {
+    for (++p; p != end && IsDigit(*p); ++p) {
+      has_digits = true;
+      --exp;
+      if (m == 0 && *p == '0') continue;
+      if (++num_digits > 19) return false;
+      m = m * 10 + (*p - '0');
+    }
+  }
+  if (!has_digits) return false;
+
+  if (p != end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    bool exp_negative = false;
+    if (p != end && (*p == '-' || *p == '+')) {
+      exp_negative = *p == '-';
+      ++p;
+    }
+    if (p == end) return false;
+    int32_t e = 0;
+    for (; p != end && IsDigit(*p); ++p) {
+      if (e < 10000) e = e * 10 + (*p - '0');
+    }
+    exp += exp_negative ? -e : e;
+  }
+
+  *mantissa = m;
+  *exponent = exp;
+  return p == end;
+}
+
+}  // namespace
+
+bool ConvertStringToInteger(const StringPiece &s, int32_t *out) {
+  const char *p = s.begin();
+  const char *end = s.end();
+  bool negative = false;
+  if (p != end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    ++p;
+  }
+  if (p == end || end - p > 10) {
+    return ConvertStringToInteger(s.ToString(), out);
+  }
+
+  int64_t value = 0;
+  for (; p != end; ++p) {
+    if (!IsDigit(*p)) return ConvertStringToInteger(s.ToString(), out);
+    value = value * 10 + (*p - '0');
+  }
+  if (negative) value = -value;
+  if (value < std::numeric_limits<int32_t>::min() ||
+      value > std::numeric_limits<int32_t>::max()) {
+    return ConvertStringToInteger(s.ToString(), out);
+  }
+  *out = static_cast<int32_t>(value);
+  return true;
+}
+
+bool ConvertStringToReal(const StringPiece &s, float *out) {
+  bool negative;
+  uint64_t mantissa;
+  int32_t exponent;
+  // Clinger's fast path: the mantissa and the power of ten are both exact
+  // doubles, so a single multiplication or division is correctly rounded.
+  if (!ParseDecimal(s, &negative, &mantissa, &exponent) ||
+      mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22) {
+    return ConvertStringToReal(s.ToString(), out);
+  }
+
+  double d = static_cast<double>(mantissa);
+  d = exponent < 0 ? d / kPowersOfTen[-exponent] : d * kPowersOfTen[exponent];
+
+  // Rounding the correctly rounded double to float gives the correctly
+  // rounded float, unless the double sits exactly halfway between two
+  // floats. Leave that rare case, and overflow, to the slow path.
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  if ((bits & 0x1fffffff) == 0x10000000 ||
+      d > std::numeric_limits<float>::max()) {
+    return ConvertStringToReal(s.ToString(), out);
+  }
+
+  *out = static_cast<float>(negative ? -d : d);
+  return true;
+}
+
 }  // namespace kaldilm
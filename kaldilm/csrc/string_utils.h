@@ -5,20 +5,79 @@
 #ifndef KALDILM_CSRC_STRING_UTILS_H_
 #define KALDILM_CSRC_STRING_UTILS_H_
 
+#include <string.h>
+
+#include <cstddef>
+#include <ostream>
 #include <string>
 #include <vector>
 
 namespace kaldilm {
 
+/// A non-owning view of a range of characters, e.g., a token inside a
+/// memory-mapped file. The viewed characters must outlive the view.
+struct StringPiece {
+  const char *data = nullptr;
+  std::size_t size = 0;
+
+  StringPiece() = default;
+  StringPiece(const char *data, std::size_t size) : data(data), size(size) {}
+  StringPiece(const char *begin, const char *end)
+      : data(begin), size(end - begin) {}
+
+  const char *begin() const { return data; }
+  const char *end() const { return data + size; }
+  bool empty() const { return size == 0; }
+  char operator[](std::size_t i) const { return data[i]; }
+
+  std::string ToString() const { return std::string(data, size); }
+};
+
+inline bool operator==(const StringPiece &a, const StringPiece &b) {
+  return a.size == b.size &&
+         (a.size == 0 || memcmp(a.data, b.data, a.size) == 0);
+}
+
+inline bool operator==(const StringPiece &a, const std::string &b) {
+  return a == StringPiece(b.data(), b.size());
+}
+
+inline bool operator==(const StringPiece &a, const char *b) {
+  return a == StringPiece(b, strlen(b));
+}
+
+template <class T>
+inline bool operator!=(const StringPiece &a, const T &b) {
+  return !(a == b);
+}
+
+inline std::ostream &operator<<(std::ostream &os, const StringPiece &s) {
+  return os.write(s.data, s.size);
+}
+
 void SplitString(char *s, const char *delim, bool omit_empty_strings,
                  std::vector<char *> *vec);
 
 void SplitString(const std::string &s, const char *delim,
                  bool omit_empty_strings, std::vector<std::string> *vec);
 
+/// Like SplitString(), but returns views into [s.begin(), s.end()) instead of
+/// copies. `vec` is cleared first; its capacity is reused across calls.
+void SplitStringToPieces(const StringPiece &s, const char *delim,
+                         bool omit_empty_strings,
+                         std::vector<StringPiece> *vec);
+
 bool ConvertStringToInteger(const std::string &s, int32_t *out);
 bool ConvertStringToReal(const std::string &s, float *out);
 
+/// Same as the std::string versions above, i.e., they accept and reject the
+/// same inputs and produce bit-identical values, but they do not allocate.
+/// Plain decimal numbers, such as ARPA log-probs, backoffs and n-gram counts,
+/// are converted directly from the characters; anything else falls back to
+/// the std::string versions.
+bool ConvertStringToInteger(const StringPiece &s, int32_t *out);
+bool ConvertStringToReal(const StringPiece &s, float *out);
+
 }  // namespace kaldilm
 
 #endif  // KALDILM_CSRC_STRING_UTILS_H_
@@ -0,0 +1,85 @@
+// kaldilm/csrc/string_utils_benchmark.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+// Compare the std::string and StringPiece versions of ConvertStringToReal()
+// on fields that look like ARPA log-probs and backoffs.
+//
+// Usage:
+//   string_utils_benchmark [num-fields]
+//
+// num-fields defaults to 10 million; use a few hundred million to get
+// numbers comparable to converting a large LM.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "kaldilm/csrc/log.h"
+#include "kaldilm/csrc/string_utils.h"
+
+namespace kaldilm {
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+static void Run(int64_t num_fields) {
+  // A fixed set of distinct fields, cycled through num_fields times.
+  const int32_t kNumDistinct = 1 << 16;
+  std::vector<std::string> fields(kNumDistinct);
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<float> dist(-8, 0);
+  char buf[32];
+  for (std::string &f : fields) {
+    snprintf(buf, sizeof(buf), "%.7g", dist(gen));
+    f = buf;
+  }
+
+  float sum = 0, x = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int64_t i = 0; i != num_fields; ++i) {
+    const std::string &f = fields[i & (kNumDistinct - 1)];
+    if (!ConvertStringToReal(f, &x)) KALDILM_ERR << "Bad field " << f;
+    sum += x;
+  }
+  double stream_seconds = Seconds(start);
+
+  float piece_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int64_t i = 0; i != num_fields; ++i) {
+    const std::string &f = fields[i & (kNumDistinct - 1)];
+    if (!ConvertStringToReal(StringPiece(f.data(), f.size()), &x)) {
+      KALDILM_ERR << "Bad field " << f;
+    }
+    piece_sum += x;
+  }
+  double piece_seconds = Seconds(start);
+
+  if (sum != piece_sum) {
+    KALDILM_ERR << "Results differ: " << sum << " vs. " << piece_sum;
+  }
+
+  KALDILM_LOG << "Converted " << num_fields << " fields";
+  KALDILM_LOG << "std::string: " << stream_seconds << " s ("
+              << num_fields / stream_seconds / 1e6 << " M fields/s)";
+  KALDILM_LOG << "StringPiece: " << piece_seconds << " s ("
+              << num_fields / piece_seconds / 1e6 << " M fields/s)";
+  KALDILM_LOG << "Speedup: " << stream_seconds / piece_seconds << "x";
+}
+
+}  // namespace kaldilm
+
+int main(int argc, char *argv[]) {
+  int64_t num_fields = 10000000;
+  if (argc > 1) num_fields = atoll(argv[1]);
+  kaldilm::Run(num_fields);
+}
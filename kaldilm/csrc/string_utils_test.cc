@@ -0,0 +1,116 @@
+// kaldilm/csrc/string_utils_test.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/string_utils.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#include <cassert>
+#define NDEBUG
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "kaldilm/csrc/log.h"
+
+namespace kaldilm {
+
+// The StringPiece overloads must accept exactly the inputs the std::string
+// versions accept, and produce bit-identical values.
+static void ExpectSameReal(const std::string &s) {
+  float expected = 0, actual = 0;
+  bool expected_ok = ConvertStringToReal(s, &expected);
+  bool actual_ok =
+      ConvertStringToReal(StringPiece(s.data(), s.size()), &actual);
+  if (expected_ok != actual_ok ||
+      (expected_ok && memcmp(&expected, &actual, sizeof(float)) != 0)) {
+    KALDILM_ERR << "Mismatch for '" << s << "': " << expected_ok << " "
+                << expected << " vs. " << actual_ok << " " << actual;
+  }
+}
+
+static void ExpectSameInteger(const std::string &s) {
+  int32_t expected = 0, actual = 0;
+  bool expected_ok = ConvertStringToInteger(s, &expected);
+  bool actual_ok =
+      ConvertStringToInteger(StringPiece(s.data(), s.size()), &actual);
+  if (expected_ok != actual_ok || (expected_ok && expected != actual)) {
+    KALDILM_ERR << "Mismatch for '" << s << "': " << expected_ok << " "
+                << expected << " vs. " << actual_ok << " " << actual;
+  }
+}
+
+static void TestConvertStringToRealEdgeCases() {
+  const char *cases[] = {
+      "0", "-0", "+0", "0.0", "-0.0", "1", "-1", "+1.5", ".5", "-.5", "5.",
+      ".", "-", "+", "", "e5", "1e", "1e+", "1e-", "1e5", "1E-5", "-2.5e+3",
+      "1.5x", "1.2.3", "-0.3\r", "abc", "nan", "inf", "-inf", "0x10",
+      "1e38", "3.4028235e38", "3.4028236e38", "1e39", "-1e39", "1e-38",
+      "1e-45", "1e-46", "1e-22", "1e-23", "1e22", "1e23", "-99",
+      "-2.345678", "-0.30103",
+      "-1.2345678901234567890", "12345678901234567890",
+      "9007199254740992",       "9007199254740993",
+      "0.000000000000000000000000000001",
+      "00000000000000000000000000001.5",
+      // Halfway between two floats: 1 + 2^-24, and its neighbours.
+      "1.000000059604644775390625", "1.0000000596046448",
+      "1.0000000596046447",
+  };
+  for (const char *c : cases) {
+    ExpectSameReal(c);
+  }
+}
+
+static void TestConvertStringToRealRandom() {
+  std::mt19937 gen(20201017);
+  std::uniform_real_distribution<float> logprob(-10, 0);
+  std::uniform_real_distribution<double> any(-1e6, 1e6);
+  std::uniform_int_distribution<int32_t> precision(1, 17);
+  char buf[64];
+  for (int32_t i = 0; i != 200000; ++i) {
+    snprintf(buf, sizeof(buf), "%.*g", precision(gen), logprob(gen));
+    ExpectSameReal(buf);
+    snprintf(buf, sizeof(buf), "%.*f", precision(gen), logprob(gen));
+    ExpectSameReal(buf);
+    snprintf(buf, sizeof(buf), "%.*g", precision(gen), any(gen));
+    ExpectSameReal(buf);
+    snprintf(buf, sizeof(buf), "%.*e", precision(gen), any(gen));
+    ExpectSameReal(buf);
+  }
+}
+
+static void TestConvertStringToInteger() {
+  const char *cases[] = {
+      "0",           "-0",          "+0",          "1",
+      "-1",          "+17",         "007",         "",
+      "-",           "+",           "1.5",         "12abc",
+      "abc",         "2147483647",  "2147483648",  "-2147483648",
+      "-2147483649", "99999999999", "00000000000000000001",
+  };
+  for (const char *c : cases) {
+    ExpectSameInteger(c);
+  }
+
+  std::mt19937 gen(20201017);
+  std::uniform_int_distribution<int64_t> value(-(int64_t(1) << 33),
+                                               int64_t(1) << 33);
+  for (int32_t i = 0; i != 100000; ++i) {
+    ExpectSameInteger(std::to_string(value(gen)));
+  }
+}
+
+}  // namespace kaldilm
+
+int main(int argc, char *argv[]) {
+  kaldilm::TestConvertStringToRealEdgeCases();
+  kaldilm::TestConvertStringToRealRandom();
+  kaldilm::TestConvertStringToInteger();
+}
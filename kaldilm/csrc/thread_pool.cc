@@ -0,0 +1,91 @@
+// kaldilm/csrc/thread_pool.cc
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#include "kaldilm/csrc/thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace kaldilm {
+
+ThreadPool::ThreadPool(int32_t num_threads) {
+  if (num_threads <= 0) {
+    num_threads = std::max<int32_t>(1, std::thread::hardware_concurrency());
+  }
+  workers_.reserve(num_threads);
+  for (int32_t i = 0; i != num_threads; ++i) {
+    workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto &worker : workers_) worker.join();
+}
+
+std::future<void> ThreadPool::Enqueue(std::function<void()> task) {
+  std::packaged_task<void()> packaged(std::move(task));
+  std::future<void> future = packaged.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push(std::move(packaged));
+  }
+  cv_.notify_one();
+  return future;
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) return;  // stop_ is set and nothing is left.
+      task = std::move(tasks_.front());
+      tasks_.pop();
+    }
+    task();
+  }
+}
+
+void ParallelFor(ThreadPool *pool, int32_t n,
+                 const std::function<void(int32_t)> &task) {
+  if (pool == nullptr || n <= 1) {
+    for (int32_t i = 0; i != n; ++i) task(i);
+    return;
+  }
+  std::vector<std::future<void>> futures;
+  futures.reserve(n);
+  for (int32_t i = 0; i != n; ++i) {
+    futures.push_back(pool->Enqueue([&task, i] { task(i); }));
+  }
+  // The tasks refer to task, so all of them must be done before the first
+  // error, if any, is rethrown.
+  for (auto &f : futures) f.wait();
+  for (auto &f : futures) f.get();
+}
+
+int32_t NumRanges(const ThreadPool *pool, std::size_t n) {
+  if (pool == nullptr) return 1;
+  // More ranges than threads even out the load.
+  const int32_t kRangesPerThread = 4;
+  std::size_t num_ranges =
+      std::min<std::size_t>(n, kRangesPerThread * pool->NumThreads());
+  return static_cast<int32_t>(std::max<std::size_t>(1, num_ranges));
+}
+
+void ParallelForRanges(
+    ThreadPool *pool, std::size_t n,
+    const std::function<void(int32_t, std::size_t, std::size_t)> &task) {
+  int32_t num_ranges = NumRanges(pool, n);
+  ParallelFor(pool, num_ranges, [&task, n, num_ranges](int32_t i) {
+    task(i, n * i / num_ranges, n * (i + 1) / num_ranges);
+  });
+}
+
+}  // namespace kaldilm
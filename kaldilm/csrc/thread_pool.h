@@ -0,0 +1,68 @@
+// kaldilm/csrc/thread_pool.h
+//
+// Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+#ifndef KALDILM_CSRC_THREAD_POOL_H_
+#define KALDILM_CSRC_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace kaldilm {
+
+/**
+   A fixed-size pool of worker threads executing tasks in FIFO order.
+
+   The destructor finishes all queued tasks before joining the workers.
+*/
+class ThreadPool {
+ public:
+  /// num_threads <= 0 means to use std::thread::hardware_concurrency().
+  explicit ThreadPool(int32_t num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /// Queue a task. The returned future becomes ready when it has run.
+  std::future<void> Enqueue(std::function<void()> task);
+
+  int32_t NumThreads() const { return static_cast<int32_t>(workers_.size()); }
+
+ private:
+  void WorkerLoop();
+
+  std::vector<std::thread> workers_;
+  std::queue<std::packaged_task<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+};
+
+/// Run task(i) for i in [0, n) on the pool and wait for all of them. If
+/// pool is nullptr, the tasks are run on the calling thread. An exception
+/// thrown by a task is rethrown once all of them are done.
+void ParallelFor(ThreadPool *pool, int32_t n,
+                 const std::function<void(int32_t)> &task);
+
+/// Return the number of ranges ParallelForRanges() splits n items into:
+/// a few per thread of the pool, or 1 if pool is nullptr.
+int32_t NumRanges(const ThreadPool *pool, std::size_t n);
+
+/// Split [0, n) into NumRanges(pool, n) contiguous ranges of about the same
+/// size, and run task(i, begin, end) for the i-th range [begin, end) on the
+/// pool. Wait for all of them.
+void ParallelForRanges(
+    ThreadPool *pool, std::size_t n,
+    const std::function<void(int32_t, std::size_t, std::size_t)> &task);
+
+}  // namespace kaldilm
+
+#endif  // KALDILM_CSRC_THREAD_POOL_H_
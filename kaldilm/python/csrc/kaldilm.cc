@@ -4,143 +4,753 @@
 
 #include "kaldilm/python/csrc/kaldilm.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "fst/fstlib.h"
-#include "fst/script/print.h"
 #include "fst/symbol-table.h"
 #include "kaldilm/csrc/arpa_file_parser.h"
 #include "kaldilm/csrc/arpa_lm_compiler.h"
+#include "kaldilm/csrc/arpa_ngram_reader.h"
+#include "kaldilm/csrc/compile_stats.h"
+#include "kaldilm/csrc/fst_arrays.h"
+#include "kaldilm/csrc/fst_text_writer.h"
 #include "kaldilm/csrc/log.h"
+#include "kaldilm/csrc/thread_pool.h"
+#include "pybind11/numpy.h"
+#include "pybind11/stl.h"
 
 namespace kaldilm {
 
-template <class Arc>
+// Make a pool of num_threads threads, or of as many as there are cores if it
+// is not positive. Return nullptr for a single thread.
+static std::unique_ptr<ThreadPool> MakePool(int32_t num_threads) {
+  if (num_threads <= 0) num_threads = std::thread::hardware_concurrency();
+  std::unique_ptr<ThreadPool> pool;
+  if (num_threads > 1) pool.reset(new ThreadPool(num_threads));
+  return pool;
+}
+
 static void PrintFstInTextFormat(std::ostream &os,
-                                 const fst::VectorFst<Arc> &t) {
-  bool ok;
-  // Text-mode output.  Note: we expect that t.InputSymbols() and
-  // t.OutputSymbols() would always return NULL.  The corresponding input
-  // routine would not work if the FST actually had symbols attached.  Write a
-  // newline to start the FST; in a table, the first line of the FST will
-  // appear on its own line.
+                                 const fst::StdExpandedFst &t,
+                                 ThreadPool *pool) {
+  // Text-mode output, without symbols. Write a newline to start the FST; in
+  // a table, the first line of the FST will appear on its own line.
   os << '\n';
-  bool acceptor = false, write_one = false;
-  // fst::FstPrinter<Arc> printer(t, t.InputSymbols(), t.OutputSymbols(), NULL,
-  //                              acceptor, write_one, "\t");
-
-  fst::FstPrinter<Arc> printer(t, nullptr, nullptr, nullptr, acceptor,
-                               write_one, "\t");
-  printer.Print(&os, "<unknown>");
+  WriteFstText(t, pool, os);
   if (os.fail()) KALDILM_ERR << "Stream failure detected writing FST to stream";
   // Write another newline as a terminating character.  The read routine will
   // detect this [this is a Kaldi mechanism, not something in the original
   // OpenFst code].
   os << '\n';
-  ok = os.good();
+  if (!os.good()) KALDILM_ERR << "Error writing FST to stream";
+}
+
+// A compiled model, returned by arpa2fst(return_text=False). Its text
+// format is produced only on request, and can be streamed to a file.
+class CompiledFst {
+ public:
+  explicit CompiledFst(std::unique_ptr<fst::StdExpandedFst> fst)
+      : fst_(std::move(fst)) {}
+
+  // Return the text format, formatted on num_threads threads, or on as many
+  // as there are cores if it is not positive. See PrintFstInTextFormat().
+  std::string Text(int32_t num_threads) const {
+    std::unique_ptr<ThreadPool> pool = MakePool(num_threads);
+    std::string text = "\n";
+    WriteFstText(*fst_, pool.get(), &text);
+    text += '\n';
+    return text;
+  }
+
+  // Write the text format to a file, as Text() would return it.
+  void WriteText(const std::string &filename, int32_t num_threads) const {
+    std::unique_ptr<ThreadPool> pool = MakePool(num_threads);
+    std::ofstream os(filename);
+    if (!os) KALDILM_ERR << "Failed to open " << filename << " for writing";
+    PrintFstInTextFormat(os, *fst_, pool.get());
+    os.close();
+    if (!os) KALDILM_ERR << "Failed to write " << filename;
+  }
+
+  int64_t NumStates() const { return fst_->NumStates(); }
+
+  int64_t NumArcs() const {
+    int64_t num_arcs = 0;
+    for (int32_t s = 0; s != fst_->NumStates(); ++s) {
+      num_arcs += fst_->NumArcs(s);
+    }
+    return num_arcs;
+  }
+
+  // Export the FST into arrays, on num_threads threads, or on as many as
+  // there are cores if it is not positive.
+  void ExportArrays(int32_t num_threads, FstArrays *arrays) const {
+    std::unique_ptr<ThreadPool> pool = MakePool(num_threads);
+    ExportFstArrays(*fst_, pool.get(), arrays);
+  }
+
+ private:
+  std::unique_ptr<fst::StdExpandedFst> fst_;
+};
+
+// One of the arrays of an FstArrays, exposed through the buffer protocol,
+// so that numpy.asarray() and torch.frombuffer() share its memory rather
+// than copy it. It keeps all the arrays alive.
+class FstArray {
+ public:
+  template <class T>
+  FstArray(std::shared_ptr<FstArrays> owner, std::vector<T> *values)
+      : owner_(std::move(owner)),
+        data_(values->data()),
+        size_(values->size()),
+        itemsize_(sizeof(T)),
+        format_(py::format_descriptor<T>::format()) {}
+
+  py::buffer_info Buffer() const {
+    return py::buffer_info(data_, itemsize_, format_, 1, {size_},
+                           {itemsize_});
+  }
+
+  py::ssize_t Size() const { return size_; }
+
+ private:
+  std::shared_ptr<FstArrays> owner_;
+  void *data_;
+  py::ssize_t size_;
+  py::ssize_t itemsize_;
+  std::string format_;
+};
+
+// Return the arrays of the FST in a dict; see arpa2fst.py. The export runs
+// without the GIL.
+static py::dict ToArrays(const CompiledFst &compiled, int32_t num_threads) {
+  std::shared_ptr<FstArrays> arrays = std::make_shared<FstArrays>();
+  {
+    py::gil_scoped_release release;
+    compiled.ExportArrays(num_threads, arrays.get());
+  }
+  py::dict ans;
+  ans["start"] = arrays->start;
+  ans["row_splits"] = FstArray(arrays, &arrays->row_splits);
+  ans["src"] = FstArray(arrays, &arrays->src);
+  ans["dst"] = FstArray(arrays, &arrays->dst);
+  ans["ilabel"] = FstArray(arrays, &arrays->ilabel);
+  ans["olabel"] = FstArray(arrays, &arrays->olabel);
+  ans["weight"] = FstArray(arrays, &arrays->weight);
+  ans["final_weight"] = FstArray(arrays, &arrays->final_weight);
+  return ans;
+}
+
+// A temporary file in tmp_dir, or, if it is empty, in $TMPDIR or /tmp. It is
+// removed in the destructor; a file mapped into memory stays readable until
+// it is unmapped.
+class TempFile {
+ public:
+  explicit TempFile(std::string tmp_dir) {
+    if (tmp_dir.empty()) {
+      const char *env = std::getenv("TMPDIR");
+      tmp_dir = env != nullptr && *env != '\0' ? env : "/tmp";
+    }
+#ifdef _WIN32
+    std::unique_ptr<char, void (*)(void *)> name(
+        _tempnam(tmp_dir.c_str(), "kaldilm-"), std::free);
+    if (name != nullptr) name_ = name.get();
+#else
+    std::string name = tmp_dir + "/kaldilm-XXXXXX";
+    std::vector<char> buf(name.begin(), name.end());
+    buf.push_back('\0');
+    int fd = mkstemp(buf.data());
+    if (fd != -1) {
+      close(fd);
+      name_ = buf.data();
+    }
+#endif
+    if (name_.empty()) {
+      KALDILM_ERR << "Failed to create a temporary file in " << tmp_dir << ": "
+                  << std::strerror(errno);
+    }
+  }
+  ~TempFile() { std::remove(name_.c_str()); }
+
+  TempFile(const TempFile &) = delete;
+  TempFile &operator=(const TempFile &) = delete;
+
+  const std::string &Name() const { return name_; }
+
+ private:
+  std::string name_;
+};
 
-  if (!ok) KALDILM_ERR << "Error writing FST to stream";
+// Write the model compiled in CSR layout as a ConstFst to fst_wxfilename,
+// aligned so that ReadConstFst() can map it into memory. The "write" phase
+// is added to stats.
+static void WriteConstFst(const CsrFst &csr, const fst::SymbolTable &symbols,
+                          const std::string &fst_wxfilename, bool keep_symbols,
+                          const std::string &write_syms_filename,
+                          CompileStats *stats) {
+  PhaseTimer write_timer;
+  if (!write_syms_filename.empty()) {
+    std::ofstream kosym(write_syms_filename);
+    symbols.WriteText(kosym);
+  }
+
+  fst::FstWriteOptions wopts(fst_wxfilename);
+  wopts.write_isymbols = wopts.write_osymbols = keep_symbols;
+  wopts.align = true;
+  std::ofstream kofst(fst_wxfilename, std::ios::binary);
+  if (!kofst) KALDILM_ERR << "Failed to open " << fst_wxfilename;
+  csr.Write(kofst, wopts);
+  kofst.close();
+  if (!kofst) KALDILM_ERR << "Failed to write " << fst_wxfilename;
+  write_timer.Finish("write", stats);
 }
 
-std::string Arpa2Fst(const std::string &input_arpa,
-                     const std::string &output_fst = "",
-                     const std::string bos_symbol = "<s>",
-                     const std::string &disambig_symbol = "",
-                     const std::string &eos_symbol = "</s>",
-                     bool ilabel_sort = true, bool keep_symbols = false,
-                     int32_t max_arpa_warnings = 30,
-                     const std::string &read_symbol_table = "",
-                     const std::string &write_symbol_table = "",
-                     int32_t max_order = -1) {
+// Read back a ConstFst written by WriteConstFst(). It is mapped into memory
+// rather than copied, so it should be read once the arrays it was written
+// from are gone.
+static std::unique_ptr<fst::StdExpandedFst> ReadConstFst(
+    const std::string &filename) {
+  std::ifstream kifst(filename, std::ios::binary);
+  fst::FstReadOptions ropts(filename);
+  ropts.mode = fst::FstReadOptions::MAP;
+  std::unique_ptr<fst::StdExpandedFst> result(
+      fst::StdConstFst::Read(kifst, ropts));
+  if (result == nullptr) KALDILM_ERR << "Failed to read back " << filename;
+  return result;
+}
+
+// Replace the contents of stats_dict, unless it is None, with stats.
+static void ReturnStats(const CompileStats &stats, py::object stats_dict) {
+  if (stats_dict.is_none()) return;
+  py::dict dict = stats_dict.cast<py::dict>();
+  dict.clear();
+  dict.attr("update")(
+      py::module::import("json").attr("loads")(stats.ToJson()));
+}
+
+// Arguments of arpa2fst() other than stats; see arpa2fst.py.
+struct Arpa2FstOptions {
+  std::string input_arpa;
+  std::string output_fst;
+  std::string bos_symbol = "<s>";
+  std::string disambig_symbol;
+  std::string eos_symbol = "</s>";
+  bool ilabel_sort = true;
+  bool keep_symbols = false;
+  int32_t max_arpa_warnings = 30;
+  std::string read_symbol_table;
+  std::string write_symbol_table;
+  int32_t max_order = -1;
+  int32_t num_threads = 1;
+  bool const_fst = false;
+  int64_t max_memory_mb = 0;
+  std::string tmp_dir;
+  bool remove_redundant_states = false;
+  std::string write_arpa_cache;
+  bool return_text = true;
+
+  // Inputs given in memory rather than as files; see Arpa2FstJob. If
+  // arpa_data is not null, it is read in place instead of input_arpa, and
+  // so is symbol_table instead of read_symbol_table.
+  const char *arpa_data = nullptr;
+  std::size_t arpa_size = 0;
+  std::shared_ptr<const fst::SymbolTable> symbol_table;
+};
+
+// What arpa2fst() returns: the text format of the FST, or, if return_text
+// is false, the FST itself; and the stats and the symbol table.
+struct Arpa2FstResult {
+  std::string text;
+  std::unique_ptr<CompiledFst> fst;
+  CompileStats stats;
+  std::unique_ptr<fst::SymbolTable> symbols;
+  // The message of the error the job failed with, in arpa2fst_batch().
+  std::string error;
+};
+
+// Compile the model and write the output files. It touches no Python
+// objects, so it runs without the GIL. The symbol table of the model is
+// returned in symbols_out.
+static std::unique_ptr<fst::StdExpandedFst> CompileArpa(
+    const Arpa2FstOptions &opts, CompileStats *stats,
+    std::unique_ptr<fst::SymbolTable> *symbols_out) {
+  if (opts.max_memory_mb > 0 && !opts.const_fst) {
+    KALDILM_ERR << "max_memory_mb is supported only with const_fst";
+  }
+
   ArpaParseOptions options;
-  options.max_order = max_order;
-  options.max_warnings = max_arpa_warnings;
+  options.max_order = opts.max_order;
+  options.num_threads = opts.num_threads;
+  options.max_warnings = opts.max_arpa_warnings;
+  options.cache_filename = opts.write_arpa_cache;
 
-  std::string read_syms_filename = read_symbol_table;
-  std::string write_syms_filename = write_symbol_table;
+  std::string read_syms_filename = opts.read_symbol_table;
+  std::string write_syms_filename = opts.write_symbol_table;
 
-  std::string arpa_rxfilename = input_arpa;
-  std::string fst_wxfilename = output_fst;
+  std::string arpa_rxfilename = opts.input_arpa;
+  std::string fst_wxfilename = opts.output_fst;
+  bool keep_symbols = opts.keep_symbols;
+
+  // Without output_fst, a ConstFst is written to a temporary file, so that
+  // it can be mapped into memory too.
+  std::unique_ptr<TempFile> tmp_fst;
+  if (opts.const_fst && fst_wxfilename.empty()) {
+    tmp_fst.reset(new TempFile(opts.tmp_dir));
+  }
+  const std::string &const_fst_filename =
+      tmp_fst != nullptr ? tmp_fst->Name() : fst_wxfilename;
 
   int64 disambig_symbol_id = 0;
 
-  fst::SymbolTable *symbols;
-  if (!read_syms_filename.empty()) {
-    // Use existing symbols. Required symbols must be in the table.
+  // Use existing symbols, if any. Required symbols must be in the table.
+  std::unique_ptr<fst::SymbolTable> symbols;
+  if (opts.symbol_table != nullptr) {
+    // The copy shares the symbols of the original until it is modified.
+    symbols.reset(opts.symbol_table->Copy());
+    read_syms_filename = "<memory>";
+  } else if (!read_syms_filename.empty()) {
     std::ifstream kisym(read_syms_filename);
-    symbols = fst::SymbolTable::ReadText(kisym, read_syms_filename);
+    symbols.reset(fst::SymbolTable::ReadText(kisym, read_syms_filename));
     if (symbols == nullptr)
       KALDILM_ERR << "Could not read symbol table from file "
                   << read_syms_filename;
+  }
 
+  bool read_symbols = symbols != nullptr;
+  if (read_symbols) {
     options.oov_handling = ArpaParseOptions::kSkipNGram;
-    if (!disambig_symbol.empty()) {
-      disambig_symbol_id = symbols->Find(disambig_symbol);
+    if (!opts.disambig_symbol.empty()) {
+      disambig_symbol_id = symbols->Find(opts.disambig_symbol);
       if (disambig_symbol_id == -1)  // fst::kNoSymbol
         KALDILM_ERR << "Symbol table " << read_syms_filename
-                    << " has no symbol for " << disambig_symbol;
+                    << " has no symbol for " << opts.disambig_symbol;
     }
   } else {
     // Create a new symbol table and populate it from ARPA file.
-    symbols = new fst::SymbolTable(fst_wxfilename);
+    symbols.reset(new fst::SymbolTable(fst_wxfilename));
     options.oov_handling = ArpaParseOptions::kAddToSymbols;
     symbols->AddSymbol("<eps>", 0);
-    if (!disambig_symbol.empty()) {
-      disambig_symbol_id = symbols->AddSymbol(disambig_symbol);
+    if (!opts.disambig_symbol.empty()) {
+      disambig_symbol_id = symbols->AddSymbol(opts.disambig_symbol);
     }
   }
 
   // Add or use existing BOS and EOS.
-  options.bos_symbol = symbols->AddSymbol(bos_symbol);
-  options.eos_symbol = symbols->AddSymbol(eos_symbol);
+  options.bos_symbol = symbols->AddSymbol(opts.bos_symbol);
+  options.eos_symbol = symbols->AddSymbol(opts.eos_symbol);
 
   // If producing new (not reading existing) symbols and not saving them,
   // need to keep symbols with FST, otherwise they would be lost.
-  if (read_syms_filename.empty() && write_syms_filename.empty())
-    keep_symbols = true;
+  if (!read_symbols && write_syms_filename.empty()) keep_symbols = true;
 
-  // Actually compile LM.
+  // Actually compile LM. The compiler is gone, and its memory with it, by
+  // the time the result is returned, or, with const_fst, read back.
   KALDILM_ASSERT(symbols != nullptr);
-  ArpaLmCompiler lm_compiler(options, disambig_symbol_id, symbols);
+  std::unique_ptr<fst::StdExpandedFst> result;
   {
-    std::fstream ki(arpa_rxfilename);
-    lm_compiler.Read(ki);
+    ArpaLmCompiler lm_compiler(options, disambig_symbol_id, symbols.get(),
+                               opts.const_fst);
+    if (opts.max_memory_mb > 0) {
+      lm_compiler.SetMemoryBudget(
+          static_cast<std::size_t>(opts.max_memory_mb) << 20, opts.tmp_dir);
+    }
+    lm_compiler.SetRemoveRedundantStates(opts.remove_redundant_states);
+    // Sort the FST if requested by options. Only the states whose arcs are
+    // out of order are sorted.
+    lm_compiler.SetILabelSort(opts.ilabel_sort);
+    if (opts.arpa_data != nullptr) {
+      lm_compiler.Read(opts.arpa_data, opts.arpa_size);
+    } else {
+      lm_compiler.Read(arpa_rxfilename);
+    }
+    *stats = lm_compiler.Stats();
+
+    if (opts.const_fst) {
+      WriteConstFst(lm_compiler.Csr(), *symbols, const_fst_filename,
+                    keep_symbols, write_syms_filename, stats);
+    } else {
+      PhaseTimer write_timer;
+      // Write symbols if requested.
+      if (!write_syms_filename.empty()) {
+        std::ofstream kosym(write_syms_filename);
+        symbols->WriteText(kosym);
+      }
+
+      // Write LM FST.
+      if (fst_wxfilename.size() > 0) {
+        std::ofstream kofst(fst_wxfilename, std::ios::binary);
+        fst::FstWriteOptions wopts(fst_wxfilename);
+        wopts.write_isymbols = wopts.write_osymbols = keep_symbols;
+        lm_compiler.Fst().Write(kofst, wopts);
+      }
+      write_timer.Finish("write", stats);
+      // Shares the states of the compiler's FST rather than copying them.
+      result.reset(new fst::StdVectorFst(lm_compiler.Fst()));
+    }
   }
+  if (opts.const_fst) result = ReadConstFst(const_fst_filename);
+  *symbols_out = std::move(symbols);
+  return result;
+}
 
-  // Sort the FST in-place if requested by options.
-  if (ilabel_sort) {
-    fst::ArcSort(lm_compiler.MutableFst(), fst::StdILabelCompare());
+static Arpa2FstResult RunArpa2Fst(const Arpa2FstOptions &opts) {
+  Arpa2FstResult result;
+  std::unique_ptr<CompiledFst> compiled(
+      new CompiledFst(CompileArpa(opts, &result.stats, &result.symbols)));
+  if (opts.return_text) {
+    PhaseTimer print_timer;
+    result.text = compiled->Text(opts.num_threads);
+    print_timer.Finish("print", &result.stats);
+  } else {
+    result.fst = std::move(compiled);
   }
+  result.stats.peak_rss_bytes = PeakRssBytes();
+  return result;
+}
 
-  // Write symbols if requested.
-  if (!write_syms_filename.empty()) {
-    std::ofstream kosym(write_syms_filename);
-    symbols->WriteText(kosym);
+// Replace the contents of symbols_dict, unless it is None, with symbols,
+// mapping each symbol to its id.
+static void ReturnSymbols(const fst::SymbolTable &symbols,
+                          py::object symbols_dict) {
+  if (symbols_dict.is_none()) return;
+  py::dict dict = symbols_dict.cast<py::dict>();
+  dict.clear();
+  for (fst::SymbolTableIterator siter(symbols); !siter.Done(); siter.Next()) {
+    dict[py::str(siter.Symbol())] = siter.Value();
   }
+}
 
-  // Write LM FST.
-  if (fst_wxfilename.size() > 0) {
-    std::ofstream kofst(fst_wxfilename, std::ios::binary);
-    fst::FstWriteOptions wopts(fst_wxfilename);
-    wopts.write_isymbols = wopts.write_osymbols = keep_symbols;
-    lm_compiler.Fst().Write(kofst, wopts);
+// Return the text as a str or the CompiledFst, and fill in stats_dict and
+// symbols_dict unless they are None. Needs the GIL.
+static py::object ToPython(Arpa2FstResult *result, py::object stats_dict,
+                           py::object symbols_dict) {
+  ReturnStats(result->stats, stats_dict);
+  ReturnSymbols(*result->symbols, symbols_dict);
+  result->symbols.reset();
+  if (result->fst != nullptr) return py::cast(std::move(result->fst));
+  py::str text(result->text);
+  std::string().swap(result->text);
+  return std::move(text);
+}
+
+// Build a symbol table from a dict mapping symbols to ids, or from a list
+// of symbols, whose ids are their positions. Needs the GIL.
+static std::shared_ptr<const fst::SymbolTable> ToSymbolTable(
+    py::handle symbol_table) {
+  std::shared_ptr<fst::SymbolTable> symbols =
+      std::make_shared<fst::SymbolTable>("<memory>");
+  auto add = [&symbols](py::handle symbol, int64 id) {
+    std::string s = symbol.cast<std::string>();
+    if (id < 0) {
+      throw py::value_error("Negative id " + std::to_string(id) +
+                            " of symbol " + s + " in the symbol table");
+    }
+    if (symbols->Member(id)) {
+      throw py::value_error("Duplicate id " + std::to_string(id) +
+                            " in the symbol table");
+    }
+    if (symbols->AddSymbol(s, id) != id) {
+      throw py::value_error("Duplicate symbol " + s + " in the symbol table");
+    }
+  };
+  if (py::isinstance<py::dict>(symbol_table)) {
+    for (auto item : py::reinterpret_borrow<py::dict>(symbol_table)) {
+      add(item.first, item.second.cast<int64>());
+    }
+  } else {
+    int64 id = 0;
+    for (py::handle symbol : symbol_table) add(symbol, id++);
   }
+  return symbols;
+}
+
+// A job of arpa2fst() with the Python objects it reads in place. It is
+// made and destroyed with the GIL held, and run without it.
+struct Arpa2FstJob {
+  Arpa2FstOptions opts;
+  // The view of the buffer opts.arpa_data points into, which keeps the
+  // buffer alive and unchanged until the job is done.
+  std::unique_ptr<py::buffer_info> arpa_buffer;
+};
 
-  delete symbols;
+// Return a view of arpa_data, any object supporting the buffer protocol,
+// e.g., bytes, which holds an ARPA file or cache. The view keeps the buffer
+// alive and unchanged until it is destroyed, with the GIL held.
+static std::unique_ptr<py::buffer_info> RequestArpaBuffer(
+    py::object arpa_data) {
+  std::unique_ptr<py::buffer_info> buffer(
+      new py::buffer_info(py::buffer(arpa_data).request()));
+  if (!PyBuffer_IsContiguous(buffer->view(), 'C')) {
+    throw py::value_error("input_arpa must be a contiguous buffer");
+  }
+  return buffer;
+}
 
-  std::ostringstream os;
-  PrintFstInTextFormat<fst::StdArc>(os, lm_compiler.Fst());
-  return os.str();
+// Set up job to run with opts, and with the ARPA file or cache in
+// arpa_data, and the symbol table in symbol_table, unless they are None.
+// See RequestArpaBuffer() for arpa_data, and ToSymbolTable() for
+// symbol_table.
+static void InitJob(const Arpa2FstOptions &opts, py::object arpa_data,
+                    py::object symbol_table, Arpa2FstJob *job) {
+  job->opts = opts;
+  if (!arpa_data.is_none()) {
+    job->arpa_buffer = RequestArpaBuffer(arpa_data);
+    job->opts.arpa_data = static_cast<const char *>(job->arpa_buffer->ptr);
+    job->opts.arpa_size =
+        job->arpa_buffer->size * job->arpa_buffer->itemsize;
+  }
+  if (!symbol_table.is_none()) {
+    job->opts.symbol_table = ToSymbolTable(symbol_table);
+  }
+}
+
+static py::object Arpa2Fst(const Arpa2FstOptions &opts, py::object arpa_data,
+                           py::object symbol_table, py::object stats_dict,
+                           py::object symbols_dict) {
+  Arpa2FstJob job;
+  InitJob(opts, arpa_data, symbol_table, &job);
+  Arpa2FstResult result;
+  {
+    py::gil_scoped_release release;
+    result = RunArpa2Fst(job.opts);
+  }
+  return ToPython(&result, stats_dict, symbols_dict);
+}
+
+// Run the jobs on num_workers threads, or on as many as there are cores if
+// it is not positive, and return a list of (result, stats) tuples in the
+// order of the jobs. Each job is a tuple of the arguments of Arpa2Fst()
+// other than stats_dict. The result of a job that failed is the
+// RuntimeError it failed with; the other jobs go on.
+static py::list Arpa2FstBatch(py::list jobs, int32_t num_workers) {
+  std::vector<Arpa2FstJob> batch(jobs.size());
+  for (std::size_t i = 0; i != batch.size(); ++i) {
+    py::tuple job = jobs[i].cast<py::tuple>();
+    InitJob(job[0].cast<const Arpa2FstOptions &>(), job[1], job[2],
+            &batch[i]);
+  }
+  std::vector<Arpa2FstResult> results(batch.size());
+  {
+    py::gil_scoped_release release;
+    if (num_workers <= 0) {
+      num_workers = std::thread::hardware_concurrency();
+    }
+    std::unique_ptr<ThreadPool> pool;
+    if (num_workers > 1 && batch.size() > 1) {
+      pool.reset(new ThreadPool(
+          std::min<std::size_t>(num_workers, batch.size())));
+    }
+    ParallelFor(pool.get(), batch.size(),
+                [&batch, &results](int32_t i) {
+                  const Arpa2FstOptions &opts = batch[i].opts;
+                  KALDILM_LOG << "Compiling "
+                              << (opts.arpa_data != nullptr ? "<memory>"
+                                                            : opts.input_arpa);
+                  try {
+                    results[i] = RunArpa2Fst(opts);
+                  } catch (const std::exception &e) {
+                    results[i] = Arpa2FstResult();
+                    results[i].error = e.what();
+                  }
+                });
+  }
+  py::list ans;
+  for (std::size_t i = 0; i != results.size(); ++i) {
+    py::dict stats;
+    py::object value;
+    if (results[i].error.empty()) {
+      value = ToPython(&results[i], stats, jobs[i].cast<py::tuple>()[3]);
+    } else {
+      value = py::reinterpret_borrow<py::object>(PyExc_RuntimeError)(
+          results[i].error);
+    }
+    ans.append(py::make_tuple(value, stats));
+  }
+  return ans;
 }
 
+// Yields the n-grams of an ARPA file or cache in batches of NumPy arrays;
+// see ngram_reader.py. The file is read on a thread of its own, without
+// the GIL.
+class NGramReader {
+ public:
+  NGramReader(py::object input_arpa, py::object read_symbol_table,
+              const std::string &bos_symbol,
+              const std::string &disambig_symbol,
+              const std::string &eos_symbol, int32_t max_order,
+              int32_t num_threads, int32_t max_arpa_warnings,
+              int32_t batch_size) {
+    ArpaParseOptions options;
+    options.max_order = max_order;
+    options.num_threads = num_threads;
+    options.max_warnings = max_arpa_warnings;
+
+    // Symbols are mapped as by arpa2fst(), so that the ids are the same.
+    if (py::isinstance<py::str>(read_symbol_table)) {
+      std::string filename = read_symbol_table.cast<std::string>();
+      if (!filename.empty()) {
+        std::ifstream kisym(filename);
+        symbols_.reset(fst::SymbolTable::ReadText(kisym, filename));
+        if (symbols_ == nullptr)
+          KALDILM_ERR << "Could not read symbol table from file "
+                      << filename;
+      }
+    } else if (!read_symbol_table.is_none()) {
+      symbols_.reset(ToSymbolTable(read_symbol_table)->Copy());
+    }
+    if (symbols_ != nullptr) {
+      options.oov_handling = ArpaParseOptions::kSkipNGram;
+    } else {
+      symbols_.reset(new fst::SymbolTable("<memory>"));
+      options.oov_handling = ArpaParseOptions::kAddToSymbols;
+      symbols_->AddSymbol("<eps>", 0);
+      if (!disambig_symbol.empty()) symbols_->AddSymbol(disambig_symbol);
+    }
+    options.bos_symbol = symbols_->AddSymbol(bos_symbol);
+    options.eos_symbol = symbols_->AddSymbol(eos_symbol);
+
+    reader_.reset(new ArpaNGramReader(options, symbols_.get(), batch_size));
+    if (py::isinstance<py::str>(input_arpa)) {
+      reader_->Start(input_arpa.cast<std::string>());
+    } else {
+      arpa_buffer_ = RequestArpaBuffer(input_arpa);
+      reader_->Start(static_cast<const char *>(arpa_buffer_->ptr),
+                     arpa_buffer_->size * arpa_buffer_->itemsize);
+    }
+  }
+
+  // Dropping the reader early waits for the reading thread to stop, which
+  // it does at the next batch.
+  ~NGramReader() {
+    py::gil_scoped_release release;
+    reader_.reset();
+  }
+
+  // Return a tuple (order, words, logprobs, backoffs) for the next batch.
+  // The arrays own the memory of the batch, which is not copied.
+  py::tuple Next() {
+    std::unique_ptr<NGramBatch> batch(new NGramBatch);
+    bool ok;
+    {
+      py::gil_scoped_release release;
+      ok = reader_->Next(batch.get());
+    }
+    if (!ok) {
+      done_ = true;
+      throw py::stop_iteration();
+    }
+    py::ssize_t size = batch->Size();
+    py::ssize_t order = batch->order;
+    const NGramBatch *data = batch.get();
+    py::capsule owner(batch.release(), [](void *p) {
+      delete static_cast<NGramBatch *>(p);
+    });
+    return py::make_tuple(
+        order,
+        py::array_t<int32_t>({size, order}, data->words.data(), owner),
+        py::array_t<float>(size, data->logprobs.data(), owner),
+        py::array_t<float>(size, data->backoffs.data(), owner));
+  }
+
+  py::dict Symbols() const {
+    CheckDone("symbols");
+    py::dict ans;
+    ReturnSymbols(*symbols_, ans);
+    return ans;
+  }
+
+  py::dict Stats() const {
+    CheckDone("stats");
+    py::dict ans;
+    ReturnStats(reader_->Stats(), ans);
+    return ans;
+  }
+
+ private:
+  void CheckDone(const std::string &what) const {
+    if (!done_) {
+      throw std::runtime_error(what +
+                               " are available once all n-grams are read");
+    }
+  }
+
+  // The reader is destroyed first, as it uses the others.
+  std::unique_ptr<py::buffer_info> arpa_buffer_;
+  std::unique_ptr<fst::SymbolTable> symbols_;
+  std::unique_ptr<ArpaNGramReader> reader_;
+  bool done_ = false;
+};
+
 }  // namespace kaldilm
 
 PYBIND11_MODULE(_kaldilm, m) {
   m.doc() = "Python wrapper for kaldilm";
-  m.def("arpa2fst", &kaldilm::Arpa2Fst, py::arg("input_arpa"),
-        py::arg("output_fst") = "", py::arg("bos_symbol") = "<s>",
-        py::arg("disambig_symbol") = "", py::arg("eos_symbol") = "</s>",
-        py::arg("ilabel_sort") = true, py::arg("keep_symbols") = false,
-        py::arg("max_arpa_warnings") = 30, py::arg("read_symbol_table") = "",
-        py::arg("write_symbol_table") = "", py::arg("max_order") = -1);
+  py::class_<kaldilm::CompiledFst>(m, "CompiledFst")
+      .def("text", &kaldilm::CompiledFst::Text, py::arg("num_threads") = 1,
+           py::call_guard<py::gil_scoped_release>())
+      .def("write_text", &kaldilm::CompiledFst::WriteText,
+           py::arg("filename"), py::arg("num_threads") = 1,
+           py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("num_states", &kaldilm::CompiledFst::NumStates)
+      .def_property_readonly("num_arcs", &kaldilm::CompiledFst::NumArcs)
+      .def("to_arrays", &kaldilm::ToArrays, py::arg("num_threads") = 1);
+  py::class_<kaldilm::FstArray>(m, "FstArray", py::buffer_protocol())
+      .def_buffer(&kaldilm::FstArray::Buffer)
+      .def("__len__", &kaldilm::FstArray::Size);
+  using kaldilm::Arpa2FstOptions;
+  py::class_<Arpa2FstOptions>(m, "Arpa2FstOptions")
+      .def(py::init<>())
+      .def_readwrite("input_arpa", &Arpa2FstOptions::input_arpa)
+      .def_readwrite("output_fst", &Arpa2FstOptions::output_fst)
+      .def_readwrite("bos_symbol", &Arpa2FstOptions::bos_symbol)
+      .def_readwrite("disambig_symbol", &Arpa2FstOptions::disambig_symbol)
+      .def_readwrite("eos_symbol", &Arpa2FstOptions::eos_symbol)
+      .def_readwrite("ilabel_sort", &Arpa2FstOptions::ilabel_sort)
+      .def_readwrite("keep_symbols", &Arpa2FstOptions::keep_symbols)
+      .def_readwrite("max_arpa_warnings", &Arpa2FstOptions::max_arpa_warnings)
+      .def_readwrite("read_symbol_table", &Arpa2FstOptions::read_symbol_table)
+      .def_readwrite("write_symbol_table", &Arpa2FstOptions::write_symbol_table)
+      .def_readwrite("max_order", &Arpa2FstOptions::max_order)
+      .def_readwrite("num_threads", &Arpa2FstOptions::num_threads)
+      .def_readwrite("const_fst", &Arpa2FstOptions::const_fst)
+      .def_readwrite("max_memory_mb", &Arpa2FstOptions::max_memory_mb)
+      .def_readwrite("tmp_dir", &Arpa2FstOptions::tmp_dir)
+      .def_readwrite("remove_redundant_states",
+                     &Arpa2FstOptions::remove_redundant_states)
+      .def_readwrite("write_arpa_cache", &Arpa2FstOptions::write_arpa_cache)
+      .def_readwrite("return_text", &Arpa2FstOptions::return_text);
+  m.def("arpa2fst", &kaldilm::Arpa2Fst, py::arg("options"),
+        py::arg("arpa_data") = py::none(),
+        py::arg("symbol_table") = py::none(), py::arg("stats") = py::none(),
+        py::arg("symbols") = py::none());
+  m.def("arpa2fst_batch", &kaldilm::Arpa2FstBatch, py::arg("jobs"),
+        py::arg("num_workers") = 0);
+  py::class_<kaldilm::NGramReader>(m, "NGramReader")
+      .def(py::init<py::object, py::object, const std::string &,
+                    const std::string &, const std::string &, int32_t,
+                    int32_t, int32_t, int32_t>(),
+           py::arg("input_arpa"), py::arg("read_symbol_table"),
+           py::arg("bos_symbol"), py::arg("disambig_symbol"),
+           py::arg("eos_symbol"),
+           py::arg("max_order"), py::arg("num_threads"),
+           py::arg("max_arpa_warnings"), py::arg("batch_size"))
+      .def("__iter__", [](py::object self) { return self; })
+      .def("__next__", &kaldilm::NGramReader::Next)
+      .def("symbols", &kaldilm::NGramReader::Symbols)
+      .def("stats", &kaldilm::NGramReader::Stats);
 }
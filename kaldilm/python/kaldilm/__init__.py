@@ -1 +1,2 @@
-from .arpa2fst import arpa2fst
+from .arpa2fst import CompiledFst, arpa2fst, arpa2fst_batch
+from .ngram_reader import NGramReader, read_ngrams
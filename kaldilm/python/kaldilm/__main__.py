@@ -4,6 +4,8 @@
 
 if __name__ == '__main__':
     import argparse
+    import json
+    import sys
 
     from .arpa2fst import arpa2fst
 
@@ -68,7 +70,61 @@ if __name__ == '__main__':
                         'Default is -1.',
                         default=-1,
                         type=int)
-    parser.add_argument('input_arpa', help='input arpa filename')
+    parser.add_argument('--num-threads',
+                        help='Number of threads used to parse the n-gram '
+                        'sections of the arpa file, to sort arcs and to '
+                        'remove redundant states. Unless it is 1, the fst '
+                        'is also built while the arpa file is parsed. '
+                        'If it is 0 or negative, all available cores are used. '
+                        'Default is 1.',
+                        default=1,
+                        type=int)
+    parser.add_argument('--const-fst',
+                        help='Compile directly into the layout of a ConstFst '
+                        'and write the output fst as a ConstFst. '
+                        'It needs about half the memory (default = false)',
+                        type=_str2bool,
+                        default=False)
+    parser.add_argument('--max-memory-mb',
+                        help='If positive, keep the arrays built during '
+                        'compilation within this many megabytes of memory '
+                        'by moving the rest to temporary files. '
+                        'Requires --const-fst=true. Default is 0.',
+                        default=0,
+                        type=int)
+    parser.add_argument('--tmp-dir',
+                        help='Directory for the temporary files of '
+                        '--max-memory-mb. It should be on a local disk. '
+                        'If empty, $TMPDIR or /tmp is used (default = "")',
+                        default='')
+    parser.add_argument('--remove-redundant-states',
+                        help='Remove states that have only a backoff arc, '
+                        'as kaldi does. Requires --disambig-symbol. '
+                        'It uses --num-threads threads (default = false)',
+                        type=_str2bool,
+                        default=False)
+    parser.add_argument('--write-arpa-cache',
+                        help='Also write the n-grams to this file in a '
+                        'binary form, which can be given as input_arpa '
+                        'to compile the model again faster (default = "")',
+                        default='')
+    parser.add_argument('--print-stats',
+                        help='Print the time and memory taken by each '
+                        'phase, and the n-gram, state and arc counts, as '
+                        'JSON to stderr (default = false)',
+                        type=_str2bool,
+                        default=False)
+    parser.add_argument('--print-text',
+                        help='Print the text format of the FST to stdout. '
+                        'Set it to false when only output_fst is needed, '
+                        'to save the time and memory of generating it '
+                        '(default = true)',
+                        type=_str2bool,
+                        default=True)
+    parser.add_argument('input_arpa',
+                        help='input arpa filename. It may be compressed '
+                        'with gzip, xz or zstd, or be a file written by '
+                        '--write-arpa-cache')
     parser.add_argument('output_fst',
                         default='',
                         nargs='?',
@@ -76,6 +132,7 @@ if __name__ == '__main__':
                         'If empty, no output file is created.')
     args = parser.parse_args()
 
+    stats = {} if args.print_stats else None
     s = arpa2fst(input_arpa=args.input_arpa,
                  output_fst=args.output_fst,
                  bos_symbol=args.bos_symbol,
@@ -86,5 +143,16 @@ if __name__ == '__main__':
                  max_arpa_warnings=args.max_arpa_warnings,
                  read_symbol_table=args.read_symbol_table,
                  write_symbol_table=args.write_symbol_table,
-                 max_order=args.max_order)
-    print(s)
+                 max_order=args.max_order,
+                 num_threads=args.num_threads,
+                 const_fst=args.const_fst,
+                 max_memory_mb=args.max_memory_mb,
+                 tmp_dir=args.tmp_dir,
+                 remove_redundant_states=args.remove_redundant_states,
+                 write_arpa_cache=args.write_arpa_cache,
+                 stats=stats,
+                 return_text=args.print_text)
+    if args.print_text:
+        print(s)
+    if stats is not None:
+        print(json.dumps(stats), file=sys.stderr)
@@ -1,9 +1,21 @@
 # Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
 
+import inspect
+from typing import Any, Dict, List, Optional, Tuple, Union
+
 import _kaldilm
+from _kaldilm import CompiledFst
+
 
+def _file_or_object(value: Any) -> Tuple[str, Any]:
+    '''Split an argument that is a file name or an in-memory object into
+    the file name and the object, one of which is empty.'''
+    if isinstance(value, str):
+        return value, None
+    return '', value
 
-def arpa2fst(input_arpa: str,
+
+def arpa2fst(input_arpa: Union[str, bytes, bytearray, memoryview],
              output_fst: str = '',
              bos_symbol: str = '<s>',
              disambig_symbol: str = '',
@@ -11,9 +23,18 @@ def arpa2fst(input_arpa: str,
              ilabel_sort: bool = True,
              keep_symbols: bool = False,
              max_arpa_warnings: int = 30,
-             read_symbol_table: str = '',
+             read_symbol_table: Union[str, Dict[str, int], List[str]] = '',
              write_symbol_table: str = '',
-             max_order: int = -1) -> str:
+             max_order: int = -1,
+             num_threads: int = 1,
+             const_fst: bool = False,
+             max_memory_mb: int = 0,
+             tmp_dir: str = '',
+             remove_redundant_states: bool = False,
+             write_arpa_cache: str = '',
+             stats: Optional[dict] = None,
+             return_text: bool = True,
+             symbols: Optional[dict] = None) -> Union[str, CompiledFst]:
     '''Convert an ARPA file to an FST.
 
     This function is a wrapper of kaldi's arpa2fst and
@@ -21,7 +42,14 @@ def arpa2fst(input_arpa: str,
 
     Args:
       input_arpa:
-        The input arpa file.
+        The input arpa file. It may be compressed with gzip, xz or zstd,
+        e.g., lm.arpa.gz; the format is detected from the file content.
+        It may also be an arpa cache written by write_arpa_cache, which
+        is read without any text parsing. Instead of a file name, it may
+        be the content of such a file as bytes, or as any other object
+        supporting the buffer protocol, e.g., a memoryview or a NumPy
+        array. It is read in place, without a copy, and must not be
+        changed until this function returns.
       output_fst:
         The output fst file. Note that it is a binary file.
         This function will return a text format of it.
@@ -34,7 +62,10 @@ def arpa2fst(input_arpa: str,
       eos_symbol:
         End of sentence symbol.
       ilabel_sort:
-        Ilabel-sort the output FST.
+        Ilabel-sort the output FST. Arcs are already in order if the
+        n-grams of the arpa file are sorted the same way as the ids of
+        their words, e.g., when the symbol table is created from the
+        unigram section. Only the states whose arcs are not get sorted.
       keep_symbols:
         Store symbol table with FST. Symbols always saved to FST if symbol
         tables are neither read or written (otherwise symbols would be lost
@@ -43,7 +74,9 @@ def arpa2fst(input_arpa: str,
         Maximum warnings to report on ARPA parsing, 0 to disable, -1 to
         show all.
       read_symbol_table:
-        Use existing symbol table.
+        Use existing symbol table. Instead of a file name, it may be a dict
+        mapping each symbol to its id, or a list of symbols, whose ids are
+        their positions, so that no file is written and read back.
       write_symbol_table:
         Write generated symbol table to a file.
       max_order:
@@ -51,19 +84,177 @@ def arpa2fst(input_arpa: str,
         If it is -1, all ngram data in the file are used.
         If it is 1, only unigram data are used.
         If it is 2, only ngram data up to bigram are used.
+        Sections of higher orders are skipped without being parsed.
+      num_threads:
+        Number of threads used to parse the n-gram sections of the
+        arpa file, to sort arcs, to remove redundant states and to
+        format the returned text. Unless it is 1, the FST is also built
+        on a thread of its own while the arpa file is being parsed. The
+        result does not depend on it. If it is 1, everything is
+        single-threaded. If it is 0 or negative, all available cores are
+        used.
+      const_fst:
+        If True, compile the model directly into the layout of OpenFst's
+        ConstFst and write output_fst as a ConstFst, which can be
+        memory-mapped when it is read. This needs about half the memory
+        of compiling a VectorFst. The returned FST is output_fst, or,
+        if it is empty, a temporary file in tmp_dir, mapped into memory
+        once the compiler has released its own.
+      max_memory_mb:
+        If positive, the large arrays built during compilation are kept
+        within this many megabytes of memory. Arrays that do not fit are
+        moved to temporary files, which are mapped into memory, so that
+        the operating system can page them out to disk. The result is the
+        same. It requires const_fst to be True. Other memory, e.g., the
+        symbol table, is not counted, so leave some headroom.
+      tmp_dir:
+        Directory for the temporary files of max_memory_mb and
+        const_fst. It should be on a local disk, not on a tmpfs. If it is
+        empty, $TMPDIR or /tmp is used.
+      remove_redundant_states:
+        If True, remove states that are not final and have only a backoff
+        arc, by redirecting the arcs into them to the destination of the
+        backoff arc, as kaldi's arpa2fst does. The result is equivalent,
+        and has fewer states and arcs. It requires disambig_symbol and
+        is done in parallel with num_threads threads.
+      write_arpa_cache:
+        If not empty, also write the n-grams of input_arpa to this file
+        in a binary form. Passing it as input_arpa later gives the same
+        FST as the arpa file for any other arguments, much faster. Only
+        the orders up to max_order are written. The file is not kept if
+        n-grams are skipped because their words are not in
+        read_symbol_table.
+      stats:
+        If not None, a dict that is cleared and filled with what the
+        compilation took and produced, e.g., for logging to a dashboard:
+
+          - phases: a list of dicts with name, wall_seconds, cpu_seconds
+            and peak_rss_bytes, in the order the phases ran. They are
+            "read" (parsing and building), "build" (the building part of
+            "read", with the CPU time of the building thread only),
+            "finish" (const_fst only), "ilabel_sort" and
+            "remove_redundant_states" if requested, "write", and "print"
+            if return_text is True.
+          - bytes_read: bytes of input_arpa read, after decompression.
+          - ngrams, skipped_ngrams: lists of the n-grams compiled and
+            skipped per order. N-grams are skipped for words not in
+            read_symbol_table, for a missing lower order n-gram, or for
+            a misplaced bos_symbol or eos_symbol.
+          - num_states, num_arcs: size of the FST.
+          - general_history_key: True if the model is too large for
+            histories to be packed into integers, which is slower.
+          - trie_history: True if the n-grams were sorted, so that their
+            histories were tracked in a compact trie.
+          - history_load_factor: load factor of the hash map of the
+            histories not in the trie.
+          - peak_rss_bytes: peak resident memory of the process; 0 on
+            Windows.
+      return_text:
+        If False, the text format is not generated, which for a large
+        model takes several times the memory of the FST. A CompiledFst
+        is returned instead, which holds the FST and produces the text
+        only on request: text(num_threads=1) returns it, and
+        write_text(filename, num_threads=1) streams it to a file. Both
+        format ranges of states on num_threads threads; the text is the
+        same for any of them. Its num_states and num_arcs give the size
+        of the FST. Drop it right away if only output_fst is needed.
+
+        to_arrays(num_threads=1) exports the FST into flat arrays, for
+        consumers such as k2 and PyTorch. It returns a dict with the
+        start state in 'start', and arrays that numpy.asarray() and
+        torch.frombuffer() use without a copy:
+          - row_splits (int64): the arcs of state s are
+            [row_splits[s], row_splits[s + 1]) in the arrays below.
+          - src, dst, ilabel, olabel (int32), weight (float32): the arcs.
+          - final_weight (float32): per state, inf if it is not final.
+        Weights are costs, i.e., negated natural log probabilities. The
+        arrays live on after the CompiledFst is dropped.
+      symbols:
+        If not None, a dict that is cleared and filled with the symbol
+        table of the FST, mapping each symbol to its id. It is the table
+        that write_symbol_table would write, without a file.
+
+    Returns:
+      Return a text format of the resulting FST with integer labels, or,
+      if return_text is False, a CompiledFst. It raises a RuntimeError if
+      the model cannot be compiled, e.g., for an invalid arpa file.
+    '''
+    options = _kaldilm.Arpa2FstOptions()
+    options.input_arpa, arpa_data = _file_or_object(input_arpa)
+    options.output_fst = output_fst
+    options.bos_symbol = bos_symbol
+    options.disambig_symbol = disambig_symbol
+    options.eos_symbol = eos_symbol
+    options.ilabel_sort = ilabel_sort
+    options.keep_symbols = keep_symbols
+    options.max_arpa_warnings = max_arpa_warnings
+    options.read_symbol_table, symbol_table = _file_or_object(
+        read_symbol_table)
+    options.write_symbol_table = write_symbol_table
+    options.max_order = max_order
+    options.num_threads = num_threads
+    options.const_fst = const_fst
+    options.max_memory_mb = max_memory_mb
+    options.tmp_dir = tmp_dir
+    options.remove_redundant_states = remove_redundant_states
+    options.write_arpa_cache = write_arpa_cache
+    options.return_text = return_text
+    # The GIL is released while the model is compiled.
+    return _kaldilm.arpa2fst(options,
+                             arpa_data=arpa_data,
+                             symbol_table=symbol_table,
+                             stats=stats,
+                             symbols=symbols)
+
+
+def arpa2fst_batch(
+        jobs: List[Dict[str, Any]],
+        num_workers: int = 0) -> List[Tuple[Union[str, CompiledFst], dict]]:
+    '''Compile several arpa files at once.
+
+    The jobs run on a pool of num_workers threads, each compiling one job at
+    a time, without holding the GIL, so that other Python threads keep
+    running meanwhile.
+
+    Args:
+      jobs:
+        The keyword arguments of arpa2fst() for each job, except stats,
+        e.g., [dict(input_arpa='a.arpa', output_fst='a.fst',
+        return_text=False), ...]. Jobs must not write to the same files.
+        Each job uses num_threads threads of its own on top of the pool.
+        Jobs may share the same read_symbol_table object; it is converted
+        once per job.
+      num_workers:
+        Number of jobs compiled at the same time. If it is 0 or negative,
+        as many as there are cores.
 
     Returns:
-      Return a text format of the resulting FST with integer labels.
+      Return a list with a tuple (result, stats) per job, in the order of
+      jobs, where result is what arpa2fst() would return, and stats is the
+      dict it would fill in. The results of all jobs are kept in memory
+      until the last one is done, so pass return_text=False for large
+      models. If a job fails, e.g., for an invalid arpa file, its result
+      is the RuntimeError that arpa2fst() would raise, and its stats are
+      empty; the other jobs are not affected.
     '''
-    s = _kaldilm.arpa2fst(input_arpa=input_arpa,
-                          output_fst=output_fst,
-                          bos_symbol=bos_symbol,
-                          disambig_symbol=disambig_symbol,
-                          eos_symbol=eos_symbol,
-                          ilabel_sort=ilabel_sort,
-                          keep_symbols=keep_symbols,
-                          max_arpa_warnings=max_arpa_warnings,
-                          read_symbol_table=read_symbol_table,
-                          write_symbol_table=write_symbol_table,
-                          max_order=max_order)
-    return s
+    signature = inspect.signature(arpa2fst)
+    batch = []
+    for job in jobs:
+        if 'stats' in job:
+            raise TypeError('stats is returned by arpa2fst_batch(), '
+                            'not passed in jobs')
+        bound = signature.bind(**job)
+        bound.apply_defaults()
+        arguments = bound.arguments
+        job_options = _kaldilm.Arpa2FstOptions()
+        for name, value in arguments.items():
+            if name not in ('input_arpa', 'read_symbol_table', 'stats',
+                            'symbols'):
+                setattr(job_options, name, value)
+        job_options.input_arpa, arpa_data = _file_or_object(
+            arguments['input_arpa'])
+        job_options.read_symbol_table, symbol_table = _file_or_object(
+            arguments['read_symbol_table'])
+        batch.append(
+            (job_options, arpa_data, symbol_table, arguments['symbols']))
+    return _kaldilm.arpa2fst_batch(batch, num_workers)
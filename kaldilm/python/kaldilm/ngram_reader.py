@@ -0,0 +1,65 @@
+# Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+from typing import Dict, List, Union
+
+import _kaldilm
+from _kaldilm import NGramReader
+
+
+def read_ngrams(input_arpa: Union[str, bytes, bytearray, memoryview],
+                read_symbol_table: Union[str, Dict[str, int], List[str]] = '',
+                bos_symbol: str = '<s>',
+                disambig_symbol: str = '',
+                eos_symbol: str = '</s>',
+                max_order: int = -1,
+                num_threads: int = 1,
+                max_arpa_warnings: int = 30,
+                batch_size: int = 65536) -> NGramReader:
+    '''Iterate over the n-grams of an ARPA file in batches of NumPy arrays.
+
+    The file is parsed by the same code as in arpa2fst(), on a thread of its
+    own and without holding the GIL, while the previous batches are being
+    processed. It is meant for analyzing or filtering a model before it is
+    compiled. NumPy must be installed.
+
+    Example:
+
+      reader = kaldilm.read_ngrams('lm.arpa', batch_size=1 << 20)
+      for order, words, logprobs, backoffs in reader:
+          print(order, words.shape, logprobs.min())
+      symbols = reader.symbols()
+
+    Args:
+      input_arpa, read_symbol_table, bos_symbol, disambig_symbol,
+      eos_symbol, max_order, num_threads, max_arpa_warnings:
+        As for arpa2fst(). Words are mapped to the same ids as by
+        arpa2fst() with the same arguments. N-grams with words not in
+        read_symbol_table are skipped.
+      batch_size:
+        The largest number of n-grams in a batch.
+
+    Returns:
+      Return an iterator yielding a tuple (order, words, logprobs,
+      backoffs) per batch, in the order of the file. All the n-grams of a
+      batch have the same order. words is an int32 array of shape
+      [batch, order] with the ids of the words of each n-gram, from left to
+      right; logprobs and backoffs are float32 arrays of shape [batch],
+      converted to natural logarithms. A missing backoff is 0. The arrays
+      are not copied, and they may be kept. An error in the file raises
+      a RuntimeError from the iterator, after the batches before it.
+
+      Once the iterator is exhausted, its symbols() returns the symbol
+      table as a dict mapping each symbol to its id, and its stats() the
+      statistics described for arpa2fst(), with the "read" phase only.
+      Dropping the iterator early stops the parsing of the rest of the
+      file.
+    '''
+    return _kaldilm.NGramReader(input_arpa=input_arpa,
+                                read_symbol_table=read_symbol_table,
+                                bos_symbol=bos_symbol,
+                                disambig_symbol=disambig_symbol,
+                                eos_symbol=eos_symbol,
+                                max_order=max_order,
+                                num_threads=num_threads,
+                                max_arpa_warnings=max_arpa_warnings,
+                                batch_size=batch_size)
@@ -0,0 +1,324 @@
+#!/usr/bin/env python3
+#
+# Copyright (c)  2020  Xiaomi Corporation (authors: Fangjun Kuang)
+
+# To run this single test, use
+#
+#  python3 -m unittest test_arpa2fst.py -v
+#
+# from this directory, with kaldilm installed.
+
+import gc
+import math
+import os
+import tempfile
+import threading
+import time
+import unittest
+
+import kaldilm
+import numpy as np
+
+TEST_DATA = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+                         '..', 'csrc', 'test_data')
+INPUT_ARPA = os.path.join(TEST_DATA, 'input.arpa')
+
+# A bigram model with an invalid logprob at line 12.
+BAD_ARPA = b'''\\data\\
+ngram 1=4
+ngram 2=2
+
+\\1-grams:
+-5.234679\ta -3.3
+-3.456783\tb
+0.0000000\t<s> -2.5
+-4.333333\t</s>
+
+\\2-grams:
+x\ta b -3.23
+-1.30490\t<s> a -4.2
+
+\\end\\
+'''
+
+
+def make_arpa(num_words: int, num_bigrams: int) -> bytes:
+    '''Return a bigram model with num_words words and num_bigrams bigrams,
+    sorted by their histories.'''
+    lines = ['\\data\\', f'ngram 1={num_words + 2}',
+             f'ngram 2={num_bigrams}', '', '\\1-grams:',
+             '-1.0\t<s>\t-0.5', '-2.0\t</s>']
+    lines += [f'-{2 + i % 7}.5\tw{i}\t-0.25' for i in range(num_words)]
+    lines += ['', '\\2-grams:']
+    per_history = max(1, num_bigrams // num_words)
+    for i in range(num_bigrams):
+        h = i // per_history
+        w = (h * 31 + i % per_history * 7) % num_words
+        lines.append(f'-{1 + i % 5}.25\tw{h} w{w}')
+    lines += ['', '\\end\\', '']
+    return '\n'.join(lines).encode()
+
+
+class TestArpa2Fst(unittest.TestCase):
+
+    def setUp(self):
+        self.tmp_dir = tempfile.TemporaryDirectory()
+
+    def tearDown(self):
+        self.tmp_dir.cleanup()
+
+    def write_file(self, name: str, data: bytes) -> str:
+        filename = os.path.join(self.tmp_dir.name, name)
+        with open(filename, 'wb') as f:
+            f.write(data)
+        return filename
+
+    def test_invalid_arpa_raises(self):
+        with self.assertRaisesRegex(RuntimeError, 'line 12'):
+            kaldilm.arpa2fst(BAD_ARPA, disambig_symbol='#0')
+
+    def test_batch_fails_one_job_at_a_time(self):
+        expected = kaldilm.arpa2fst(INPUT_ARPA, disambig_symbol='#0')
+        jobs = [
+            dict(input_arpa=INPUT_ARPA, disambig_symbol='#0'),
+            dict(input_arpa=BAD_ARPA, disambig_symbol='#0'),
+            dict(input_arpa=INPUT_ARPA, disambig_symbol='#0'),
+        ]
+        for num_workers in (1, 3):
+            results = kaldilm.arpa2fst_batch(jobs, num_workers=num_workers)
+            self.assertEqual(len(results), 3)
+            for i in (0, 2):
+                text, stats = results[i]
+                self.assertEqual(text, expected)
+                self.assertEqual(stats['ngrams'], [4, 2, 2])
+            error, stats = results[1]
+            self.assertIsInstance(error, RuntimeError)
+            self.assertIn('line 12', str(error))
+            self.assertEqual(stats, {})
+
+    def test_pipeline_matches_single_thread(self):
+        # With num_threads > 1, the n-grams are passed from the parser to
+        # the thread building the FST through a queue. The model must be
+        # large enough for the queue to fill up.
+        big_arpa = self.write_file(
+            'big.arpa', make_arpa(num_words=2000, num_bigrams=100000))
+        for arpa in (INPUT_ARPA, big_arpa):
+            for kwargs in (dict(), dict(const_fst=True),
+                           dict(disambig_symbol='#0',
+                                remove_redundant_states=True)):
+                expected = kaldilm.arpa2fst(arpa, num_threads=1, **kwargs)
+                for num_threads in (2, 4):
+                    with self.subTest(arpa=arpa,
+                                      num_threads=num_threads,
+                                      **kwargs):
+                        text = kaldilm.arpa2fst(arpa,
+                                                num_threads=num_threads,
+                                                **kwargs)
+                        self.assertEqual(text, expected)
+
+    def test_compiled_fst_text(self):
+        for kwargs in (dict(), dict(const_fst=True),
+                       dict(const_fst=True, output_fst=os.path.join(
+                           self.tmp_dir.name, 'G.fst'))):
+            with self.subTest(**kwargs):
+                expected = kaldilm.arpa2fst(INPUT_ARPA, **kwargs)
+                stats = {}
+                compiled = kaldilm.arpa2fst(INPUT_ARPA,
+                                            return_text=False,
+                                            stats=stats,
+                                            **kwargs)
+                self.assertIsInstance(compiled, kaldilm.CompiledFst)
+                self.assertNotIn('print', [p['name'] for p in stats['phases']])
+                self.assertEqual(compiled.num_states, stats['num_states'])
+                self.assertEqual(compiled.num_arcs, stats['num_arcs'])
+                for num_threads in (1, 3):
+                    self.assertEqual(compiled.text(num_threads=num_threads),
+                                     expected)
+                    filename = os.path.join(self.tmp_dir.name, 'G.txt')
+                    compiled.write_text(filename, num_threads=num_threads)
+                    with open(filename) as f:
+                        self.assertEqual(f.read(), expected)
+
+    def test_to_arrays(self):
+        for kwargs in (dict(), dict(const_fst=True)):
+            with self.subTest(**kwargs):
+                text = kaldilm.arpa2fst(INPUT_ARPA, **kwargs)
+                G = kaldilm.arpa2fst(INPUT_ARPA, return_text=False, **kwargs)
+                num_states, num_arcs = G.num_states, G.num_arcs
+                arrays = G.to_arrays(num_threads=2)
+                self.assertEqual(set(arrays), {
+                    'start', 'row_splits', 'src', 'dst', 'ilabel', 'olabel',
+                    'weight', 'final_weight'
+                })
+                dtypes = dict(row_splits=np.int64, src=np.int32,
+                              dst=np.int32, ilabel=np.int32,
+                              olabel=np.int32, weight=np.float32,
+                              final_weight=np.float32)
+                a = {}
+                for name, dtype in dtypes.items():
+                    a[name] = np.asarray(arrays[name])
+                    self.assertEqual(a[name].dtype, dtype)
+                    self.assertEqual(len(a[name]), len(arrays[name]))
+                    # The buffer is used in place, not copied.
+                    self.assertTrue(np.shares_memory(
+                        a[name], np.frombuffer(arrays[name], dtype=dtype)))
+
+                self.assertEqual(len(a['row_splits']), num_states + 1)
+                self.assertEqual(a['row_splits'][0], 0)
+                self.assertEqual(a['row_splits'][-1], num_arcs)
+                np.testing.assert_array_equal(
+                    np.diff(a['row_splits']),
+                    np.bincount(a['src'], minlength=num_states))
+
+                # Lines of the text are arcs "src dst ilabel olabel
+                # [weight]", or final states "state [weight]".
+                fields = [line.split() for line in text.split('\n') if line]
+                arcs = sorted(tuple(map(int, f[:4])) for f in fields
+                              if len(f) >= 4)
+                finals = {int(f[0]) for f in fields if len(f) <= 2}
+                self.assertEqual(arrays['start'], int(fields[0][0]))
+                self.assertEqual(
+                    sorted(zip(a['src'].tolist(), a['dst'].tolist(),
+                               a['ilabel'].tolist(), a['olabel'].tolist())),
+                    arcs)
+                np.testing.assert_array_equal(
+                    np.isinf(a['final_weight']),
+                    [s not in finals for s in range(num_states)])
+
+                # The arrays outlive the FST and the dict.
+                expected = {name: v.copy() for name, v in a.items()}
+                del G, arrays
+                gc.collect()
+                for name, v in a.items():
+                    np.testing.assert_array_equal(v, expected[name])
+
+    def test_in_memory_arpa(self):
+        expected = kaldilm.arpa2fst(INPUT_ARPA, disambig_symbol='#0')
+        with open(INPUT_ARPA, 'rb') as f:
+            data = f.read()
+        for arpa in (data, bytearray(data), memoryview(data)):
+            with self.subTest(type=type(arpa).__name__):
+                text = kaldilm.arpa2fst(arpa, disambig_symbol='#0')
+                self.assertEqual(text, expected)
+
+    def test_symbol_table_objects(self):
+        symbols_txt = os.path.join(self.tmp_dir.name, 'words.txt')
+        symbols = {}
+        kaldilm.arpa2fst(INPUT_ARPA,
+                         disambig_symbol='#0',
+                         write_symbol_table=symbols_txt,
+                         symbols=symbols)
+        # The model gets the same ids from the file it wrote, and from the
+        # same table as a dict, or as a list of symbols in the order of
+        # their ids.
+        expected = kaldilm.arpa2fst(INPUT_ARPA,
+                                    disambig_symbol='#0',
+                                    read_symbol_table=symbols_txt)
+        by_id = sorted(symbols, key=symbols.get)
+        self.assertEqual([symbols[s] for s in by_id], list(range(len(by_id))))
+        with open(INPUT_ARPA, 'rb') as f:
+            data = f.read()
+        for table in (symbols, by_id):
+            for arpa in (INPUT_ARPA, data):
+                with self.subTest(table=type(table).__name__,
+                                  arpa=type(arpa).__name__):
+                    text = kaldilm.arpa2fst(arpa,
+                                            disambig_symbol='#0',
+                                            read_symbol_table=table)
+                    self.assertEqual(text, expected)
+
+        with self.assertRaisesRegex(ValueError, 'Duplicate symbol'):
+            kaldilm.arpa2fst(INPUT_ARPA, read_symbol_table=by_id + ['a'])
+        with self.assertRaisesRegex(ValueError, 'Duplicate id 5'):
+            kaldilm.arpa2fst(INPUT_ARPA,
+                             read_symbol_table=dict(symbols, x=5, y=5))
+        with self.assertRaisesRegex(ValueError, 'Negative id'):
+            kaldilm.arpa2fst(INPUT_ARPA,
+                             read_symbol_table=dict(symbols, x=-1))
+
+    def test_read_ngrams(self):
+        batches = list(kaldilm.read_ngrams(INPUT_ARPA, batch_size=3))
+        self.assertEqual([(order, len(words)) for order, words, _, _ in batches],
+                         [(1, 3), (1, 1), (2, 2), (3, 2)])
+        for order, words, logprobs, backoffs in batches:
+            self.assertEqual(words.dtype, np.int32)
+            self.assertEqual(words.shape, (len(words), order))
+            self.assertEqual(logprobs.dtype, np.float32)
+            self.assertEqual(logprobs.shape, (len(words),))
+            self.assertEqual(backoffs.dtype, np.float32)
+            self.assertEqual(backoffs.shape, (len(words),))
+
+        reader = kaldilm.read_ngrams(INPUT_ARPA)
+        with self.assertRaisesRegex(RuntimeError, 'once all n-grams'):
+            reader.symbols()
+        batches = list(reader)
+        symbols = reader.symbols()
+        self.assertEqual(reader.stats()['ngrams'], [4, 2, 2])
+        # The ids are those arpa2fst() gives the words.
+        expected = {}
+        kaldilm.arpa2fst(INPUT_ARPA, symbols=expected)
+        self.assertEqual(symbols, expected)
+
+        order, words, logprobs, backoffs = batches[2]
+        self.assertEqual(order, 3)
+        np.testing.assert_array_equal(
+            words, [[symbols['<s>'], symbols['a'], symbols['b']],
+                    [symbols['a'], symbols['b'], symbols['</s>']]])
+        np.testing.assert_allclose(
+            logprobs, [-0.34958 * math.log(10), -0.23940 * math.log(10)],
+            rtol=1e-6)
+        np.testing.assert_array_equal(backoffs, [0, 0])
+
+    def test_read_ngrams_error(self):
+        # The unigrams before the error at line 12 are delivered first.
+        reader = kaldilm.read_ngrams(BAD_ARPA, batch_size=2)
+        orders = []
+        with self.assertRaisesRegex(RuntimeError, 'line 12'):
+            for order, words, _, _ in reader:
+                orders.append((order, len(words)))
+        self.assertEqual(orders, [(1, 2), (1, 2)])
+
+    def test_read_ngrams_stops_early(self):
+        arpa = self.write_file(
+            'big.arpa', make_arpa(num_words=20000, num_bigrams=400000))
+        start = time.monotonic()
+        num_ngrams = sum(len(words) for _, words, _, _ in
+                         kaldilm.read_ngrams(arpa, batch_size=1000))
+        elapsed = time.monotonic() - start
+        self.assertEqual(num_ngrams, 420002)
+
+        # Dropping the reader after the first batch must not parse the
+        # rest of the file.
+        reader = kaldilm.read_ngrams(arpa, batch_size=1000)
+        next(reader)
+        start = time.monotonic()
+        del reader
+        self.assertLess(time.monotonic() - start, elapsed / 2)
+
+    def test_gil_is_released(self):
+        arpa = make_arpa(num_words=20000, num_bigrams=400000)
+        done = threading.Event()
+        elapsed = []
+
+        def run():
+            start = time.monotonic()
+            kaldilm.arpa2fst(arpa, return_text=False)
+            elapsed.append(time.monotonic() - start)
+            done.set()
+
+        thread = threading.Thread(target=run)
+        thread.start()
+        # If the GIL were held while the model is compiled, this loop
+        # would be stalled for all of that time.
+        largest_gap = 0.0
+        last = time.monotonic()
+        while not done.is_set():
+            now = time.monotonic()
+            largest_gap = max(largest_gap, now - last)
+            last = now
+        thread.join()
+        self.assertLess(largest_gap, elapsed[0] / 2)
+
+
+if __name__ == '__main__':
+    unittest.main()